@@ -33,6 +33,14 @@
 #include <sstream>
 #include <utility>
 #include <cassert>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+#include <limits>
 
 #include "mdds/node.hpp"
 #include "mdds/flat_segment_tree_itr.hpp"
@@ -45,15 +53,386 @@
 
 namespace mdds {
 
+namespace __fst {
+
+/**
+ * Default trait of flat_segment_tree, which leaves out all optional data
+ * in the non-leaf nodes.  To enable any of them, pass a trait that defines
+ * the same members as the third template argument.
+ */
+struct default_trait
+{
+    /**
+     * A flag to determine whether or not the non-leaf nodes store the
+     * aggregate of the segments underneath them, which lets aggregate() and
+     * search_weight() run in O(log n) time with a valid tree.  It only
+     * takes effect for arithmetic value types.
+     */
+    constexpr static bool range_aggregate = false;
+
+    /**
+     * A flag to determine whether or not the non-leaf nodes store key
+     * offsets, which let shift_left() and shift_right() keep a valid tree
+     * valid in O(log n) time instead of invalidating it.
+     */
+    constexpr static bool lazy_shift = false;
+};
+
+/**
+ * Type used to sum the segment values weighted by their lengths.  It's the
+ * widest integer or floating point type that preserves the signedness of
+ * both the key and value types, so that the sum does not overflow where
+ * the product of the two types would.
+ */
+template<typename _Key, typename _Value, bool _Float = std::is_floating_point<std::common_type_t<_Key, _Value>>::value>
+struct weighted_sum
+{
+    typedef typename std::conditional<
+        std::is_signed<_Key>::value || std::is_signed<_Value>::value,
+        int64_t, uint64_t>::type type;
+};
+
+template<typename _Key, typename _Value>
+struct weighted_sum<_Key, _Value, true>
+{
+    typedef typename std::conditional<
+        std::is_same<std::common_type_t<_Key, _Value>, long double>::value,
+        long double, double>::type type;
+};
+
+/**
+ * Aggregate of the segments under a non-leaf node, or within a key range.
+ * It is only available for arithmetic value types.
+ */
+template<typename _Key, typename _Value, bool _Enabled = std::is_arithmetic<_Value>::value>
+struct range_aggregate
+{
+    typedef _Value sum_type; // placeholder to keep the method signatures valid.
+};
+
+template<typename _Key, typename _Value>
+struct range_aggregate<_Key, _Value, true>
+{
+    typedef typename weighted_sum<_Key, _Value>::type sum_type;
+
+    sum_type sum;       /// sum of the segment values weighted by their lengths.
+    _Value min_value;   /// minimum segment value.
+    _Value max_value;   /// maximum segment value.
+    size_t count;       /// number of segments.
+
+    range_aggregate() : sum(0), min_value(0), max_value(0), count(0) {}
+
+    void add_segment(_Key length, _Value value)
+    {
+        sum += sum_type(length) * sum_type(value);
+        if (!count || value < min_value)
+            min_value = value;
+        if (!count || max_value < value)
+            max_value = value;
+        ++count;
+    }
+
+    void add(const range_aggregate& r)
+    {
+        if (!r.count)
+            return;
+
+        sum += r.sum;
+        if (!count || r.min_value < min_value)
+            min_value = r.min_value;
+        if (!count || max_value < r.max_value)
+            max_value = r.max_value;
+        count += r.count;
+    }
+};
+
+/**
+ * Empty base of the non-leaf node values in place of a disabled member.
+ */
+struct no_nonleaf_data {};
+
+/**
+ * Key offset of a non-leaf node not yet applied to its child nodes.
+ */
+template<typename _Key, bool _Enabled>
+struct key_offset
+{
+    _Key delta;
+
+    key_offset() : delta(0) {}
+};
+
+template<typename _Key>
+struct key_offset<_Key, false>
+{
+    constexpr static _Key delta = 0; // shifts never leave any offsets.
+};
+
+/**
+ * Header of the binary state written by flat_segment_tree::save_state().
+ * It's followed by the default value, the keys of all leaf nodes, and the
+ * values of all segments.  Each of these sections starts at a multiple of
+ * 8 bytes, so that the arrays can be read in place from a memory-mapped
+ * buffer, and the whole state ends with a check byte of 0xFF.
+ */
+struct state_header
+{
+    uint16_t flags;         /// reserved, always 0.
+    uint8_t key_size;       /// size of the key type in bytes.
+    uint8_t value_size;     /// size of the value type in bytes.
+    uint32_t reserved;      /// reserved, always 0.
+    uint64_t segment_count; /// number of segments.
+};
+
+inline size_t get_state_section_size(size_t bytes)
+{
+    return (bytes + 7) & ~size_t(7);
+}
+
+/**
+ * Check the segment count stored in a state against the maximum number of
+ * segments whose key and value arrays can fit in the specified number of
+ * bytes.  This must pass before any section size gets computed from the
+ * count, as the computation may otherwise overflow.
+ */
+inline bool check_state_segment_count(uint64_t n, size_t segment_size, size_t max_bytes)
+{
+    return n <= max_bytes / segment_size;
+}
+
+template<typename _Key, typename _Value>
+bool search_segment_arrays(
+    const _Key* keys, const _Value* values, size_t n,
+    _Key key, _Value& value, _Key* start_key, _Key* end_key);
+
+}
+
+template<typename _Key, typename _Value, typename _Trait = __fst::default_trait>
+class flat_segment_tree;
+
+/**
+ * Immutable snapshot of a flat_segment_tree, created by
+ * flat_segment_tree::freeze().  It stores the keys and values of the
+ * segments in two contiguous arrays, and searches the sorted keys directly
+ * with a branchless binary search.  Since
+ * none of its methods modify its content, any number of threads can query
+ * the same instance concurrently without synchronization.
+ */
 template<typename _Key, typename _Value>
+class frozen_flat_segment_tree
+{
+    template<typename, typename, typename>
+    friend class flat_segment_tree;
+
+public:
+    typedef _Key    key_type;
+    typedef _Value  value_type;
+    typedef size_t  size_type;
+
+    /**
+     * Segment stored in the container, with its start key (inclusive), end
+     * key (non-inclusive) and value.
+     */
+    struct segment_type
+    {
+        key_type start;
+        key_type end;
+        value_type value;
+    };
+
+    /**
+     * Default constructor creates an empty instance with no segments.
+     */
+    frozen_flat_segment_tree();
+
+    /**
+     * Search for the value associated with a key.
+     *
+     * @param key key value
+     * @param value value associated with key specified gets stored upon
+     *              successful search.
+     * @param start_key pointer to a variable where the start key value of the
+     *                  segment that contains the key gets stored upon
+     *                  successful search.
+     * @param end_key pointer to a varaible where the end key value of the
+     *                segment that contains the key gets stored upon
+     *                successful search.
+     * @return true if the key is within the range of the container,
+     *         otherwise false.
+     */
+    bool search(key_type key, value_type& value, key_type* start_key = nullptr, key_type* end_key = nullptr) const;
+
+    /**
+     * Get the segment at the specified position.
+     *
+     * @param pos position of the segment, which must be less than the value
+     *            returned by size().
+     *
+     * @return segment at the specified position.
+     */
+    segment_type get_segment(size_type pos) const;
+
+    /**
+     * @return number of segments stored.
+     */
+    size_type size() const
+    {
+        return m_values.size();
+    }
+
+    bool empty() const
+    {
+        return m_values.empty();
+    }
+
+    key_type min_key() const
+    {
+        return m_keys.front();
+    }
+
+    key_type max_key() const
+    {
+        return m_keys.back();
+    }
+
+    value_type default_value() const
+    {
+        return m_init_val;
+    }
+
+private:
+    frozen_flat_segment_tree(std::vector<key_type>&& keys, std::vector<value_type>&& values, const value_type& init_val);
+
+private:
+    /** Start keys of all segments, followed by the end key of the last one. */
+    std::vector<key_type> m_keys;
+    std::vector<value_type> m_values;
+
+    value_type m_init_val;
+};
+
+/**
+ * Read-only view of the binary state written by
+ * flat_segment_tree::save_state().  It answers queries directly from the
+ * buffer without copying it, so the buffer can be a memory-mapped file.
+ * The buffer must stay alive and unmodified while the view is in use, and
+ * must be aligned to at least 8 bytes.  Like frozen_flat_segment_tree, it
+ * can be queried by any number of threads concurrently.
+ */
+template<typename _Key, typename _Value>
+class flat_segment_tree_view
+{
+public:
+    typedef _Key    key_type;
+    typedef _Value  value_type;
+    typedef size_t  size_type;
+    typedef typename frozen_flat_segment_tree<_Key, _Value>::segment_type segment_type;
+
+    /**
+     * Constructor that takes the buffer storing the state.
+     *
+     * @param buffer pointer to the first byte of the state.
+     * @param size size of the buffer in bytes.  It may be larger than the
+     *             size of the state.
+     *
+     * @exception mdds::invalid_arg_error if the buffer doesn't store a valid
+     *            state for this key and value types, or is not properly
+     *            aligned.
+     */
+    flat_segment_tree_view(const char* buffer, size_type size);
+
+    /**
+     * Search for the value associated with a key.
+     *
+     * @param key key value
+     * @param value value associated with key specified gets stored upon
+     *              successful search.
+     * @param start_key pointer to a variable where the start key value of the
+     *                  segment that contains the key gets stored upon
+     *                  successful search.
+     * @param end_key pointer to a varaible where the end key value of the
+     *                segment that contains the key gets stored upon
+     *                successful search.
+     * @return true if the key is within the range of the container,
+     *         otherwise false.
+     */
+    bool search(key_type key, value_type& value, key_type* start_key = nullptr, key_type* end_key = nullptr) const
+    {
+        return __fst::search_segment_arrays(m_keys, m_values, m_size, key, value, start_key, end_key);
+    }
+
+    /**
+     * Get the segment at the specified position.
+     *
+     * @param pos position of the segment, which must be less than the value
+     *            returned by size().
+     *
+     * @return segment at the specified position.
+     */
+    segment_type get_segment(size_type pos) const;
+
+    /**
+     * @return number of segments stored.
+     */
+    size_type size() const
+    {
+        return m_size;
+    }
+
+    key_type min_key() const
+    {
+        return m_keys[0];
+    }
+
+    key_type max_key() const
+    {
+        return m_keys[m_size];
+    }
+
+    value_type default_value() const
+    {
+        return *m_init_val;
+    }
+
+private:
+    const value_type* m_init_val;
+    const key_type* m_keys;
+    const value_type* m_values;
+    size_type m_size;
+};
+
+template<typename _Key, typename _Value, typename _Trait>
 class flat_segment_tree
 {
 public:
     typedef _Key    key_type;
     typedef _Value  value_type;
     typedef size_t  size_type;
+    typedef _Trait  trait_type;
+
+private:
+    constexpr static bool store_aggregate = trait_type::range_aggregate && std::is_arithmetic<value_type>::value;
+    constexpr static bool store_key_offset = trait_type::lazy_shift;
+
+public:
+
+    /**
+     * Aggregate of the segments within a key range, returned by
+     * aggregate().  It stores the sum of the segment values weighted by
+     * their lengths, the minimum and maximum segment values, and the number
+     * of segments.  Its members are only available for arithmetic value
+     * types.
+     */
+    typedef __fst::range_aggregate<key_type, value_type> aggregate_type;
 
+    /**
+     * The non-leaf nodes also store the aggregate of all segments
+     * underneath them, and the key offset not yet applied to their child
+     * nodes, when the trait enables them.
+     */
     struct nonleaf_value_type
+        : public std::conditional<store_aggregate, aggregate_type, __fst::no_nonleaf_data>::type
+        , public __fst::key_offset<key_type, store_key_offset>
     {
         key_type low;   /// low range value (inclusive)
         key_type high;  /// high range value (non-inclusive)
@@ -100,6 +479,12 @@ public:
 
     typedef __st::nonleaf_node<flat_segment_tree> nonleaf_node;
 
+    typedef __st::node_pool<flat_segment_tree> node_pool;
+
+    typedef frozen_flat_segment_tree<key_type, value_type> frozen_type;
+
+    typedef flat_segment_tree_view<key_type, value_type> view_type;
+
     struct fill_nonleaf_value_handler
     {
         void operator() (__st::nonleaf_node<flat_segment_tree>& _self, const __st::node_base* left_node, const __st::node_base* right_node)
@@ -143,6 +528,30 @@ public:
                     static_cast<const node*>(left_node)->value_leaf.key :
                     static_cast<const nonleaf_node*>(left_node)->value_nonleaf.high;
             }
+
+            if constexpr (store_aggregate)
+            {
+                aggregate_type& agg = _self.value_nonleaf;
+                agg = aggregate_type();
+                add_child_aggregate(agg, left_node);
+                if (right_node)
+                    add_child_aggregate(agg, right_node);
+            }
+        }
+
+    private:
+        static void add_child_aggregate(aggregate_type& agg, const __st::node_base* child)
+        {
+            if (!child->is_leaf)
+            {
+                agg.add(static_cast<const nonleaf_node*>(child)->value_nonleaf);
+                return;
+            }
+
+            // The right-most leaf node doesn't start a segment.
+            const node* p = static_cast<const node*>(child);
+            if (p->next)
+                agg.add_segment(p->next->value_leaf.key - p->value_leaf.key, p->value_leaf.value);
         }
     };
 
@@ -181,6 +590,11 @@ private:
 
     friend struct ::mdds::__fst::itr_forward_handler<flat_segment_tree>;
     friend struct ::mdds::__fst::itr_reverse_handler<flat_segment_tree>;
+    friend class ::mdds::__fst::const_iterator_base<
+        flat_segment_tree, ::mdds::__fst::itr_forward_handler<flat_segment_tree> >;
+    friend class ::mdds::__fst::const_iterator_base<
+        flat_segment_tree, ::mdds::__fst::itr_reverse_handler<flat_segment_tree> >;
+    friend class ::mdds::__fst::const_segment_iterator<flat_segment_tree>;
 
 public:
     class const_iterator : public ::mdds::__fst::const_iterator_base<
@@ -312,22 +726,22 @@ public:
     /** 
      * Copy constructor only copies the leaf nodes.  
      */
-    flat_segment_tree(const flat_segment_tree<key_type, value_type>& r);
+    flat_segment_tree(const flat_segment_tree& r);
 
     ~flat_segment_tree();
 
     /**
       * Assignment only copies the leaf nodes.
       */
-    flat_segment_tree<key_type, value_type>&
-    operator=(const flat_segment_tree<key_type, value_type>& other);
+    flat_segment_tree&
+    operator=(const flat_segment_tree& other);
 
     /**
      * Swap the content of the tree with another instance.
      *
      * @param other instance of flat_segment_tree to swap content with.
      */
-    void swap(flat_segment_tree<key_type, value_type>& other);
+    void swap(flat_segment_tree& other);
 
     /**
      * Remove all stored segments except for the initial segment. The minimum
@@ -395,12 +809,74 @@ public:
     std::pair<const_iterator, bool>
     insert(const const_iterator& pos, key_type start_key, key_type end_key, value_type val);
 
+    /**
+     * Replace the entire content of the container with a sorted sequence of
+     * segments, and build the tree.  The leaf nodes are built directly from
+     * the sequence in a single pass, with adjacent segments of equal value
+     * merged, and the gaps between the segments filled with the default
+     * value.  The minimum and maximum keys and the default value are
+     * retained.
+     *
+     * Each element of the sequence must have <code>start</code>,
+     * <code>end</code> and <code>value</code> members, as does the value
+     * type of const_segment_iterator.  The segments must be sorted by their
+     * start keys and must not overlap.  Empty segments are ignored, and
+     * segments that extend outside the range of the container get clipped.
+     *
+     * @param first iterator pointing to the first segment in the sequence.
+     * @param last iterator pointing to the position past the last segment
+     *             in the sequence.
+     *
+     * @exception mdds::invalid_arg_error if the segments are not sorted or
+     *            overlap each other.  The content of the container is left
+     *            unchanged in this case.
+     */
+    template<typename _Iter>
+    void assign(_Iter first, _Iter last);
+
+    /**
+     * Combine two containers into a new one in a single pass over the leaf
+     * nodes of both, in O(n + m) time.  Each segment of the new container
+     * gets the value computed from the values of both containers over that
+     * segment, and adjacent segments of equal value get merged.  For
+     * instance, overlaying one container onto another takes a function
+     * that returns the second value unless it's the default value.  The
+     * tree of the new container is not built.
+     *
+     * @param left first container.
+     * @param right second container.  It must have the same minimum and
+     *              maximum keys as the first one.
+     * @param func binary function that takes a value from the first
+     *             container and a value from the second, and returns the
+     *             combined value.  The default value of the new container
+     *             is the combination of the default values of both.
+     *
+     * @return new container storing the combined segments.
+     *
+     * @exception mdds::invalid_arg_error if the two containers have
+     *            different minimum or maximum keys.
+     */
+    template<typename _Func>
+    static flat_segment_tree merge(const flat_segment_tree& left, const flat_segment_tree& right, _Func func);
+
     /** 
      * Remove a segment specified by the start and end key values, and shift 
      * the remaining segments (i.e. those segments that come after the removed
      * segment) to left.  Note that the start and end positions of the segment 
      * being removed <b>must</b> be within the base segment span.
      *
+     * When the trait enables lazy_shift, the tree is valid, and the removal
+     * does not cause any segments to be removed or merged, the tree stays
+     * valid and only the non-leaf nodes
+     * along the boundaries of the shifted range get updated in O(log n)
+     * time.  The shifted key values are kept as offsets in the non-leaf
+     * nodes, and get applied to the leaf nodes by the next call that
+     * modifies the container or rebuilds the tree.  Until then, read-only
+     * access never modifies the container; iterators compute the shifted
+     * key value of each leaf node on the fly at an extra cost of O(log n)
+     * per node, and leaf-node searches go through the tree instead.
+     * Existing segment iterators become invalid after a shift.
+     *
      * @param start_key start position of the segment being removed.
      * @param end_key end position of the segment being removed. 
      */
@@ -417,6 +893,10 @@ public:
      *                        <i>not</i> be shifted.  This argument has no
      *                        effect if the position specified does not
      *                        coincide with any of the existing nodes.
+     *
+     * Like shift_left(), when the trait enables lazy_shift, the tree is valid
+     * and no segments get pushed out of the range, the tree stays valid and the shift runs in O(log n)
+     * time.
      */
     void shift_right(key_type pos, key_type size, bool skip_start_node);
 
@@ -461,11 +941,34 @@ public:
     std::pair<const_iterator, bool>
     search(const const_iterator& pos, key_type key, value_type& value, key_type* start_key = nullptr, key_type* end_key = nullptr) const;
 
+    /**
+     * Look up the values associated with a series of keys in one pass.  When
+     * the keys are sorted in ascending order, the first key is located via
+     * the tree (or via the incremental search index) if available, and the
+     * rest are located by walking the leaf nodes forward from there, which
+     * costs O(log n + m + k) for k keys spanning m leaf nodes.  Keys that are
+     * not sorted get sorted first, and their values get scattered back to
+     * the original order.
+     *
+     * @param keys_begin forward iterator pointing to the first key.
+     * @param keys_end forward iterator pointing to the position past the
+     *                 last key.
+     * @param out output iterator to which the value for each key gets
+     *            written, in the same order as the keys.  Keys that are
+     *            outside the range of the container get the default value.
+     *
+     * @return number of keys that are within the range of the container.
+     */
+    template<typename _KeyIter, typename _OutIter>
+    size_type search_many(_KeyIter keys_begin, _KeyIter keys_end, _OutIter out) const;
+
     /**
      * Perform tree search for a value associated with a key.  This method 
      * assumes that the tree is valid.  Call is_tree_valid() to find out
      * whether the tree is valid, and build_tree() to build a new tree in case
-     * it's not.
+     * it's not.  When incremental search is enabled, this method instead
+     * uses the incrementally maintained leaf index, and the validity of the
+     * tree is not required.
      * 
      * @param key key value
      * @param value value associated with key specified gets stored upon
@@ -483,13 +986,97 @@ public:
     std::pair<const_iterator, bool>
     search_tree(key_type key, value_type& value, key_type* start_key = nullptr, key_type* end_key = nullptr) const;
 
+    /**
+     * Perform tree search for a value associated with a key, using the
+     * implicit array index built by build_tree_array().  The index stores
+     * the leaf keys contiguously in Eytzinger (breadth-first) order, and the
+     * descent through it is branchless.  It returns the same result as
+     * search_tree(), but typically runs faster on large trees as it avoids
+     * chasing non-leaf node pointers.  When the index is not available, it
+     * falls back to search_tree().  Like search_tree(), this method assumes
+     * that the tree is valid.
+     *
+     * @param key key value
+     * @param value value associated with key specified gets stored upon
+     *              successful search.
+     * @param start_key pointer to a variable where the start key value of the
+     *                  segment that contains the key gets stored upon
+     *                  successful search.
+     * @param end_key pointer to a varaible where the end key value of the
+     *                segment that contains the key gets stored upon
+     *                successful search.
+     * @return a pair of const_iterator corresponding to the start position of
+     *         the segment containing the key, and a boolean value indicating
+     *         whether or not the search has been successful.
+     */
+    std::pair<const_iterator, bool>
+    search_tree_array(key_type key, value_type& value, key_type* start_key = nullptr, key_type* end_key = nullptr) const;
+
+    /**
+     * Compute the aggregate of the segment values over a key range.  The sum
+     * is weighted by the length of each segment's overlap with the range,
+     * and the count is the number of segments that overlap the range.  When
+     * the trait enables range_aggregate and the tree is valid, this method
+     * runs in O(log n) time using the aggregates stored in the non-leaf
+     * nodes.  Otherwise it walks the leaf nodes within the range.  This
+     * method is only available for arithmetic value types.
+     *
+     * @param start_key start value of the range (inclusive).
+     * @param end_key end value of the range (not inclusive).
+     *
+     * @return aggregate of the segments within the range.  The part of the
+     *         range outside the container is ignored.  If the range is
+     *         empty, the count of the returned aggregate is zero.
+     */
+    aggregate_type aggregate(key_type start_key, key_type end_key) const;
+
+    /**
+     * Find the key at which the cumulative weight, counted from the minimum
+     * key, reaches the specified weight.  Each key contributes the value of
+     * its segment to the cumulative weight, so this is the inverse of the
+     * weighted sum of aggregate(min_key(), key).  For instance, when the
+     * values are row heights, this finds the row that contains a given
+     * pixel offset.  Keys whose segments have zero values never get
+     * returned.  When the trait enables range_aggregate and the tree is
+     * valid, this method runs in O(log n) time using the aggregates stored
+     * in the non-leaf nodes.  Otherwise it walks the leaf nodes.  This
+     * method is only available for arithmetic value
+     * types, and the values are assumed to be non-negative.
+     *
+     * @param weight cumulative weight to search for.
+     * @param key key whose cumulative weight range contains the specified
+     *            weight gets stored upon successful search.  With an
+     *            integral key type, this is the key k that satisfies
+     *            sum[min, k) <= weight < sum[min, k+1).
+     * @param start_weight pointer to a variable where the cumulative weight
+     *                     at the found key, i.e. sum[min, key), gets stored
+     *                     upon successful search.
+     *
+     * @return a pair of const_iterator corresponding to the start position of
+     *         the segment containing the found key, and a boolean value
+     *         indicating whether or not the search has been successful.  The
+     *         search fails when the weight is negative, or is equal to or
+     *         greater than the total weight of the container.
+     */
+    std::pair<const_iterator, bool>
+    search_weight(typename aggregate_type::sum_type weight, key_type& key,
+                  typename aggregate_type::sum_type* start_weight = nullptr) const;
+
     /**
      * Build a tree of non-leaf nodes based on the values stored in the leaf
      * nodes.  The tree must be valid before you can call the search_tree()
-     * method.
+     * or search_tree_array() method.
      */
     void build_tree();
 
+    /**
+     * Build the implicit array index used by search_tree_array(), and the
+     * tree if it's not valid.  The index takes additional memory
+     * proportional to the number of leaf nodes, and is therefore only built
+     * upon request.  It gets released when the tree becomes invalid.
+     */
+    void build_tree_array();
+
     /**
      * @return true if the tree is valid, otherwise false.  The tree must be
      *         valid before you can call the search_tree() method.
@@ -499,14 +1086,99 @@ public:
         return m_valid_tree;
     }
 
+    /**
+     * Create an immutable snapshot of the container.  The snapshot doesn't
+     * share any of its storage with the container, so the container can be
+     * modified while other threads query the snapshot.
+     *
+     * @return an instance of mdds::frozen_flat_segment_tree with the same
+     *         content.
+     */
+    frozen_type freeze() const;
+
+    /**
+     * Save the state of the instance to an output stream in a binary
+     * format.  It stores the minimum and maximum keys, the default value,
+     * and the keys and values of all leaf nodes as packed arrays.  The state
+     * can be restored by load_state(), or queried in place via view_type.
+     * Both the key and value types must be trivially copyable, and the state
+     * uses the byte order of the host.
+     *
+     * @param os output stream to write the state to.
+     */
+    void save_state(std::ostream& os) const;
+
+    /**
+     * Restore the state of the instance from an input stream, replacing its
+     * content, including the minimum and maximum keys and the default
+     * value.  The leaf nodes get created in a single pass, and the tree is
+     * not built.  The incremental search and pooled storage settings are
+     * retained.
+     *
+     * @param is input stream to load the state from.
+     *
+     * @exception mdds::invalid_arg_error if the stream doesn't store a valid
+     *            state for this key and value types.  The content of the
+     *            container is left unchanged in this case.
+     */
+    void load_state(std::istream& is);
+
+    /**
+     * Enable or disable incremental search.  When enabled, the container
+     * maintains a sorted index of its leaf nodes that stays valid across all
+     * insertions and shifts, and search_tree() uses that index in O(log n)
+     * time without requiring a call to build_tree() after each modification.
+     * The index is also used to locate the insertion position of each new
+     * segment, in place of the linear search of the leaf nodes.
+     * Each insertion updates only the part of the index that covers the
+     * modified segments, while each shift updates the part that follows the
+     * shift position.
+     *
+     * @param enabled true to enable incremental search, or false to disable
+     *                it and release the index.
+     */
+    void set_incremental_search(bool enabled);
+
+    /**
+     * @return true if incremental search is enabled, otherwise false.
+     */
+    bool is_incremental_search() const
+    {
+        return m_incremental_search;
+    }
+
+    /**
+     * Enable or disable pooled storage of the leaf nodes.  When enabled, the
+     * leaf nodes get allocated from contiguous chunks of memory owned by the
+     * container rather than individually.  A removed node gets destroyed
+     * right away, and its storage gets recycled for new ones.  When both
+     * the key and value types are trivially destructible, the container
+     * frees all chunks at once upon destruction without visiting the
+     * nodes.  Enabling or disabling it moves all existing leaf nodes into
+     * or out of the pool in key order, which invalidates all iterators as
+     * well as the tree.
+     *
+     * @param enabled true to enable pooled storage, or false to disable it.
+     */
+    void set_node_pool(bool enabled);
+
+    /**
+     * @return true if pooled storage of the leaf nodes is enabled, otherwise
+     *         false.
+     */
+    bool has_node_pool() const
+    {
+        return m_use_node_pool;
+    }
+
     /** 
      * Equality between two flat_segment_tree instances is evaluated by 
      * comparing the keys and the values of the leaf nodes only.  Neither the 
      * non-leaf nodes nor the validity of the tree is evaluated. 
      */
-    bool operator==(const flat_segment_tree<key_type, value_type>& r) const;
+    bool operator==(const flat_segment_tree& r) const;
 
-    bool operator !=(const flat_segment_tree<key_type, value_type>& r) const
+    bool operator !=(const flat_segment_tree& r) const
     {
         return !operator==(r);
     }
@@ -539,6 +1211,11 @@ public:
         return m_root_node;
     }
 
+    bool has_search_array() const
+    {
+        return !m_search_keys.empty();
+    }
+
     void dump_tree() const
     {
         using ::std::cout;
@@ -568,7 +1245,7 @@ public:
         long node_id = 0;
         while (cur_node)
         {
-            cout << "  node " << node_id++ << ": key = " << cur_node->value_leaf.key
+            cout << "  node " << node_id++ << ": key = " << get_leaf_key(cur_node.get())
                 << "; value = " << cur_node->value_leaf.value 
                 << endl;
             cur_node = cur_node->next;
@@ -595,7 +1272,7 @@ public:
                     // Position past the right-mode node.  Invalid.
                     return false;
     
-                if (cur_node->value_leaf.key != *itr)
+                if (get_leaf_key(cur_node) != *itr)
                     // Key values differ.
                     return false;
     
@@ -618,7 +1295,7 @@ public:
                     // Position past the left-mode node.  Invalid.
                     return false;
     
-                if (cur_node->value_leaf.key != *itr)
+                if (get_leaf_key(cur_node) != *itr)
                     // Key values differ.
                     return false;
     
@@ -689,14 +1366,14 @@ private:
             // new segment.
             return;
 
-        node_ptr new_node(new node);
+        node_ptr new_node(create_node());
         new_node->value_leaf.key   = start_key;
         new_node->value_leaf.value = m_init_val;
         new_node->prev = m_right_leaf->prev;
         new_node->next = m_right_leaf;
         m_right_leaf->prev->next = new_node;
         m_right_leaf->prev = new_node;
-        m_valid_tree = false;
+        invalidate_tree();
     }
 
     ::std::pair<const_iterator, bool>
@@ -705,6 +1382,8 @@ private:
     ::std::pair<const_iterator, bool>
         insert_to_pos(node_ptr& start_pos, key_type start_key, key_type end_key, value_type val);
 
+    void append_leaf_node(node_ptr& last_node, key_type key, const value_type& val);
+
     ::std::pair<const_iterator, bool>
         search_impl(const node* pos, key_type key, value_type& value, key_type* start_key, key_type* end_key) const;
 
@@ -712,6 +1391,13 @@ private:
 
     const node* get_insertion_pos_leaf(key_type key, const node* start_pos) const;
 
+    template<typename _KeyIter, typename _OutIter>
+    size_type search_sorted_keys(_KeyIter keys_begin, _KeyIter keys_end, _OutIter out) const;
+
+    void aggregate_tree(const __st::node_base* p, key_type frame, key_type start_key, key_type end_key, aggregate_type& result) const;
+
+    typename aggregate_type::sum_type get_node_weight(const __st::node_base* p) const;
+
     static void shift_leaf_key_left(node_ptr& begin_node, node_ptr& end_node, key_type shift_value)
     {
         node* cur_node_p = begin_node.get();
@@ -755,6 +1441,58 @@ private:
 
     void destroy();
 
+    node* create_node();
+
+    node* create_node(const node& r);
+
+    void shift_left_impl(key_type start_key, key_type end_key);
+
+    void shift_right_impl(key_type pos, key_type size, bool skip_start_node);
+
+    bool shift_left_lazy(key_type start_key, key_type end_key);
+
+    bool shift_right_lazy(key_type pos, key_type size, bool skip_start_node);
+
+    /**
+     * Parameters of a shift that gets applied to the tree lazily.
+     */
+    struct key_shift
+    {
+        key_type first_key; /// key of the first leaf node to shift.
+        key_type prev_key;  /// key of the leaf node before the first one.
+        key_type last_key;  /// key of the last leaf node before the rightmost one.
+        key_type delta;     /// amount of shift.
+    };
+
+    void shift_leaf_keys_lazy(const key_shift& shift);
+
+    void shift_subtree_keys(__st::node_base* p, key_type frame, const key_shift& shift);
+
+    void refresh_nonleaf_value(nonleaf_node& nonleaf, key_type frame, const key_shift& shift) const;
+
+    key_type get_leaf_key(const node* p) const;
+
+    void flush_pending_shifts();
+
+    void apply_pending_shift(__st::node_base* p, key_type delta);
+
+    void build_leaf_index();
+
+    size_t get_leaf_index_pos(key_type key) const;
+
+    size_t get_leaf_index_pos(const node* p) const;
+
+    void update_leaf_index(size_t first_pos, size_t last_pos);
+
+    ::std::pair<const_iterator, bool>
+        search_leaf_index(key_type key, value_type& value, key_type* start_key, key_type* end_key) const;
+
+    void fill_search_array(size_t pos, const node*& cur_node);
+
+    void release_search_array();
+
+    void invalidate_tree();
+
     /**
      * Check and optionally adjust the start and end key values if one of them
      * is out-of-bound.
@@ -765,18 +1503,49 @@ private:
     bool adjust_segment_range(key_type& start_key, key_type& end_key) const;
 
 private:
+    /**
+     * Storage of the leaf nodes when pooled storage is enabled.  Chunks
+     * with live nodes outlive the pool, so the destruction order of the
+     * members does not matter.
+     */
+    std::unique_ptr<node_pool> m_node_pool;
+
     std::vector<nonleaf_node> m_nonleaf_node_pool;
 
+    /**
+     * Leaf keys and their nodes laid out in Eytzinger order, for use in
+     * search_tree_array().  The first element of each is unused so that the
+     * children of the element at position i are at 2i and 2i+1.  Both are
+     * empty unless build_tree_array() has been called on the current tree.
+     */
+    std::vector<key_type> m_search_keys;
+    std::vector<const node*> m_search_nodes;
+
+    /**
+     * Leaf nodes in key order, maintained only while incremental search is
+     * enabled.  It stores node pointers rather than keys so that shifting
+     * the key values does not invalidate it.
+     */
+    std::vector<const node*> m_leaf_index;
+
     nonleaf_node* m_root_node;
     node_ptr   m_left_leaf;
     node_ptr   m_right_leaf;
     value_type m_init_val;
     bool       m_valid_tree;
+    bool       m_incremental_search;
+    bool       m_use_node_pool;
+
+    /**
+     * True when some of the non-leaf nodes store key offsets that have not
+     * yet been applied to the leaf nodes underneath.
+     */
+    bool m_pending_shift;
 };
 
-template<typename _Key, typename _Value>
+template<typename _Key, typename _Value, typename _Trait>
 void
-swap(flat_segment_tree<_Key, _Value>& left, flat_segment_tree<_Key, _Value>& right)
+swap(flat_segment_tree<_Key, _Value, _Trait>& left, flat_segment_tree<_Key, _Value, _Trait>& right)
 {
     left.swap(right);
 }
@@ -28,26 +28,147 @@
 namespace mdds {
 
 template<typename _Key, typename _Value>
-typename flat_segment_tree<_Key, _Value>::const_segment_iterator
-flat_segment_tree<_Key, _Value>::begin_segment() const
+frozen_flat_segment_tree<_Key, _Value>::frozen_flat_segment_tree() :
+    m_keys(1, key_type()), m_init_val()
 {
-    return const_segment_iterator(m_left_leaf.get(), m_left_leaf->next.get());
 }
 
 template<typename _Key, typename _Value>
-typename flat_segment_tree<_Key, _Value>::const_segment_iterator
-flat_segment_tree<_Key, _Value>::end_segment() const
+frozen_flat_segment_tree<_Key, _Value>::frozen_flat_segment_tree(
+    std::vector<key_type>&& keys, std::vector<value_type>&& values, const value_type& init_val) :
+    m_keys(std::move(keys)), m_values(std::move(values)), m_init_val(init_val)
 {
-    return const_segment_iterator(m_right_leaf.get(), nullptr);
+    assert(m_keys.size() == m_values.size() + 1);
 }
 
+namespace __fst {
+
 template<typename _Key, typename _Value>
-flat_segment_tree<_Key, _Value>::flat_segment_tree(key_type min_val, key_type max_val, value_type init_val) :
+bool search_segment_arrays(
+    const _Key* keys, const _Value* values, size_t n,
+    _Key key, _Value& value, _Key* start_key, _Key* end_key)
+{
+    if (!n || key < keys[0] || keys[n] <= key)
+        // key value is out-of-bound.
+        return false;
+
+    // Find the last segment that starts at or before the search key.  Each
+    // step halves the range without branching on the comparison, which the
+    // compiler turns into a conditional move.
+    const _Key* base = keys;
+    while (n > 1)
+    {
+        size_t half = n / 2;
+        base = (base[half] <= key) ? base + half : base;
+        n -= half;
+    }
+
+    size_t pos = base - keys;
+    value = values[pos];
+    if (start_key)
+        *start_key = keys[pos];
+    if (end_key)
+        *end_key = keys[pos+1];
+
+    return true;
+}
+
+}
+
+template<typename _Key, typename _Value>
+bool frozen_flat_segment_tree<_Key, _Value>::search(
+    key_type key, value_type& value, key_type* start_key, key_type* end_key) const
+{
+    return __fst::search_segment_arrays(
+        m_keys.data(), m_values.data(), m_values.size(), key, value, start_key, end_key);
+}
+
+template<typename _Key, typename _Value>
+typename frozen_flat_segment_tree<_Key, _Value>::segment_type
+frozen_flat_segment_tree<_Key, _Value>::get_segment(size_type pos) const
+{
+    assert(pos < m_values.size());
+    segment_type seg;
+    seg.start = m_keys[pos];
+    seg.end = m_keys[pos+1];
+    seg.value = m_values[pos];
+    return seg;
+}
+
+template<typename _Key, typename _Value>
+flat_segment_tree_view<_Key, _Value>::flat_segment_tree_view(const char* buffer, size_type size) :
+    m_init_val(nullptr), m_keys(nullptr), m_values(nullptr), m_size(0)
+{
+    static_assert(std::is_trivially_copyable<key_type>::value && std::is_trivially_copyable<value_type>::value,
+        "flat_segment_tree_view requires trivially copyable key and value types.");
+
+    __fst::state_header header;
+    if (size < sizeof(header))
+        throw invalid_arg_error("flat_segment_tree_view: the buffer is too small.");
+
+    std::memcpy(&header, buffer, sizeof(header));
+    if (header.flags || header.key_size != sizeof(key_type) || header.value_size != sizeof(value_type))
+        throw invalid_arg_error("flat_segment_tree_view: the buffer is not meant for this key and value types.");
+
+    // The segment count must fit in the buffer before any section size gets
+    // computed from it.
+    if (!__fst::check_state_segment_count(header.segment_count, sizeof(key_type) + sizeof(value_type), size))
+        throw invalid_arg_error("flat_segment_tree_view: the buffer doesn't store a valid state.");
+
+    size_t n = header.segment_count;
+    size_t init_val_pos = sizeof(header);
+    size_t keys_pos = init_val_pos + __fst::get_state_section_size(sizeof(value_type));
+    size_t values_pos = keys_pos + __fst::get_state_section_size((n + 1) * sizeof(key_type));
+    size_t end_pos = values_pos + __fst::get_state_section_size(n * sizeof(value_type));
+
+    if (!n || size <= end_pos || static_cast<uint8_t>(buffer[end_pos]) != 0xFF)
+        throw invalid_arg_error("flat_segment_tree_view: the buffer doesn't store a valid state.");
+
+    if (reinterpret_cast<uintptr_t>(buffer) % 8)
+        throw invalid_arg_error("flat_segment_tree_view: the buffer is not aligned to 8 bytes.");
+
+    m_init_val = reinterpret_cast<const value_type*>(buffer + init_val_pos);
+    m_keys = reinterpret_cast<const key_type*>(buffer + keys_pos);
+    m_values = reinterpret_cast<const value_type*>(buffer + values_pos);
+    m_size = n;
+}
+
+template<typename _Key, typename _Value>
+typename flat_segment_tree_view<_Key, _Value>::segment_type
+flat_segment_tree_view<_Key, _Value>::get_segment(size_type pos) const
+{
+    assert(pos < m_size);
+    segment_type seg;
+    seg.start = m_keys[pos];
+    seg.end = m_keys[pos+1];
+    seg.value = m_values[pos];
+    return seg;
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+typename flat_segment_tree<_Key, _Value, _Trait>::const_segment_iterator
+flat_segment_tree<_Key, _Value, _Trait>::begin_segment() const
+{
+    return const_segment_iterator(this, m_left_leaf.get(), m_left_leaf->next.get());
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+typename flat_segment_tree<_Key, _Value, _Trait>::const_segment_iterator
+flat_segment_tree<_Key, _Value, _Trait>::end_segment() const
+{
+    return const_segment_iterator(this, m_right_leaf.get(), nullptr);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+flat_segment_tree<_Key, _Value, _Trait>::flat_segment_tree(key_type min_val, key_type max_val, value_type init_val) :
     m_root_node(nullptr),
     m_left_leaf(new node),
     m_right_leaf(new node),
     m_init_val(init_val),
-    m_valid_tree(false)
+    m_valid_tree(false),
+    m_incremental_search(false),
+    m_use_node_pool(false),
+    m_pending_shift(false)
 {
     // we need to create two end nodes during initialization.
     m_left_leaf->value_leaf.key = min_val;
@@ -63,20 +184,31 @@ flat_segment_tree<_Key, _Value>::flat_segment_tree(key_type min_val, key_type ma
     m_right_leaf->value_leaf.value = init_val;
 }
 
-template<typename _Key, typename _Value>
-flat_segment_tree<_Key, _Value>::flat_segment_tree(const flat_segment_tree<_Key, _Value>& r) :
+template<typename _Key, typename _Value, typename _Trait>
+flat_segment_tree<_Key, _Value, _Trait>::flat_segment_tree(const flat_segment_tree<_Key, _Value, _Trait>& r) :
     m_root_node(nullptr),
-    m_left_leaf(new node(static_cast<const node&>(*r.m_left_leaf))),
+    m_left_leaf(static_cast<node*>(nullptr)),
     m_right_leaf(static_cast<node*>(nullptr)),
     m_init_val(r.m_init_val),
-    m_valid_tree(false) // tree is invalid because we only copy the leaf nodes.
+    m_valid_tree(false), // tree is invalid because we only copy the leaf nodes.
+    m_incremental_search(false),
+    m_use_node_pool(r.m_use_node_pool),
+    m_pending_shift(false)
 {
+    if (m_use_node_pool)
+        m_node_pool.reset(new node_pool);
+
+    m_left_leaf.reset(create_node(*r.m_left_leaf));
+
     // Copy all the leaf nodes from the original instance.
     node* src_node = r.m_left_leaf.get();
     node_ptr dest_node = m_left_leaf;
     while (true)
     {
-        dest_node->next.reset(new node(*src_node->next));
+        dest_node->next.reset(create_node(*src_node->next));
+
+        // The source key value may have a pending shift not yet applied.
+        dest_node->next->value_leaf.key = r.get_leaf_key(src_node->next.get());
 
         // Move on to the next source node.
         src_node = src_node->next.get();
@@ -94,39 +226,69 @@ flat_segment_tree<_Key, _Value>::flat_segment_tree(const flat_segment_tree<_Key,
             break;
         }
     }
+
+    if (r.m_incremental_search)
+        set_incremental_search(true);
 }
 
-template<typename _Key, typename _Value>
-flat_segment_tree<_Key, _Value>::~flat_segment_tree()
+template<typename _Key, typename _Value, typename _Trait>
+flat_segment_tree<_Key, _Value, _Trait>::~flat_segment_tree()
 {
+    if (m_use_node_pool && std::is_trivially_destructible<leaf_value_type>::value)
+    {
+        // All leaf nodes live in the pool, and destroying them has no side
+        // effects.  Free the whole pool at once instead.
+        m_left_leaf.detach();
+        m_right_leaf.detach();
+        m_node_pool->discard_all();
+        return;
+    }
+
     destroy();
 }
 
-template<typename _Key, typename _Value>
-flat_segment_tree<_Key, _Value>&
-flat_segment_tree<_Key, _Value>::operator=(const flat_segment_tree<_Key, _Value>& other)
+template<typename _Key, typename _Value, typename _Trait>
+flat_segment_tree<_Key, _Value, _Trait>&
+flat_segment_tree<_Key, _Value, _Trait>::operator=(const flat_segment_tree<_Key, _Value, _Trait>& other)
 {
-    flat_segment_tree<_Key, _Value> copy(other);
+    flat_segment_tree<_Key, _Value, _Trait> copy(other);
     swap(copy);
     return *this;
 }
 
-template<typename _Key, typename _Value>
+template<typename _Key, typename _Value, typename _Trait>
 void
-flat_segment_tree<_Key, _Value>::swap(flat_segment_tree<_Key, _Value>& other)
+flat_segment_tree<_Key, _Value, _Trait>::swap(flat_segment_tree<_Key, _Value, _Trait>& other)
 {
     m_nonleaf_node_pool.swap(other.m_nonleaf_node_pool);
+    m_search_keys.swap(other.m_search_keys);
+    m_search_nodes.swap(other.m_search_nodes);
     std::swap(m_root_node, other.m_root_node);
     std::swap(m_left_leaf, other.m_left_leaf);
     std::swap(m_right_leaf, other.m_right_leaf);
     std::swap(m_init_val, other.m_init_val);
     std::swap(m_valid_tree, other.m_valid_tree);
+    m_leaf_index.swap(other.m_leaf_index);
+    std::swap(m_incremental_search, other.m_incremental_search);
+    m_node_pool.swap(other.m_node_pool);
+    std::swap(m_use_node_pool, other.m_use_node_pool);
+    std::swap(m_pending_shift, other.m_pending_shift);
 }
 
-template<typename _Key, typename _Value>
+template<typename _Key, typename _Value, typename _Trait>
 void
-flat_segment_tree<_Key, _Value>::clear()
+flat_segment_tree<_Key, _Value, _Trait>::clear()
 {
+    if (m_use_node_pool)
+    {
+        // Replace the whole pool along with the leaf nodes.
+        flat_segment_tree new_tree(m_left_leaf->value_leaf.key, m_right_leaf->value_leaf.key, m_init_val);
+        new_tree.set_node_pool(true);
+        new_tree.set_incremental_search(m_incremental_search);
+        swap(new_tree);
+        return;
+    }
+
     // the border nodes should not be destroyed--add a ref to keep them alive
     node_ptr left(m_left_leaf);
     node_ptr right(m_right_leaf);
@@ -137,14 +299,19 @@ flat_segment_tree<_Key, _Value>::clear()
     // and construct the default tree
     __st::link_nodes<flat_segment_tree>(m_left_leaf, m_right_leaf);
     m_left_leaf->value_leaf.value = m_init_val;
-    m_valid_tree = false;
+    invalidate_tree();
+
+    if (m_incremental_search)
+        build_leaf_index();
 }
 
-template<typename _Key, typename _Value>
-::std::pair<typename flat_segment_tree<_Key, _Value>::const_iterator, bool>
-flat_segment_tree<_Key, _Value>::insert_segment_impl(key_type start_key, key_type end_key, value_type val, bool forward)
+template<typename _Key, typename _Value, typename _Trait>
+::std::pair<typename flat_segment_tree<_Key, _Value, _Trait>::const_iterator, bool>
+flat_segment_tree<_Key, _Value, _Trait>::insert_segment_impl(key_type start_key, key_type end_key, value_type val, bool forward)
 {
-    typedef std::pair<typename flat_segment_tree<_Key, _Value>::const_iterator, bool> ret_type;
+    typedef std::pair<typename flat_segment_tree<_Key, _Value, _Trait>::const_iterator, bool> ret_type;
+
+    flush_pending_shifts();
 
     if (!adjust_segment_range(start_key, end_key))
         return ret_type(const_iterator(this, true), false);
@@ -153,7 +320,13 @@ flat_segment_tree<_Key, _Value>::insert_segment_impl(key_type start_key, key_typ
     // start value.
 
     node_ptr start_pos;
-    if (forward)
+    if (m_incremental_search)
+    {
+        // Use the leaf index to skip the linear search.
+        const node* p = m_leaf_index[get_leaf_index_pos(start_key)];
+        start_pos.reset(const_cast<node*>(p));
+    }
+    else if (forward)
     {
         const node* p = get_insertion_pos_leaf(start_key, m_left_leaf.get());
         start_pos.reset(const_cast<node*>(p));
@@ -176,9 +349,9 @@ flat_segment_tree<_Key, _Value>::insert_segment_impl(key_type start_key, key_typ
     return insert_to_pos(start_pos, start_key, end_key, val);
 }
 
-template<typename _Key, typename _Value>
-::std::pair<typename flat_segment_tree<_Key, _Value>::const_iterator, bool>
-flat_segment_tree<_Key, _Value>::insert_to_pos(
+template<typename _Key, typename _Value, typename _Trait>
+::std::pair<typename flat_segment_tree<_Key, _Value, _Trait>::const_iterator, bool>
+flat_segment_tree<_Key, _Value, _Trait>::insert_to_pos(
     node_ptr& start_pos, key_type start_key, key_type end_key, value_type val)
 {
     node_ptr end_pos;
@@ -189,6 +362,16 @@ flat_segment_tree<_Key, _Value>::insert_to_pos(
     if (!end_pos)
         end_pos = m_right_leaf;
 
+    // The nodes before the start position and after the end position are
+    // left intact.  Record their positions in the leaf index so that only
+    // the part in between needs updating.
+    size_t index_first = 0, index_last = 0;
+    if (m_incremental_search)
+    {
+        index_first = start_pos->prev ? get_leaf_index_pos(start_pos->prev.get()) : 0;
+        index_last = end_pos->next ? get_leaf_index_pos(end_pos->next.get()) : get_leaf_index_pos(end_pos.get());
+    }
+
     node_ptr new_start_node;
     value_type old_value;
 
@@ -225,7 +408,7 @@ flat_segment_tree<_Key, _Value>::insert_to_pos(
     else
     {
         // Insert a new node before the insertion position node.
-        node_ptr new_node(new node);
+        node_ptr new_node(create_node());
         new_node->value_leaf.key = start_key;
         new_node->value_leaf.value = val;
         new_start_node = new_node;
@@ -288,7 +471,7 @@ flat_segment_tree<_Key, _Value>::insert_to_pos(
     else
     {
         // Insert a new node before the insertion position node.
-        node_ptr new_node(new node);
+        node_ptr new_node(create_node());
         new_node->value_leaf.key = end_key;
         new_node->value_leaf.value = old_value;
 
@@ -301,17 +484,23 @@ flat_segment_tree<_Key, _Value>::insert_to_pos(
     }
 
     if (changed)
-        m_valid_tree = false;
+    {
+        invalidate_tree();
+        if (m_incremental_search)
+            update_leaf_index(index_first, index_last);
+    }
 
     return ::std::pair<const_iterator, bool>(
         const_iterator(this, new_start_node.get()), changed);
 }
 
-template<typename _Key, typename _Value>
-::std::pair<typename flat_segment_tree<_Key, _Value>::const_iterator, bool>
-flat_segment_tree<_Key, _Value>::insert(
+template<typename _Key, typename _Value, typename _Trait>
+::std::pair<typename flat_segment_tree<_Key, _Value, _Trait>::const_iterator, bool>
+flat_segment_tree<_Key, _Value, _Trait>::insert(
     const const_iterator& pos, key_type start_key, key_type end_key, value_type val)
 {
+    flush_pending_shifts();
+
     const node* p = pos.get_pos();
     if (!p || this != pos.get_parent())
     {
@@ -329,7 +518,7 @@ flat_segment_tree<_Key, _Value>::insert(
 
     if (!adjust_segment_range(start_key, end_key))
     {
-        typedef std::pair<typename flat_segment_tree<_Key, _Value>::const_iterator, bool> ret_type;
+        typedef std::pair<typename flat_segment_tree<_Key, _Value, _Trait>::const_iterator, bool> ret_type;
         return ret_type(const_iterator(this, true), false);
     }
 
@@ -338,8 +527,147 @@ flat_segment_tree<_Key, _Value>::insert(
     return insert_to_pos(start_pos, start_key, end_key, val);
 }
 
-template<typename _Key, typename _Value>
-void flat_segment_tree<_Key, _Value>::shift_left(key_type start_key, key_type end_key)
+template<typename _Key, typename _Value, typename _Trait>
+template<typename _Iter>
+void flat_segment_tree<_Key, _Value, _Trait>::assign(_Iter first, _Iter last)
+{
+    key_type min_key = m_left_leaf->value_leaf.key;
+    key_type max_key = m_right_leaf->value_leaf.key;
+
+    // Build the new leaf nodes in a separate instance, so that the content
+    // of this instance stays intact in case of an exception.
+    flat_segment_tree new_tree(min_key, max_key, m_init_val);
+    new_tree.set_node_pool(m_use_node_pool);
+
+    node_ptr last_node = new_tree.m_left_leaf;
+    auto append_node = [&new_tree, &last_node](key_type key, const value_type& val)
+    {
+        new_tree.append_leaf_node(last_node, key, val);
+    };
+
+    key_type cur_end = min_key;
+    for (; first != last; ++first)
+    {
+        const auto& seg = *first;
+        key_type start_key = seg.start;
+        key_type end_key = seg.end;
+        if (!new_tree.adjust_segment_range(start_key, end_key) || start_key == end_key)
+            // Empty, or out-of-bound segment.
+            continue;
+
+        if (start_key < cur_end)
+            throw invalid_arg_error("flat_segment_tree::assign: segments are not sorted or overlap each other.");
+
+        if (cur_end < start_key)
+            // Fill the gap with the default value.
+            append_node(cur_end, m_init_val);
+
+        append_node(start_key, seg.value);
+        cur_end = end_key;
+    }
+
+    if (cur_end < max_key)
+        append_node(cur_end, m_init_val);
+
+    if (m_incremental_search)
+        new_tree.set_incremental_search(true);
+
+    new_tree.build_tree();
+    swap(new_tree);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+template<typename _Func>
+flat_segment_tree<_Key, _Value, _Trait>
+flat_segment_tree<_Key, _Value, _Trait>::merge(
+    const flat_segment_tree& left, const flat_segment_tree& right, _Func func)
+{
+    key_type min_key = left.m_left_leaf->value_leaf.key;
+    key_type max_key = left.m_right_leaf->value_leaf.key;
+    if (min_key != right.m_left_leaf->value_leaf.key || max_key != right.m_right_leaf->value_leaf.key)
+        throw invalid_arg_error("flat_segment_tree::merge: the two containers have different key ranges.");
+
+    flat_segment_tree new_tree(min_key, max_key, func(left.m_init_val, right.m_init_val));
+    new_tree.set_node_pool(left.m_use_node_pool);
+
+    // Walk both chains of leaf nodes in parallel.  Each step ends at the
+    // nearer of the next nodes of the two.
+    const node* node1 = left.m_left_leaf.get();
+    const node* node2 = right.m_left_leaf.get();
+    node_ptr last_node = new_tree.m_left_leaf;
+    key_type cur_key = min_key;
+
+    while (cur_key < max_key)
+    {
+        new_tree.append_leaf_node(last_node, cur_key, func(node1->value_leaf.value, node2->value_leaf.value));
+
+        key_type next_key1 = left.get_leaf_key(node1->next.get());
+        key_type next_key2 = right.get_leaf_key(node2->next.get());
+        cur_key = std::min(next_key1, next_key2);
+        if (next_key1 == cur_key)
+            node1 = node1->next.get();
+        if (next_key2 == cur_key)
+            node2 = node2->next.get();
+    }
+
+    return new_tree;
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::append_leaf_node(node_ptr& last_node, key_type key, const value_type& val)
+{
+    if (last_node->value_leaf.key == key)
+    {
+        // This can only happen to the left-most leaf node.
+        assert(!last_node->prev);
+        last_node->value_leaf.value = val;
+        return;
+    }
+
+    if (last_node->value_leaf.value == val)
+        // Extend the last segment.
+        return;
+
+    // Keep the chain linked to the right-most leaf node at all times, for
+    // the instance to be destroyed properly in case of an exception.
+    node_ptr new_node(create_node());
+    new_node->value_leaf.key = key;
+    new_node->value_leaf.value = val;
+    __st::link_nodes<flat_segment_tree>(last_node, new_node);
+    __st::link_nodes<flat_segment_tree>(new_node, m_right_leaf);
+    last_node = new_node;
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::shift_left(key_type start_key, key_type end_key)
+{
+    if constexpr (store_key_offset)
+    {
+        if (shift_left_lazy(start_key, end_key))
+            return;
+    }
+
+    flush_pending_shifts();
+
+    if (!m_incremental_search)
+    {
+        shift_left_impl(start_key, end_key);
+        return;
+    }
+
+    // Only the nodes at or after the start key get moved or removed, plus
+    // the node that may get appended before the rightmost node.
+    size_t index_first = get_leaf_index_pos(start_key);
+    if (index_first > 0)
+        --index_first;
+    index_first = std::min(index_first, m_leaf_index.size() - 2);
+
+    shift_left_impl(start_key, end_key);
+    update_leaf_index(index_first, m_leaf_index.size() - 1);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::shift_left_impl(key_type start_key, key_type end_key)
 {
     if (start_key >= end_key)
         return;
@@ -396,7 +724,7 @@ void flat_segment_tree<_Key, _Value>::shift_left(key_type start_key, key_type en
         // segment.
         shift_leaf_key_left(node_pos, m_right_leaf, segment_size);
         append_new_segment(right_leaf_key - segment_size);
-        m_valid_tree = false;
+        invalidate_tree();
         return;
     }
 
@@ -428,15 +756,43 @@ void flat_segment_tree<_Key, _Value>::shift_left(key_type start_key, key_type en
     }
 
     shift_leaf_key_left(node_pos, m_right_leaf, segment_size);
-    m_valid_tree = false;
+    invalidate_tree();
 
     // Insert at the end a new segment with the initial base value, for
     // the length of the removed segment.
     append_new_segment(right_leaf_key - segment_size);
 }
 
-template<typename _Key, typename _Value>
-void flat_segment_tree<_Key, _Value>::shift_right(key_type pos, key_type size, bool skip_start_node)
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::shift_right(key_type pos, key_type size, bool skip_start_node)
+{
+    if constexpr (store_key_offset)
+    {
+        if (shift_right_lazy(pos, size, skip_start_node))
+            return;
+    }
+
+    flush_pending_shifts();
+
+    if (!m_incremental_search)
+    {
+        shift_right_impl(pos, size, skip_start_node);
+        return;
+    }
+
+    // Only the nodes at or after the shift position get moved or removed.
+    // The leftmost node may have a new node inserted after it.
+    size_t index_first = get_leaf_index_pos(pos);
+    if (index_first > 0)
+        --index_first;
+    index_first = std::min(index_first, m_leaf_index.size() - 2);
+
+    shift_right_impl(pos, size, skip_start_node);
+    update_leaf_index(index_first, m_leaf_index.size() - 1);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::shift_right_impl(key_type pos, key_type size, bool skip_start_node)
 {
     if (size <= 0)
         return;
@@ -458,7 +814,7 @@ void flat_segment_tree<_Key, _Value>::shift_right(key_type pos, key_type size, b
             {
                 // The leftmost leaf node has a non-initial value.  We need to
                 // insert a new node to carry that value after the shift.
-                node_ptr new_node(new node);
+                node_ptr new_node(create_node());
                 new_node->value_leaf.key = pos + size;
                 new_node->value_leaf.value = m_left_leaf->value_leaf.value;
                 m_left_leaf->value_leaf.value = m_init_val;
@@ -475,7 +831,7 @@ void flat_segment_tree<_Key, _Value>::shift_right(key_type pos, key_type size, b
             }
         }
 
-        m_valid_tree = false;
+        invalidate_tree();
         return;
     }
 
@@ -494,12 +850,287 @@ void flat_segment_tree<_Key, _Value>::shift_right(key_type pos, key_type size, b
         return;
 
     shift_leaf_key_right(cur_node, m_right_leaf, size);
-    m_valid_tree = false;
+    invalidate_tree();
 }
 
-template<typename _Key, typename _Value>
-::std::pair<typename flat_segment_tree<_Key, _Value>::const_iterator, bool>
-flat_segment_tree<_Key, _Value>::search_impl(const node* pos,
+template<typename _Key, typename _Value, typename _Trait>
+bool flat_segment_tree<_Key, _Value, _Trait>::shift_left_lazy(key_type start_key, key_type end_key)
+{
+    if (!m_root_node || !m_valid_tree || m_incremental_search)
+        return false;
+
+    key_type left_leaf_key = m_left_leaf->value_leaf.key;
+    key_type right_leaf_key = m_right_leaf->value_leaf.key;
+    if (start_key >= end_key || start_key < left_leaf_key || right_leaf_key < end_key)
+        // Nothing to shift.
+        return true;
+
+    if (start_key == left_leaf_key || m_right_leaf->prev->value_leaf.value != m_init_val)
+        // The leftmost node gets modified, or a new segment gets appended
+        // before the rightmost node.
+        return false;
+
+    value_type val;
+    key_type seg_start, seg_end;
+    auto ret = search_tree(start_key, val, &seg_start, &seg_end);
+    if (!ret.second)
+        return false;
+
+    const node* first_node = ret.first.get_pos();
+    key_type first_key = seg_start;
+    if (seg_start < start_key)
+    {
+        first_node = first_node->next.get();
+        first_key = seg_end;
+    }
+
+    if (first_node == m_right_leaf.get() || first_key <= end_key)
+        // Some of the nodes get removed or merged.
+        return false;
+
+    key_shift shift;
+    shift.first_key = first_key;
+    shift.prev_key = get_leaf_key(first_node->prev.get());
+    shift.last_key = get_leaf_key(m_right_leaf->prev.get());
+    shift.delta = key_type(0) - (end_key - start_key);
+    shift_leaf_keys_lazy(shift);
+    return true;
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+bool flat_segment_tree<_Key, _Value, _Trait>::shift_right_lazy(key_type pos, key_type size, bool skip_start_node)
+{
+    if (!m_root_node || !m_valid_tree || m_incremental_search)
+        return false;
+
+    key_type left_leaf_key = m_left_leaf->value_leaf.key;
+    key_type right_leaf_key = m_right_leaf->value_leaf.key;
+    if (size <= 0 || pos < left_leaf_key || right_leaf_key <= pos)
+        // Nothing to shift.
+        return true;
+
+    if (pos == left_leaf_key)
+        // A new node may get inserted after the leftmost node.
+        return false;
+
+    value_type val;
+    key_type seg_start, seg_end;
+    auto ret = search_tree(pos, val, &seg_start, &seg_end);
+    if (!ret.second)
+        return false;
+
+    const node* first_node = ret.first.get_pos();
+    key_type first_key = seg_start;
+    if (seg_start < pos || skip_start_node)
+    {
+        first_node = first_node->next.get();
+        first_key = seg_end;
+    }
+
+    if (first_node == m_right_leaf.get())
+        // Nothing to shift.
+        return true;
+
+    key_type last_key = get_leaf_key(m_right_leaf->prev.get());
+    if (!(size < right_leaf_key - last_key))
+        // Some of the nodes get pushed out of the range.
+        return false;
+
+    key_shift shift;
+    shift.first_key = first_key;
+    shift.prev_key = get_leaf_key(first_node->prev.get());
+    shift.last_key = last_key;
+    shift.delta = size;
+    shift_leaf_keys_lazy(shift);
+    return true;
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::shift_leaf_keys_lazy(const key_shift& shift)
+{
+    // All leaf nodes from the first one through the one before the rightmost
+    // node get shifted.  Any subtree whose leaf nodes, plus the one that
+    // follows, are all being shifted only records the shift in its root.
+    // Only the non-leaf nodes along both boundaries of the shifted range
+    // need their values re-computed.
+    m_pending_shift = true;
+    shift_subtree_keys(m_root_node, key_type(0), shift);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::shift_subtree_keys(
+    __st::node_base* p, key_type frame, const key_shift& shift)
+{
+    if (p->is_leaf)
+    {
+        node* leaf = static_cast<node*>(p);
+        key_type key = leaf->value_leaf.key + frame;
+        if (leaf != m_right_leaf.get() && !(key < shift.first_key))
+            leaf->value_leaf.key += shift.delta;
+        return;
+    }
+
+    nonleaf_node* nonleaf = static_cast<nonleaf_node*>(p);
+    nonleaf_value_type& v = nonleaf->value_nonleaf;
+    key_type low = v.low + frame;
+    key_type high = v.high + frame;
+
+    if (high <= shift.prev_key)
+        // None of the leaf nodes underneath, nor the one that follows, get
+        // shifted.
+        return;
+
+    if (!(low < shift.first_key) && high <= shift.last_key)
+    {
+        // All of the leaf nodes underneath, and the one that follows, get
+        // shifted.  Their distances stay the same.
+        v.low += shift.delta;
+        v.high += shift.delta;
+        v.delta += shift.delta;
+        return;
+    }
+
+    key_type child_frame = frame + v.delta;
+    if (nonleaf->left)
+        shift_subtree_keys(nonleaf->left, child_frame, shift);
+    if (nonleaf->right)
+        shift_subtree_keys(nonleaf->right, child_frame, shift);
+
+    refresh_nonleaf_value(*nonleaf, frame, shift);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::refresh_nonleaf_value(
+    nonleaf_node& nonleaf, key_type frame, const key_shift& shift) const
+{
+    nonleaf_value_type& v = nonleaf.value_nonleaf;
+    key_type child_frame = frame + v.delta;
+
+    // Key of the leaf node that follows the specified leaf node, relative to
+    // the child nodes.  The following node is outside this subtree, and
+    // hasn't been shifted yet.
+    auto get_next_key = [this, &shift, child_frame](const node* p) -> key_type
+    {
+        const node* next = p->next.get();
+        key_type key = get_leaf_key(next);
+        if (next != m_right_leaf.get() && !(key < shift.first_key))
+            key += shift.delta;
+        return key - child_frame;
+    };
+
+    const __st::node_base* left_node = nonleaf.left;
+    const __st::node_base* right_node = nonleaf.right;
+    assert(left_node);
+
+    key_type low = left_node->is_leaf ?
+        static_cast<const node*>(left_node)->value_leaf.key :
+        static_cast<const nonleaf_node*>(left_node)->value_nonleaf.low;
+
+    key_type high;
+    if (right_node)
+    {
+        if (right_node->is_leaf)
+        {
+            const node* p = static_cast<const node*>(right_node);
+            high = p->next ? get_next_key(p) : p->value_leaf.key;
+        }
+        else
+            high = static_cast<const nonleaf_node*>(right_node)->value_nonleaf.high;
+    }
+    else
+    {
+        high = left_node->is_leaf ?
+            static_cast<const node*>(left_node)->value_leaf.key :
+            static_cast<const nonleaf_node*>(left_node)->value_nonleaf.high;
+    }
+
+    v.low = low + v.delta;
+    v.high = high + v.delta;
+
+    if constexpr (store_aggregate)
+    {
+        aggregate_type& agg = v;
+        agg = aggregate_type();
+
+        const __st::node_base* children[] = { left_node, right_node };
+        for (const __st::node_base* child : children)
+        {
+            if (!child)
+                continue;
+
+            if (!child->is_leaf)
+            {
+                agg.add(static_cast<const nonleaf_node*>(child)->value_nonleaf);
+                continue;
+            }
+
+            const node* p = static_cast<const node*>(child);
+            if (!p->next)
+                continue;
+
+            key_type next_key = p->next.get() == right_node ?
+                p->next->value_leaf.key : get_next_key(p);
+            agg.add_segment(next_key - p->value_leaf.key, p->value_leaf.value);
+        }
+    }
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+typename flat_segment_tree<_Key, _Value, _Trait>::key_type
+flat_segment_tree<_Key, _Value, _Trait>::get_leaf_key(const node* p) const
+{
+    key_type key = p->value_leaf.key;
+    if (!m_pending_shift)
+        return key;
+
+    for (const __st::node_base* q = p->parent; q; q = q->parent)
+        key += static_cast<const nonleaf_node*>(q)->value_nonleaf.delta;
+
+    return key;
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::flush_pending_shifts()
+{
+    if constexpr (store_key_offset)
+    {
+        if (!m_pending_shift)
+            return;
+
+        apply_pending_shift(m_root_node, key_type(0));
+
+        for (size_t i = 1; i < m_search_keys.size(); ++i)
+            m_search_keys[i] = m_search_nodes[i]->value_leaf.key;
+
+        m_pending_shift = false;
+    }
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::apply_pending_shift(__st::node_base* p, key_type delta)
+{
+    if (p->is_leaf)
+    {
+        static_cast<node*>(p)->value_leaf.key += delta;
+        return;
+    }
+
+    nonleaf_node* nonleaf = static_cast<nonleaf_node*>(p);
+    nonleaf_value_type& v = nonleaf->value_nonleaf;
+    v.low += delta;
+    v.high += delta;
+    key_type child_delta = delta + v.delta;
+    v.delta = 0;
+
+    if (nonleaf->left)
+        apply_pending_shift(nonleaf->left, child_delta);
+    if (nonleaf->right)
+        apply_pending_shift(nonleaf->right, child_delta);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+::std::pair<typename flat_segment_tree<_Key, _Value, _Trait>::const_iterator, bool>
+flat_segment_tree<_Key, _Value, _Trait>::search_impl(const node* pos,
     key_type key, value_type& value, key_type* start_key, key_type* end_key) const
 {
     typedef ::std::pair<const_iterator, bool> ret_type;
@@ -526,13 +1157,18 @@ flat_segment_tree<_Key, _Value>::search_impl(const node* pos,
     return ret_type(const_iterator(this, true), false);
 }
 
-template<typename _Key, typename _Value>
-::std::pair<typename flat_segment_tree<_Key, _Value>::const_iterator, bool>
-flat_segment_tree<_Key, _Value>::search(
+template<typename _Key, typename _Value, typename _Trait>
+::std::pair<typename flat_segment_tree<_Key, _Value, _Trait>::const_iterator, bool>
+flat_segment_tree<_Key, _Value, _Trait>::search(
     key_type key, value_type& value, key_type* start_key, key_type* end_key) const
 {
     typedef ::std::pair<const_iterator, bool> ret_type;
 
+    if (m_pending_shift)
+        // The leaf keys don't reflect the pending shifts, but the tree is
+        // always valid while any shift is pending.
+        return search_tree(key, value, start_key, end_key);
+
     if (key < m_left_leaf->value_leaf.key || m_right_leaf->value_leaf.key <= key)
         // key value is out-of-bound.
         return ret_type(const_iterator(this, true), false);
@@ -541,13 +1177,18 @@ flat_segment_tree<_Key, _Value>::search(
     return search_impl(pos, key, value, start_key, end_key);
 }
 
-template<typename _Key, typename _Value>
-::std::pair<typename flat_segment_tree<_Key, _Value>::const_iterator, bool>
-flat_segment_tree<_Key, _Value>::search(const const_iterator& pos,
+template<typename _Key, typename _Value, typename _Trait>
+::std::pair<typename flat_segment_tree<_Key, _Value, _Trait>::const_iterator, bool>
+flat_segment_tree<_Key, _Value, _Trait>::search(const const_iterator& pos,
     key_type key, value_type& value, key_type* start_key, key_type* end_key) const
 {
     typedef ::std::pair<const_iterator, bool> ret_type;
 
+    if (m_pending_shift)
+        // Same as above.  Searching the tree is faster than walking the
+        // leaf nodes from the specified position anyway.
+        return search_tree(key, value, start_key, end_key);
+
     if (key < m_left_leaf->value_leaf.key || m_right_leaf->value_leaf.key <= key)
         // key value is out-of-bound.
         return ret_type(const_iterator(this, true), false);
@@ -572,12 +1213,95 @@ flat_segment_tree<_Key, _Value>::search(const const_iterator& pos,
     return search_impl(p, key, value, start_key, end_key);
 }
 
-template<typename _Key, typename _Value>
-std::pair<typename flat_segment_tree<_Key, _Value>::const_iterator, bool>
-flat_segment_tree<_Key, _Value>::search_tree(
+template<typename _Key, typename _Value, typename _Trait>
+template<typename _KeyIter, typename _OutIter>
+typename flat_segment_tree<_Key, _Value, _Trait>::size_type
+flat_segment_tree<_Key, _Value, _Trait>::search_many(_KeyIter keys_begin, _KeyIter keys_end, _OutIter out) const
+{
+    if (std::is_sorted(keys_begin, keys_end))
+        return search_sorted_keys(keys_begin, keys_end, out);
+
+    // Sort the keys while remembering their original positions, look them
+    // up in sorted order, then put the values back in the original order.
+    std::vector<std::pair<key_type, size_t>> sorted_keys;
+    for (size_t i = 0; keys_begin != keys_end; ++keys_begin, ++i)
+        sorted_keys.emplace_back(*keys_begin, i);
+
+    std::sort(sorted_keys.begin(), sorted_keys.end());
+
+    std::vector<key_type> keys;
+    keys.reserve(sorted_keys.size());
+    for (const auto& v : sorted_keys)
+        keys.push_back(v.first);
+
+    std::vector<value_type> sorted_values;
+    sorted_values.reserve(keys.size());
+    size_type found = search_sorted_keys(keys.begin(), keys.end(), std::back_inserter(sorted_values));
+
+    std::vector<value_type> values(keys.size());
+    for (size_t i = 0; i < sorted_keys.size(); ++i)
+        values[sorted_keys[i].second] = sorted_values[i];
+
+    std::copy(values.begin(), values.end(), out);
+    return found;
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+template<typename _KeyIter, typename _OutIter>
+typename flat_segment_tree<_Key, _Value, _Trait>::size_type
+flat_segment_tree<_Key, _Value, _Trait>::search_sorted_keys(_KeyIter keys_begin, _KeyIter keys_end, _OutIter out) const
+{
+    key_type min_key = m_left_leaf->value_leaf.key;
+    key_type max_key = m_right_leaf->value_leaf.key;
+
+    size_type found = 0;
+    const node* cur_node = nullptr;
+
+    for (; keys_begin != keys_end; ++keys_begin, ++out)
+    {
+        key_type key = *keys_begin;
+        if (key < min_key || max_key <= key)
+        {
+            // key value is out-of-bound.
+            *out = m_init_val;
+            continue;
+        }
+
+        if (!cur_node)
+        {
+            // Locate the segment of the first key via the tree if we can.
+            // Otherwise start from the left-most leaf node.
+            cur_node = m_left_leaf.get();
+            if (m_incremental_search || (m_root_node && m_valid_tree))
+            {
+                value_type val;
+                auto ret = search_tree(key, val);
+                if (ret.second)
+                    cur_node = ret.first.get_pos();
+            }
+        }
+
+        // The right-most leaf node stops this loop since the key is below
+        // its value.
+        while (get_leaf_key(cur_node->next.get()) <= key)
+            cur_node = cur_node->next.get();
+
+        *out = cur_node->value_leaf.value;
+        ++found;
+    }
+
+    return found;
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+std::pair<typename flat_segment_tree<_Key, _Value, _Trait>::const_iterator, bool>
+flat_segment_tree<_Key, _Value, _Trait>::search_tree(
     key_type key, value_type& value, key_type* start_key, key_type* end_key) const
 {
     typedef std::pair<const_iterator, bool> ret_type;
+    if (m_incremental_search)
+        return search_leaf_index(key, value, start_key, end_key);
+
     if (!m_root_node || !m_valid_tree)
     {
         // either tree has not been built, or is in an invalid state.
@@ -590,11 +1314,16 @@ flat_segment_tree<_Key, _Value>::search_tree(
         return ret_type(const_iterator(this, true), false);
     }
 
-    // Descend down the tree through the last non-leaf layer.
+    // Descend down the tree through the last non-leaf layer.  The key
+    // values stored in each node are relative to the sum of the pending
+    // shifts of its ancestors.
 
     const nonleaf_node* cur_node = m_root_node;
+    key_type frame = 0;
     while (true)
     {
+        key_type child_frame = frame + cur_node->value_nonleaf.delta;
+
         if (cur_node->left)
         {
             if (cur_node->left->is_leaf)
@@ -602,10 +1331,12 @@ flat_segment_tree<_Key, _Value>::search_tree(
 
             const nonleaf_node* left_nonleaf = static_cast<const nonleaf_node*>(cur_node->left);
             const nonleaf_value_type& v = left_nonleaf->value_nonleaf;
-            if (v.low <= key && key < v.high)
+            key_type low = v.low + child_frame, high = v.high + child_frame;
+            if (low <= key && key < high)
             {
                 // Descend one level through the left child node.
                 cur_node = left_nonleaf;
+                frame = child_frame;
                 continue;
             }
         }
@@ -620,10 +1351,12 @@ flat_segment_tree<_Key, _Value>::search_tree(
             assert(!cur_node->right->is_leaf);
             const nonleaf_node* right_nonleaf = static_cast<const nonleaf_node*>(cur_node->right);
             const nonleaf_value_type& v = right_nonleaf->value_nonleaf;
-            if (v.low <= key && key < v.high)
+            key_type low = v.low + child_frame, high = v.high + child_frame;
+            if (low <= key && key < high)
             {
                 // Descend one level through the right child node.
                 cur_node = right_nonleaf;
+                frame = child_frame;
                 continue;
             }
         }
@@ -633,19 +1366,31 @@ flat_segment_tree<_Key, _Value>::search_tree(
     // Current node must be a non-leaf whose child nodes are leaf nodes.
     assert(cur_node->left->is_leaf && cur_node->right->is_leaf);
 
+    key_type child_frame = frame + cur_node->value_nonleaf.delta;
     const node* dest_node = nullptr;
     const node* leaf_left = static_cast<const node*>(cur_node->left);
     const node* leaf_right = static_cast<const node*>(cur_node->right);
-    key_type key1 = leaf_left->value_leaf.key;
-    key_type key2 = leaf_right->value_leaf.key;
+    key_type key1 = leaf_left->value_leaf.key + child_frame;
+    key_type key2 = leaf_right->value_leaf.key + child_frame;
+    key_type key3 = cur_node->value_nonleaf.high + frame;
 
     if (key1 <= key && key < key2)
     {
         dest_node = leaf_left;
+        if (start_key)
+            *start_key = key1;
+        if (end_key)
+            *end_key = key2;
     }
-    else if (key2 <= key && key < cur_node->value_nonleaf.high)
+    else if (key2 <= key && key < key3)
     {
+        // The upper bound of the current node is the key of the node that
+        // comes after the right leaf node.
         dest_node = leaf_right;
+        if (start_key)
+            *start_key = key2;
+        if (end_key)
+            *end_key = key3;
     }
 
     if (!dest_node)
@@ -653,29 +1398,246 @@ flat_segment_tree<_Key, _Value>::search_tree(
         return ret_type(const_iterator(this, true), false);
     }
 
+    value = dest_node->value_leaf.value;
+    return ret_type(const_iterator(this, dest_node), true);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+std::pair<typename flat_segment_tree<_Key, _Value, _Trait>::const_iterator, bool>
+flat_segment_tree<_Key, _Value, _Trait>::search_tree_array(
+    key_type key, value_type& value, key_type* start_key, key_type* end_key) const
+{
+    typedef std::pair<const_iterator, bool> ret_type;
+    if (m_pending_shift || m_search_keys.size() < 2)
+        // Either the array doesn't reflect the shifts yet, or it has not
+        // been built.
+        return search_tree(key, value, start_key, end_key);
+
+    if (!m_valid_tree)
+    {
+        // the tree is in an invalid state.
+        return ret_type(const_iterator(this, true), false);
+    }
+
+    if (key < m_left_leaf->value_leaf.key || m_right_leaf->value_leaf.key <= key)
+    {
+        // key value is out-of-bound.
+        return ret_type(const_iterator(this, true), false);
+    }
+
+    // Find the first leaf whose key is greater than the search key.  Each
+    // step picks the child position arithmetically, and remembers the last
+    // position where the descent went left; the compiler turns both into
+    // conditional moves.  Since the rightmost leaf is part of the array and
+    // the key is below its value, such a leaf always exists.
+
+    const key_type* keys = m_search_keys.data();
+    size_t n = m_search_keys.size() - 1;
+    size_t pos = 1, found = 0;
+    while (pos <= n)
+    {
+        bool go_right = !(key < keys[pos]);
+        found = go_right ? found : pos;
+        pos = 2 * pos + go_right;
+    }
+
+    assert(found);
+    const node* end_node = m_search_nodes[found];
+    const node* dest_node = end_node->prev.get();
+    assert(dest_node);
+
     value = dest_node->value_leaf.value;
     if (start_key)
         *start_key = dest_node->value_leaf.key;
-
     if (end_key)
+        *end_key = end_node->value_leaf.key;
+
+    return ret_type(const_iterator(this, dest_node), true);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+typename flat_segment_tree<_Key, _Value, _Trait>::aggregate_type
+flat_segment_tree<_Key, _Value, _Trait>::aggregate(key_type start_key, key_type end_key) const
+{
+    static_assert(std::is_arithmetic<value_type>::value, "aggregate() requires an arithmetic value type.");
+
+    aggregate_type result;
+    if (!adjust_segment_range(start_key, end_key) || start_key == end_key)
+        return result;
+
+    if constexpr (store_aggregate)
     {
-        assert(dest_node->next);
-        if (dest_node->next)
-            *end_key = dest_node->next->value_leaf.key;
-        else
-            // This should never happen, but just in case....
-            *end_key = m_right_leaf->value_leaf.key;
+        if (m_root_node && m_valid_tree)
+        {
+            aggregate_tree(m_root_node, key_type(0), start_key, end_key, result);
+            return result;
+        }
     }
 
+    // Walk the leaf nodes from the segment that contains the start key.
+    const node* cur_node = m_left_leaf.get();
+    if (m_incremental_search)
+    {
+        value_type val;
+        auto ret = search_leaf_index(start_key, val, nullptr, nullptr);
+        if (ret.second)
+            cur_node = ret.first.get_pos();
+    }
+
+    for (; cur_node->next && cur_node->value_leaf.key < end_key; cur_node = cur_node->next.get())
+    {
+        key_type seg_start = std::max(start_key, cur_node->value_leaf.key);
+        key_type seg_end = std::min(end_key, cur_node->next->value_leaf.key);
+        if (seg_start < seg_end)
+            result.add_segment(seg_end - seg_start, cur_node->value_leaf.value);
+    }
+
+    return result;
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::aggregate_tree(
+    const __st::node_base* p, key_type frame, key_type start_key, key_type end_key, aggregate_type& result) const
+{
+    if (p->is_leaf)
+    {
+        // Partial overlap with a single segment.
+        const node* leaf = static_cast<const node*>(p);
+        if (!leaf->next)
+            return;
+
+        key_type seg_start = std::max<key_type>(start_key, leaf->value_leaf.key + frame);
+        key_type seg_end = std::min(end_key, get_leaf_key(leaf->next.get()));
+        if (seg_start < seg_end)
+            result.add_segment(seg_end - seg_start, leaf->value_leaf.value);
+        return;
+    }
+
+    const nonleaf_node* nonleaf = static_cast<const nonleaf_node*>(p);
+    const nonleaf_value_type& v = nonleaf->value_nonleaf;
+    key_type low = v.low + frame, high = v.high + frame;
+    if (high <= start_key || end_key <= low)
+        // No overlap.
+        return;
+
+    if (start_key <= low && high <= end_key)
+    {
+        // The whole subtree is within the range.
+        result.add(v);
+        return;
+    }
+
+    key_type child_frame = frame + v.delta;
+    if (nonleaf->left)
+        aggregate_tree(nonleaf->left, child_frame, start_key, end_key, result);
+    if (nonleaf->right)
+        aggregate_tree(nonleaf->right, child_frame, start_key, end_key, result);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+std::pair<typename flat_segment_tree<_Key, _Value, _Trait>::const_iterator, bool>
+flat_segment_tree<_Key, _Value, _Trait>::search_weight(
+    typename aggregate_type::sum_type weight, key_type& key, typename aggregate_type::sum_type* start_weight) const
+{
+    static_assert(std::is_arithmetic<value_type>::value, "search_weight() requires an arithmetic value type.");
+
+    typedef std::pair<const_iterator, bool> ret_type;
+    typedef typename aggregate_type::sum_type sum_type;
+
+    if (weight < sum_type(0))
+        return ret_type(const_iterator(this, true), false);
+
+    // Weight remaining after skipping the segments before the current one.
+    sum_type remaining = weight;
+    const node* dest_node = nullptr;
+
+    if constexpr (store_aggregate)
+    {
+        if (m_root_node && m_valid_tree)
+        {
+            if (m_root_node->value_nonleaf.sum <= weight)
+                // Past the total weight.
+                return ret_type(const_iterator(this, true), false);
+
+            // Descend through the child whose subtree contains the weight.
+            const __st::node_base* p = m_root_node;
+            while (!p->is_leaf)
+            {
+                const nonleaf_node* nonleaf = static_cast<const nonleaf_node*>(p);
+                sum_type left_weight = get_node_weight(nonleaf->left);
+                if (remaining < left_weight)
+                {
+                    p = nonleaf->left;
+                    continue;
+                }
+
+                remaining -= left_weight;
+                p = nonleaf->right;
+                assert(p); // the total weight check above guarantees this.
+            }
+
+            dest_node = static_cast<const node*>(p);
+        }
+    }
+
+    if (!dest_node)
+    {
+        for (const node* p = m_left_leaf.get(); p->next; p = p->next.get())
+        {
+            sum_type seg_weight = get_node_weight(p);
+            if (remaining < seg_weight)
+            {
+                dest_node = p;
+                break;
+            }
+
+            remaining -= seg_weight;
+        }
+
+        if (!dest_node)
+            // Past the total weight.
+            return ret_type(const_iterator(this, true), false);
+    }
+
+    assert(dest_node->next && dest_node->value_leaf.value > value_type(0));
+
+    // Position within the segment.
+    key_type offset = static_cast<key_type>(remaining / sum_type(dest_node->value_leaf.value));
+    key = get_leaf_key(dest_node) + offset;
+
+    if (start_weight)
+        *start_weight = weight - remaining + sum_type(offset) * sum_type(dest_node->value_leaf.value);
+
     return ret_type(const_iterator(this, dest_node), true);
 }
 
-template<typename _Key, typename _Value>
-void flat_segment_tree<_Key, _Value>::build_tree()
+template<typename _Key, typename _Value, typename _Trait>
+typename flat_segment_tree<_Key, _Value, _Trait>::aggregate_type::sum_type
+flat_segment_tree<_Key, _Value, _Trait>::get_node_weight(const __st::node_base* p) const
+{
+    typedef typename aggregate_type::sum_type sum_type;
+
+    if constexpr (store_aggregate)
+    {
+        if (!p->is_leaf)
+            return static_cast<const nonleaf_node*>(p)->value_nonleaf.sum;
+    }
+
+    // The right-most leaf node doesn't start a segment.
+    const node* leaf = static_cast<const node*>(p);
+    if (!leaf->next)
+        return 0;
+
+    return sum_type(get_leaf_key(leaf->next.get()) - get_leaf_key(leaf)) * sum_type(leaf->value_leaf.value);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::build_tree()
 {
     if (!m_left_leaf)
         return;
 
+    flush_pending_shifts();
     m_nonleaf_node_pool.clear();
 
     // Count the number of leaf nodes.
@@ -690,15 +1652,349 @@ void flat_segment_tree<_Key, _Value>::build_tree()
     m_valid_tree = true;
 }
 
-template<typename _Key, typename _Value>
-typename flat_segment_tree<_Key, _Value>::size_type
-flat_segment_tree<_Key, _Value>::leaf_size() const
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::build_tree_array()
+{
+    if (!m_left_leaf)
+        return;
+
+    if (!m_valid_tree)
+        build_tree();
+    else
+        flush_pending_shifts();
+
+    size_t leaf_count = leaf_size();
+    m_search_keys.resize(leaf_count + 1);
+    m_search_nodes.resize(leaf_count + 1);
+    m_search_keys[0] = key_type();
+    m_search_nodes[0] = nullptr;
+
+    // In-order traversal of the implicit tree visits the positions in key
+    // order, which is the order of the leaf node chain.
+    const node* cur_node = m_left_leaf.get();
+    fill_search_array(1, cur_node);
+    assert(!cur_node);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::fill_search_array(size_t pos, const node*& cur_node)
+{
+    if (pos >= m_search_keys.size())
+        return;
+
+    fill_search_array(2 * pos, cur_node);
+    m_search_keys[pos] = cur_node->value_leaf.key;
+    m_search_nodes[pos] = cur_node;
+    cur_node = cur_node->next.get();
+    fill_search_array(2 * pos + 1, cur_node);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::release_search_array()
+{
+    if (m_search_keys.empty())
+        return;
+
+    std::vector<key_type> empty_keys;
+    std::vector<const node*> empty_nodes;
+    m_search_keys.swap(empty_keys);
+    m_search_nodes.swap(empty_nodes);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::invalidate_tree()
+{
+    m_valid_tree = false;
+    release_search_array();
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+typename flat_segment_tree<_Key, _Value, _Trait>::frozen_type
+flat_segment_tree<_Key, _Value, _Trait>::freeze() const
+{
+    size_type n = leaf_size();
+    std::vector<key_type> keys;
+    std::vector<value_type> values;
+    keys.reserve(n);
+    values.reserve(n - 1);
+
+    for (const node* p = m_left_leaf.get(); p; p = p->next.get())
+    {
+        keys.push_back(get_leaf_key(p));
+        if (p->next)
+            values.push_back(p->value_leaf.value);
+    }
+
+    return frozen_type(std::move(keys), std::move(values), m_init_val);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::save_state(std::ostream& os) const
+{
+    static_assert(std::is_trivially_copyable<key_type>::value && std::is_trivially_copyable<value_type>::value,
+        "save_state() requires trivially copyable key and value types.");
+
+    size_type n = leaf_size() - 1;
+
+    __fst::state_header header;
+    header.flags = 0;
+    header.key_size = sizeof(key_type);
+    header.value_size = sizeof(value_type);
+    header.reserved = 0;
+    header.segment_count = n;
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    // Each section is followed by zero padding up to a multiple of 8.
+    const char padding[8] = {};
+    auto write_padding = [&os, &padding](size_t bytes)
+    {
+        os.write(padding, __fst::get_state_section_size(bytes) - bytes);
+    };
+
+    os.write(reinterpret_cast<const char*>(&m_init_val), sizeof(value_type));
+    write_padding(sizeof(value_type));
+
+    for (const node* p = m_left_leaf.get(); p; p = p->next.get())
+    {
+        key_type key = get_leaf_key(p);
+        os.write(reinterpret_cast<const char*>(&key), sizeof(key_type));
+    }
+    write_padding((n + 1) * sizeof(key_type));
+
+    for (const node* p = m_left_leaf.get(); p->next; p = p->next.get())
+        os.write(reinterpret_cast<const char*>(&p->value_leaf.value), sizeof(value_type));
+    write_padding(n * sizeof(value_type));
+
+    // Write 0xFF to signify the end of the state.
+    const char check_byte = char(0xFF);
+    os.write(&check_byte, 1);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::load_state(std::istream& is)
+{
+    static_assert(std::is_trivially_copyable<key_type>::value && std::is_trivially_copyable<value_type>::value,
+        "load_state() requires trivially copyable key and value types.");
+
+    __fst::state_header header;
+    if (!is.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        throw invalid_arg_error("flat_segment_tree::load_state: failed to read the header.");
+
+    if (header.flags || header.key_size != sizeof(key_type) || header.value_size != sizeof(value_type))
+        throw invalid_arg_error("flat_segment_tree::load_state: the stream is not meant for this key and value types.");
+
+    // Reject any segment count whose section sizes would overflow.  The
+    // stream size is unknown, so that's as far as the count can be checked
+    // up front.
+    if (!__fst::check_state_segment_count(
+        header.segment_count, sizeof(key_type) + sizeof(value_type), std::numeric_limits<size_t>::max() / 2))
+        throw invalid_arg_error("flat_segment_tree::load_state: the stream stores too many segments.");
+
+    size_t n = header.segment_count;
+    if (!n)
+        throw invalid_arg_error("flat_segment_tree::load_state: the stream stores no segments.");
+
+    char padding[8];
+    auto read_padding = [&is, &padding](size_t bytes)
+    {
+        is.read(padding, __fst::get_state_section_size(bytes) - bytes);
+    };
+
+    // Read the arrays in chunks of bounded size, and let them grow as the
+    // data arrives.  That way a corrupt segment count runs into the end of
+    // the stream rather than triggering a huge allocation up front.
+    auto read_array = [&is, &read_padding](auto& array, size_t count)
+    {
+        typedef typename std::decay<decltype(array)>::type::value_type elem_type;
+        const size_t chunk_size = 256;
+        elem_type chunk[chunk_size];
+
+        for (size_t remaining = count; remaining; )
+        {
+            size_t len = std::min(remaining, chunk_size);
+            if (!is.read(reinterpret_cast<char*>(chunk), len * sizeof(elem_type)))
+                throw invalid_arg_error("flat_segment_tree::load_state: the stream ended before all segments were read.");
+
+            array.insert(array.end(), chunk, chunk + len);
+            remaining -= len;
+        }
+
+        read_padding(count * sizeof(elem_type));
+    };
+
+    value_type init_val;
+    is.read(reinterpret_cast<char*>(&init_val), sizeof(value_type));
+    read_padding(sizeof(value_type));
+
+    std::vector<key_type> keys;
+    std::vector<value_type> values;
+    read_array(keys, n + 1);
+    read_array(values, n);
+
+    char check_byte = 0;
+    if (!is.read(&check_byte, 1) || check_byte != char(0xFF))
+        throw invalid_arg_error("flat_segment_tree::load_state: failed to find the check byte at the end of the state.");
+
+    for (size_t i = 1; i <= n; ++i)
+    {
+        if (!(keys[i-1] < keys[i]))
+            throw invalid_arg_error("flat_segment_tree::load_state: the keys are not sorted.");
+    }
+
+    flat_segment_tree new_tree(keys[0], keys[n], init_val);
+    new_tree.set_node_pool(m_use_node_pool);
+
+    node_ptr last_node = new_tree.m_left_leaf;
+    for (size_t i = 0; i < n; ++i)
+        new_tree.append_leaf_node(last_node, keys[i], values[i]);
+
+    if (m_incremental_search)
+        new_tree.set_incremental_search(true);
+
+    swap(new_tree);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::set_incremental_search(bool enabled)
+{
+    if (enabled == m_incremental_search)
+        return;
+
+    flush_pending_shifts();
+    m_incremental_search = enabled;
+
+    if (enabled)
+        build_leaf_index();
+    else
+    {
+        std::vector<const node*> empty;
+        m_leaf_index.swap(empty);
+    }
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::set_node_pool(bool enabled)
+{
+    if (enabled == m_use_node_pool)
+        return;
+
+    // Move all the existing leaf nodes into a new pool in key order, or out
+    // of the current pool, which goes away with the copy.
+    m_use_node_pool = enabled;
+    flat_segment_tree copy(*this);
+    m_use_node_pool = !enabled;
+    swap(copy);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+typename flat_segment_tree<_Key, _Value, _Trait>::node*
+flat_segment_tree<_Key, _Value, _Trait>::create_node()
+{
+    return m_use_node_pool ? m_node_pool->create() : new node;
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+typename flat_segment_tree<_Key, _Value, _Trait>::node*
+flat_segment_tree<_Key, _Value, _Trait>::create_node(const node& r)
+{
+    return m_use_node_pool ? m_node_pool->create(r) : new node(r);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::build_leaf_index()
+{
+    m_leaf_index.clear();
+    for (const node* p = m_left_leaf.get(); p; p = p->next.get())
+        m_leaf_index.push_back(p);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+size_t flat_segment_tree<_Key, _Value, _Trait>::get_leaf_index_pos(key_type key) const
+{
+    // Position of the first leaf node whose key is equal to or greater than
+    // the specified key.
+    auto it = std::lower_bound(m_leaf_index.begin(), m_leaf_index.end(), key,
+        [](const node* p, key_type k) { return p->value_leaf.key < k; });
+
+    return std::distance(m_leaf_index.begin(), it);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+size_t flat_segment_tree<_Key, _Value, _Trait>::get_leaf_index_pos(const node* p) const
+{
+    size_t pos = get_leaf_index_pos(p->value_leaf.key);
+    assert(pos < m_leaf_index.size() && m_leaf_index[pos] == p);
+    return pos;
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+void flat_segment_tree<_Key, _Value, _Trait>::update_leaf_index(size_t first_pos, size_t last_pos)
+{
+    // Both nodes at the first and last positions must have survived the
+    // modification.  Everything in between gets re-read from the chain of
+    // leaf nodes.
+    assert(first_pos < last_pos && last_pos < m_leaf_index.size());
+
+    const node* first_node = m_leaf_index[first_pos];
+    const node* last_node = m_leaf_index[last_pos];
+
+    size_t new_count = 0;
+    for (const node* p = first_node->next.get(); p != last_node; p = p->next.get())
+    {
+        assert(p);
+        ++new_count;
+    }
+
+    size_t old_count = last_pos - first_pos - 1;
+    auto it = m_leaf_index.begin() + first_pos + 1;
+    if (new_count > old_count)
+        m_leaf_index.insert(it, new_count - old_count, nullptr);
+    else if (new_count < old_count)
+        m_leaf_index.erase(it, it + (old_count - new_count));
+
+    size_t pos = first_pos + 1;
+    for (const node* p = first_node->next.get(); p != last_node; p = p->next.get())
+        m_leaf_index[pos++] = p;
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+::std::pair<typename flat_segment_tree<_Key, _Value, _Trait>::const_iterator, bool>
+flat_segment_tree<_Key, _Value, _Trait>::search_leaf_index(
+    key_type key, value_type& value, key_type* start_key, key_type* end_key) const
+{
+    typedef std::pair<const_iterator, bool> ret_type;
+
+    if (key < m_left_leaf->value_leaf.key || m_right_leaf->value_leaf.key <= key)
+        // key value is out-of-bound.
+        return ret_type(const_iterator(this, true), false);
+
+    // Find the first node whose key is greater than the search key.  The
+    // segment that contains the key starts at the node before it.
+    auto it = std::upper_bound(m_leaf_index.begin(), m_leaf_index.end(), key,
+        [](key_type k, const node* p) { return k < p->value_leaf.key; });
+
+    assert(it != m_leaf_index.begin() && it != m_leaf_index.end());
+    const node* end_node = *it;
+    const node* dest_node = *(--it);
+
+    value = dest_node->value_leaf.value;
+    if (start_key)
+        *start_key = dest_node->value_leaf.key;
+    if (end_key)
+        *end_key = end_node->value_leaf.key;
+
+    return ret_type(const_iterator(this, dest_node), true);
+}
+
+template<typename _Key, typename _Value, typename _Trait>
+typename flat_segment_tree<_Key, _Value, _Trait>::size_type
+flat_segment_tree<_Key, _Value, _Trait>::leaf_size() const
 {
     return __st::count_leaf_nodes(m_left_leaf.get(), m_right_leaf.get());
 }
 
-template<typename _Key, typename _Value>
-bool flat_segment_tree<_Key, _Value>::operator==(const flat_segment_tree<key_type, value_type>& r) const
+template<typename _Key, typename _Value, typename _Trait>
+bool flat_segment_tree<_Key, _Value, _Trait>::operator==(const flat_segment_tree& r) const
 {
     const node* n1 = m_left_leaf.get();
     const node* n2 = r.m_left_leaf.get();
@@ -712,7 +2008,8 @@ bool flat_segment_tree<_Key, _Value>::operator==(const flat_segment_tree<key_typ
         if (!n2)
             return false;
 
-        if (!n1->equals(*n2))
+        // Either of the key values may have a pending shift not yet applied.
+        if (get_leaf_key(n1) != r.get_leaf_key(n2) || n1->value_leaf.value != n2->value_leaf.value)
             return false;
 
         n1 = n1->next.get();
@@ -727,9 +2024,9 @@ bool flat_segment_tree<_Key, _Value>::operator==(const flat_segment_tree<key_typ
     return true;
 }
 
-template<typename _Key, typename _Value>
-const typename flat_segment_tree<_Key, _Value>::node*
-flat_segment_tree<_Key, _Value>::get_insertion_pos_leaf_reverse(
+template<typename _Key, typename _Value, typename _Trait>
+const typename flat_segment_tree<_Key, _Value, _Trait>::node*
+flat_segment_tree<_Key, _Value, _Trait>::get_insertion_pos_leaf_reverse(
     key_type key, const node* start_pos) const
 {
     const node* cur_node = start_pos;
@@ -745,9 +2042,9 @@ flat_segment_tree<_Key, _Value>::get_insertion_pos_leaf_reverse(
     return nullptr;
 }
 
-template<typename _Key, typename _Value>
-const typename flat_segment_tree<_Key, _Value>::node*
-flat_segment_tree<_Key, _Value>::get_insertion_pos_leaf(key_type key, const node* start_pos) const
+template<typename _Key, typename _Value, typename _Trait>
+const typename flat_segment_tree<_Key, _Value, _Trait>::node*
+flat_segment_tree<_Key, _Value, _Trait>::get_insertion_pos_leaf(key_type key, const node* start_pos) const
 {
     const node* cur_node = start_pos;
     while (cur_node)
@@ -762,17 +2059,19 @@ flat_segment_tree<_Key, _Value>::get_insertion_pos_leaf(key_type key, const node
     return nullptr;
 }
 
-template<typename _Key, typename _Value>
+template<typename _Key, typename _Value, typename _Trait>
 void
-flat_segment_tree<_Key, _Value>::destroy()
+flat_segment_tree<_Key, _Value, _Trait>::destroy()
 {
     disconnect_leaf_nodes(m_left_leaf.get(), m_right_leaf.get());
     m_nonleaf_node_pool.clear();
+    release_search_array();
     m_root_node = nullptr;
+    m_pending_shift = false;
 }
 
-template<typename _Key, typename _Value>
-bool flat_segment_tree<_Key, _Value>::adjust_segment_range(key_type& start_key, key_type& end_key) const
+template<typename _Key, typename _Value, typename _Trait>
+bool flat_segment_tree<_Key, _Value, _Trait>::adjust_segment_range(key_type& start_key, key_type& end_key) const
 {
     if (start_key >= end_key)
         // Invalid order of segment range.
@@ -171,7 +171,8 @@ protected:
 private:
     const value_type& get_current_node_pair()
     {
-        m_current_pair = value_type(m_pos->value_leaf.key, m_pos->value_leaf.value);
+        // The key value may have a pending shift not yet applied.
+        m_current_pair = value_type(m_db->get_leaf_key(m_pos), m_pos->value_leaf.value);
         return m_current_pair;
     }
 
@@ -187,8 +188,8 @@ class const_segment_iterator
     typedef _FstType fst_type;
     friend fst_type;
 
-    const_segment_iterator(const typename fst_type::node* start, const typename fst_type::node* end) :
-        m_start(start), m_end(end)
+    const_segment_iterator(const fst_type* db, const typename fst_type::node* start, const typename fst_type::node* end) :
+        m_db(db), m_start(start), m_end(end)
     {
         update_node();
     }
@@ -202,9 +203,9 @@ public:
         value_type() : start(), end(), value() {}
     };
 
-    const_segment_iterator() : m_start(nullptr), m_end(nullptr) {}
+    const_segment_iterator() : m_db(nullptr), m_start(nullptr), m_end(nullptr) {}
     const_segment_iterator(const const_segment_iterator& other) :
-        m_start(other.m_start), m_end(other.m_end)
+        m_db(other.m_db), m_start(other.m_start), m_end(other.m_end)
     {
         if (m_start)
             update_node();
@@ -224,6 +225,7 @@ public:
 
     const_segment_iterator& operator=(const const_segment_iterator& other)
     {
+        m_db = other.m_db;
         m_start = other.m_start;
         m_end = other.m_end;
         if (m_start)
@@ -286,12 +288,14 @@ private:
             // The iterator is at its end position. Nothing to do.
             return;
 
-        m_node.start = m_start->value_leaf.key;
-        m_node.end = m_end->value_leaf.key;
+        // The key values may have a pending shift not yet applied.
+        m_node.start = m_db->get_leaf_key(m_start);
+        m_node.end = m_db->get_leaf_key(m_end);
         m_node.value = m_start->value_leaf.value;
     }
 
 private:
+    const fst_type* m_db;
     const typename fst_type::node* m_start;
     const typename fst_type::node* m_end;
     value_type m_node;
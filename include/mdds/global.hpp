@@ -144,6 +144,42 @@ struct const_or_not<_T, std::false_type>
 template<typename _T, bool _Const>
 using const_t = typename const_or_not<_T, bool_constant<_Const>>::type;
 
+namespace detail {
+
+/**
+ * Hold on to the first exception thrown from the body of a parallel loop,
+ * to rethrow it once the loop has finished.  An exception must not escape
+ * the body of an OpenMP parallel loop.
+ */
+class loop_exception
+{
+    std::exception_ptr m_exception;
+
+public:
+    /**
+     * Store the exception currently being handled unless one has already
+     * been stored.  Call this only from within a catch block.
+     */
+    void capture()
+    {
+#if MDDS_USE_OPENMP
+        #pragma omp critical (mdds_loop_exception)
+#endif
+        {
+            if (!m_exception)
+                m_exception = std::current_exception();
+        }
+    }
+
+    void rethrow() const
+    {
+        if (m_exception)
+            std::rethrow_exception(m_exception);
+    }
+};
+
+}
+
 template<typename _T, typename _IsConst>
 struct get_iterator_type;
 
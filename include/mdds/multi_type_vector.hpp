@@ -218,6 +218,78 @@ public:
     typedef std::pair<iterator, size_type> position_type;
     typedef std::pair<const_iterator, size_type> const_position_type;
 
+    /**
+     * Builder object used to populate a container from a series of values
+     * and empty segments appended strictly in position order.  It builds
+     * the primary block array directly without going through the regular
+     * element insertion code paths, and hands the finished block array to a
+     * destination container in one step.
+     *
+     * <p>Appending a range of values of identical type allocates the
+     * destination element block storage in one go, with exact size, which
+     * makes this the preferred way of loading large columnar data sets.</p>
+     */
+    class builder
+    {
+        blocks_type m_blocks;
+        size_type m_cur_size;
+
+    public:
+        builder();
+        builder(const builder&) = delete;
+        builder& operator= (const builder&) = delete;
+        ~builder();
+
+        /**
+         * Append a new value to the end of the series being built.
+         *
+         * @param value new value to append.
+         */
+        template<typename _T>
+        void push_back(const _T& value);
+
+        /**
+         * Append a series of values of identical type to the end of the
+         * series being built.
+         *
+         * @param it_begin iterator that points to the begin position of the
+         *                 values being appended.
+         * @param it_end iterator that points to the end position of the
+         *               values being appended.
+         */
+        template<typename _T>
+        void push_back(const _T& it_begin, const _T& it_end);
+
+        /**
+         * Append a segment of empty elements to the end of the series being
+         * built.
+         *
+         * @param length length of the empty segment to append.
+         */
+        void push_back_empty(size_type length = 1);
+
+        /**
+         * Return the logical size of the series built so far.
+         *
+         * @return logical size of the series built so far.
+         */
+        size_type size() const;
+
+        /**
+         * Transfer the built content to a destination container.  The
+         * destination container's original content gets deleted, and the
+         * builder becomes empty after this call.  The destination
+         * container's <code>element_block_acquired</code> event handler
+         * gets called for every element block it receives.
+         *
+         * @param dest destination container that receives the built content.
+         */
+        void finalize(multi_type_vector& dest);
+
+    private:
+        void clear();
+    };
+
     /**
      * Move the position object to the next logical position.  Caller must
      * ensure the the position object is valid.
@@ -846,6 +918,45 @@ public:
      */
     mtv::element_t get_type(size_type pos) const;
 
+    /**
+     * Visit each non-empty element within specified range.  The element type
+     * of each block is checked only once per block against the element
+     * block types specified as the template arguments, and the function
+     * object gets called for each element of a matching block in a tight
+     * loop over the block's underlying array.  The function object must be
+     * callable as <code>func(pos, value)</code>, where <code>pos</code> is
+     * the logical position of the element and <code>value</code> is a
+     * const reference to a value of the matching element block's
+     * <code>value_type</code>.  A lambda overload set is a natural fit.
+     *
+     * <p>Elements in empty blocks and in blocks whose types are not
+     * specified as the template arguments are skipped.</p>
+     *
+     * <p>The method will throw an <code>std::out_of_range</code> exception
+     * if either the starting or the ending position is outside the current
+     * container range.</p>
+     *
+     * @param start_pos starting position
+     * @param end_pos ending position, inclusive.
+     * @param func function object to call for each element.
+     *
+     * @return function object passed to this method.
+     */
+    template<typename... _Blks, typename _Func>
+    _Func for_each_value(size_type start_pos, size_type end_pos, _Func func) const;
+
+    /**
+     * Visit each non-empty element in the container.  This is equivalent of
+     * calling the variant that takes a range with the range covering the
+     * entire container.
+     *
+     * @param func function object to call for each element.
+     *
+     * @return function object passed to this method.
+     */
+    template<typename... _Blks, typename _Func>
+    _Func for_each_value(_Func func) const;
+
     /**
      * Check if element at specified position is empty of not.
      *
@@ -0,0 +1,161 @@
+/*************************************************************************
+ *
+ * Copyright (c) 2021 Kohei Yoshida
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ ************************************************************************/
+
+
+#ifndef INCLUDED_MDDS_MULTI_TYPE_VECTOR_BATCH_EDITOR_HPP
+#define INCLUDED_MDDS_MULTI_TYPE_VECTOR_BATCH_EDITOR_HPP
+
+#include "mdds/global.hpp"
+
+#include <type_traits>
+#include <vector>
+#include <memory>
+
+namespace mdds { namespace mtv {
+
+/**
+ * Special-purpose wrapper around multiple multi_type_vector instances of
+ * the same type and length, to apply identical structural edits i.e.
+ * insertion or removal of element ranges to all of them in one call.  This
+ * is analogous to inserting or deleting rows in a spreadsheet where each
+ * column is stored in its own multi_type_vector instance.
+ *
+ * <p>It keeps one block position hint per vector instance, which gets
+ * updated after each edit and is used to speed up the block lookup in the
+ * next edit.  When OpenMP support is enabled via the
+ * <code>MDDS_USE_OPENMP</code> macro, the edits on individual vector
+ * instances are performed in parallel.</p>
+ *
+ * <p>Note that the vector instances must not be modified by other means
+ * during the lifetime of the batch_editor instance, or else
+ * reset_position_hints() must be called before the next edit.</p>
+ *
+ * <p>When an edit on any of the vector instances throws, the first
+ * exception thrown gets rethrown after all the other vector instances
+ * have been edited.  The vector instances may then differ in length, and
+ * the batch_editor instance should no longer be used.</p>
+ */
+template<typename _MtvT>
+class batch_editor
+{
+public:
+    typedef _MtvT mtv_type;
+    typedef typename mtv_type::size_type size_type;
+
+private:
+    typedef typename mtv_type::iterator mtv_iterator;
+
+    std::vector<mtv_type*> m_vectors;
+    std::vector<mtv_iterator> m_pos_hints;
+    size_type m_mtv_size;
+
+public:
+
+    batch_editor();
+
+    /**
+     * Constructor that takes the start and end iterators of the
+     * multi_type_vector instances to edit.
+     *
+     * @param begin iterator that references the first multi_type_vector
+     *              instance to edit.
+     * @param end iterator that references the position past the last
+     *            multi_type_vector instance to edit.
+     */
+    template<typename _T>
+    batch_editor(const _T& begin, const _T& end);
+
+    /**
+     * Insert a range of empty elements at the same position in all vector
+     * instances.  Those elements originally located after the insertion
+     * position will get shifted down after the insertion.
+     *
+     * <p>The method will throw an <code>std::out_of_range</code> exception
+     * if the specified position is outside the current vector range, in
+     * which case none of the vector instances get modified.</p>
+     *
+     * @param pos position at which to insert a range of empty elements.
+     * @param length number of empty elements to insert.
+     */
+    void insert_empty(size_type pos, size_type length);
+
+    /**
+     * Erase elements located between specified start and end positions in
+     * all vector instances.  The end positions are both inclusive.  Those
+     * elements originally located after the specified end position will get
+     * shifted up after the erasure.
+     *
+     * <p>The method will throw an <code>std::out_of_range</code> exception
+     * if either the starting or the ending position is outside the current
+     * vector range, in which case none of the vector instances get
+     * modified.</p>
+     *
+     * @param start_pos starting position
+     * @param end_pos ending position, inclusive.
+     */
+    void erase(size_type start_pos, size_type end_pos);
+
+    /**
+     * Reset the block position hints of all vector instances.  Call this
+     * when any of the vector instances have been modified outside of this
+     * batch editor.
+     */
+    void reset_position_hints();
+
+    /**
+     * Return the current length of the vector instances being edited.
+     *
+     * @return current length of the vector instances.
+     */
+    size_type size() const;
+
+    /**
+     * Return the number of vector instances being edited.
+     *
+     * @return number of vector instances.
+     */
+    size_type vector_count() const;
+
+private:
+
+    void init_insert_vector(const std::unique_ptr<mtv_type>& p);
+
+    void init_insert_vector(const std::shared_ptr<mtv_type>& p);
+
+    template<typename _T>
+    void init_insert_vector(const _T& t, typename std::enable_if<std::is_pointer<_T>::value>::type* = 0);
+
+    void init_insert_vector(mtv_type& t);
+
+    void check_vector_size(const mtv_type& t);
+};
+
+}}
+
+#include "batch_editor_def.inl"
+
+#endif
@@ -0,0 +1,200 @@
+/*************************************************************************
+ *
+ * Copyright (c) 2021 Kohei Yoshida
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ ************************************************************************/
+
+
+#include <stdexcept>
+#include <sstream>
+#include <cstdint>
+
+namespace mdds { namespace mtv {
+
+template<typename _MtvT>
+batch_editor<_MtvT>::batch_editor() : m_mtv_size(0) {}
+
+template<typename _MtvT>
+template<typename _T>
+batch_editor<_MtvT>::batch_editor(const _T& begin, const _T& end) : m_mtv_size(0)
+{
+    size_type n = std::distance(begin, end);
+    m_vectors.reserve(n);
+
+    for (_T it = begin; it != end; ++it)
+        init_insert_vector(*it);
+
+    reset_position_hints();
+}
+
+template<typename _MtvT>
+void batch_editor<_MtvT>::insert_empty(size_type pos, size_type length)
+{
+    if (!length)
+        // Nothing to insert.
+        return;
+
+    if (pos >= m_mtv_size)
+    {
+        std::ostringstream os;
+        os << "batch_editor::insert_empty: position " << pos << " is outside the vector range of " << m_mtv_size << ".";
+        throw std::out_of_range(os.str());
+    }
+
+    int64_t n = m_vectors.size();
+    mdds::detail::loop_exception loop_error;
+
+#if MDDS_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int64_t i = 0; i < n; ++i)
+    {
+        try
+        {
+            m_pos_hints[i] = m_vectors[i]->insert_empty(m_pos_hints[i], pos, length);
+        }
+        catch (...)
+        {
+            loop_error.capture();
+        }
+    }
+
+    loop_error.rethrow();
+    m_mtv_size += length;
+}
+
+template<typename _MtvT>
+void batch_editor<_MtvT>::erase(size_type start_pos, size_type end_pos)
+{
+    if (start_pos > end_pos)
+        throw std::out_of_range("Start row is larger than the end row.");
+
+    if (end_pos >= m_mtv_size)
+    {
+        std::ostringstream os;
+        os << "batch_editor::erase: end position " << end_pos << " is outside the vector range of " << m_mtv_size << ".";
+        throw std::out_of_range(os.str());
+    }
+
+    int64_t n = m_vectors.size();
+    size_type new_size = m_mtv_size - (end_pos - start_pos + 1);
+    mdds::detail::loop_exception loop_error;
+
+#if MDDS_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int64_t i = 0; i < n; ++i)
+    {
+        try
+        {
+            // Erasing invalidates all iterators of the vector.  Point the
+            // hint to the block at the erased position, or the last block
+            // when the tail has been erased, for the next edit to start
+            // from.
+            mtv_type& mtv = *m_vectors[i];
+            mtv.erase(start_pos, end_pos);
+            if (start_pos < new_size)
+                m_pos_hints[i] = mtv.position(start_pos).first;
+            else if (new_size)
+                m_pos_hints[i] = mtv.position(new_size - 1).first;
+            else
+                m_pos_hints[i] = mtv.begin();
+        }
+        catch (...)
+        {
+            loop_error.capture();
+        }
+    }
+
+    loop_error.rethrow();
+    m_mtv_size = new_size;
+}
+
+template<typename _MtvT>
+void batch_editor<_MtvT>::reset_position_hints()
+{
+    m_pos_hints.clear();
+    m_pos_hints.reserve(m_vectors.size());
+
+    for (mtv_type* p : m_vectors)
+        m_pos_hints.push_back(p->begin());
+}
+
+template<typename _MtvT>
+typename batch_editor<_MtvT>::size_type
+batch_editor<_MtvT>::size() const
+{
+    return m_mtv_size;
+}
+
+template<typename _MtvT>
+typename batch_editor<_MtvT>::size_type
+batch_editor<_MtvT>::vector_count() const
+{
+    return m_vectors.size();
+}
+
+template<typename _MtvT>
+template<typename _T>
+void batch_editor<_MtvT>::init_insert_vector(
+    const _T& t, typename std::enable_if<std::is_pointer<_T>::value>::type*)
+{
+    check_vector_size(*t);
+    m_vectors.emplace_back(t);
+}
+
+template<typename _MtvT>
+void batch_editor<_MtvT>::init_insert_vector(const std::unique_ptr<mtv_type>& p)
+{
+    check_vector_size(*p);
+    m_vectors.emplace_back(p.get());
+}
+
+template<typename _MtvT>
+void batch_editor<_MtvT>::init_insert_vector(const std::shared_ptr<mtv_type>& p)
+{
+    check_vector_size(*p);
+    m_vectors.emplace_back(p.get());
+}
+
+template<typename _MtvT>
+void batch_editor<_MtvT>::init_insert_vector(mtv_type& t)
+{
+    check_vector_size(t);
+    m_vectors.emplace_back(&t);
+}
+
+template<typename _MtvT>
+void batch_editor<_MtvT>::check_vector_size(const mtv_type& t)
+{
+    if (t.empty())
+        throw invalid_arg_error("Empty multi_type_vector instance is not allowed.");
+
+    if (!m_mtv_size)
+        m_mtv_size = t.size();
+    else if (m_mtv_size != t.size())
+        throw invalid_arg_error("All multi_type_vector instances must be of the same length.");
+}
+
+}}
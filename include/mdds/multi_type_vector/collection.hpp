@@ -39,6 +39,9 @@ namespace mdds { namespace mtv {
 template<typename _MtvT>
 class collection;
 
+template<typename _MtvT, typename _ValueT, typename _Func>
+class row_aggregate_cache;
+
 namespace detail {
 
 template<typename _MtvT>
@@ -131,6 +134,104 @@ public:
     bool operator!= (const side_iterator& other) const;
 };
 
+/**
+ * Range of consecutive element positions within which none of the
+ * multi_type_vector instances in a collection cross a block boundary.  In
+ * other words, the element type of each vector instance stays the same
+ * throughout the whole segment.
+ */
+template<typename _MtvT>
+class row_segment
+{
+    typedef _MtvT mtv_type;
+    friend collection<mtv_type>;
+
+    typedef typename mtv_type::size_type size_type;
+    typedef typename mtv_type::const_iterator const_iterator;
+
+public:
+
+    /** block of a single mtv instance that the segment falls within. */
+    struct item
+    {
+        /** type of the elements in this block. */
+        mdds::mtv::element_t type;
+
+        /** element block, or nullptr in case the block is empty. */
+        const mdds::mtv::base_element_block* data;
+
+        /**
+         * offset of the first element of the segment from the first
+         * element of the block.
+         */
+        size_type offset;
+
+        /**
+         * Get the value of an element in the segment.
+         *
+         * @param pos 0-based position of the element relative to the first
+         *            element of the segment.
+         *
+         * @return element value.
+         */
+        template<typename _Blk>
+        typename _Blk::value_type get(size_type pos) const
+        {
+            return _Blk::get_value(*data, offset + pos);
+        }
+    };
+
+private:
+    std::vector<const_iterator> m_block_positions;
+    std::vector<item> m_items;
+    size_type m_position;
+    size_type m_size;
+    size_type m_index_offset;
+
+    row_segment(size_type index_offset);
+
+public:
+
+    /**
+     * Return the logical position of the first element of the segment.
+     *
+     * @return logical position of the first element.
+     */
+    size_type position() const { return m_position; }
+
+    /**
+     * Return the number of element positions in the segment.
+     *
+     * @return length of the segment.
+     */
+    size_type size() const { return m_size; }
+
+    /**
+     * Return the index of the first mtv instance in the segment, relative
+     * to the first mtv instance in the whole collection.
+     *
+     * @return index of the first mtv instance.
+     */
+    size_type index_offset() const { return m_index_offset; }
+
+    /**
+     * Return the number of mtv instances in the segment.
+     *
+     * @return number of mtv instances.
+     */
+    size_type vector_count() const { return m_items.size(); }
+
+    /**
+     * Access the block information of a single mtv instance.
+     *
+     * @param i 0-based index of the mtv instance, relative to the first mtv
+     *          instance of the segment.
+     *
+     * @return block information of the mtv instance.
+     */
+    const item& operator[] (size_type i) const { return m_items[i]; }
+};
+
 }
 
 /**
@@ -142,6 +243,9 @@ public:
 template<typename _MtvT>
 class collection
 {
+    template<typename _MtvT2, typename _ValueT, typename _Func>
+    friend class row_aggregate_cache;
+
 public:
     typedef _MtvT mtv_type;
     typedef typename mtv_type::size_type size_type;
@@ -166,6 +270,7 @@ private:
 public:
 
     typedef detail::side_iterator<mtv_type> const_iterator;
+    typedef detail::row_segment<mtv_type> row_segment_type;
 
     collection();
 
@@ -248,8 +353,60 @@ public:
      */
     void set_element_range(size_type start, size_type size);
 
+    /**
+     * Walk the current element range by segments, within each of which the
+     * element type of each vector instance stays the same.  The function
+     * object gets called once per segment with a row_segment_type instance
+     * as its argument, which provides direct access to the element blocks
+     * covering the segment.  The segments are visited in ascending order of
+     * their positions, and cover the entire element range.
+     *
+     * <p>Only the vector instances in the current collection range are
+     * considered.</p>
+     *
+     * @param func function object to call for each segment.
+     *
+     * @return function object passed to this method.
+     */
+    template<typename _Func>
+    _Func walk_row_segments(_Func func) const;
+
+    /**
+     * Walk the current element range by segments, same as
+     * walk_row_segments(), except that the element range first gets split
+     * into multiple partitions of roughly equal lengths which then get
+     * walked independently.  When OpenMP support is enabled via the
+     * <code>MDDS_USE_OPENMP</code> macro, the partitions are walked in
+     * parallel.
+     *
+     * <p>The function object gets called with two arguments: the 0-based
+     * index of the partition and a row_segment_type instance.  When OpenMP
+     * support is enabled, the same function object instance gets called from
+     * several threads at once, one per partition being walked.  It must
+     * therefore be safe to call concurrently, e.g. by only writing to state
+     * indexed by the partition.  The calls within the same partition are
+     * always sequential and in ascending order of the segment positions.
+     * Note that a segment never spans across partitions.</p>
+     *
+     * <p>When the function object throws, the first exception thrown gets
+     * rethrown after all partitions have been walked.</p>
+     *
+     * @param func function object to call for each segment.
+     * @param partition_count number of partitions to split the element
+     *                        range into.  When the element range is shorter
+     *                        than this value, the number of partitions is
+     *                        reduced to the length of the element range.
+     *
+     * @return function object passed to this method.
+     */
+    template<typename _Func>
+    _Func walk_row_segments(_Func func, size_type partition_count) const;
+
 private:
 
+    template<typename _Func>
+    void walk_row_segments_in_range(_Func& func, size_type start, size_type end) const;
+
     void check_collection_range(size_type start, size_type size) const;
     void check_element_range(size_type start, size_type size) const;
 
@@ -26,6 +26,7 @@
  ************************************************************************/
 
 #include <sstream>
+#include <cstdint>
 
 namespace mdds { namespace mtv {
 
@@ -133,6 +134,10 @@ bool side_iterator<_MtvT>::operator!= (const side_iterator& other) const
     return !operator==(other);
 }
 
+template<typename _MtvT>
+row_segment<_MtvT>::row_segment(size_type index_offset) :
+    m_position(0), m_size(0), m_index_offset(index_offset) {}
+
 }
 
 template<typename _MtvT>
@@ -224,6 +229,117 @@ void collection<_MtvT>::set_element_range(size_type start, size_type size)
     m_elem_range.size = size;
 }
 
+template<typename _MtvT>
+template<typename _Func>
+_Func collection<_MtvT>::walk_row_segments(_Func func) const
+{
+    walk_row_segments_in_range(func, m_elem_range.start, m_elem_range.start+m_elem_range.size);
+    return func;
+}
+
+template<typename _MtvT>
+template<typename _Func>
+_Func collection<_MtvT>::walk_row_segments(_Func func, size_type partition_count) const
+{
+    if (!partition_count)
+        throw invalid_arg_error("partition count of 0 is not allowed.");
+
+    size_type start = m_elem_range.start;
+    size_type len = m_elem_range.size;
+
+    if (partition_count > len)
+        partition_count = len;
+
+    int64_t n = partition_count;
+    mdds::detail::loop_exception loop_error;
+
+#if MDDS_USE_OPENMP
+    #pragma omp parallel for
+#endif
+    for (int64_t i = 0; i < n; ++i)
+    {
+        try
+        {
+            size_type part_start = start + len * i / n;
+            size_type part_end = start + len * (i+1) / n;
+
+            auto func_part = [&func, i](const row_segment_type& seg)
+            {
+                func(size_type(i), seg);
+            };
+
+            walk_row_segments_in_range(func_part, part_start, part_end);
+        }
+        catch (...)
+        {
+            loop_error.capture();
+        }
+    }
+
+    loop_error.rethrow();
+    return func;
+}
+
+template<typename _MtvT>
+template<typename _Func>
+void collection<_MtvT>::walk_row_segments_in_range(_Func& func, size_type start, size_type end) const
+{
+    if (start >= end || !m_col_range.size)
+        return;
+
+    row_segment_type seg(m_col_range.start);
+    seg.m_block_positions.reserve(m_col_range.size);
+    seg.m_items.resize(m_col_range.size);
+
+    auto it = m_vectors.begin();
+    std::advance(it, m_col_range.start);
+    auto it_end = it;
+    std::advance(it_end, m_col_range.size);
+
+    std::for_each(it, it_end,
+        [&](const mtv_type* p)
+        {
+            seg.m_block_positions.push_back(p->position(start).first);
+        }
+    );
+
+    const size_type n = seg.m_items.size();
+
+    for (size_type pos = start; pos < end; )
+    {
+        size_type seg_end = end;
+
+        for (size_type i = 0; i < n; ++i)
+        {
+            auto& blk_pos = seg.m_block_positions[i];
+            size_type blk_end = blk_pos->position + blk_pos->size;
+            if (blk_end <= pos)
+            {
+                // The previous segment ended at the end of this block. A
+                // segment never crosses a block boundary, so the next block
+                // always contains the current position.
+                ++blk_pos;
+                blk_end = blk_pos->position + blk_pos->size;
+            }
+
+            assert(blk_pos->position <= pos && pos < blk_end);
+
+            typename row_segment_type::item& item = seg.m_items[i];
+            item.type = blk_pos->type;
+            item.data = blk_pos->data;
+            item.offset = pos - blk_pos->position;
+
+            if (blk_end < seg_end)
+                seg_end = blk_end;
+        }
+
+        seg.m_position = pos;
+        seg.m_size = seg_end - pos;
+        func(static_cast<const row_segment_type&>(seg));
+        pos = seg_end;
+    }
+}
+
 template<typename _MtvT>
 void collection<_MtvT>::check_collection_range(size_type start, size_type size) const
 {
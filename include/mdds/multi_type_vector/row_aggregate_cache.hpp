@@ -0,0 +1,150 @@
+/*************************************************************************
+ *
+ * Copyright (c) 2021 Kohei Yoshida
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ ************************************************************************/
+
+
+#ifndef INCLUDED_MDDS_MULTI_TYPE_VECTOR_ROW_AGGREGATE_CACHE_HPP
+#define INCLUDED_MDDS_MULTI_TYPE_VECTOR_ROW_AGGREGATE_CACHE_HPP
+
+#include "mdds/multi_type_vector/collection.hpp"
+#include "mdds/flat_segment_tree.hpp"
+
+#include <vector>
+
+namespace mdds { namespace mtv {
+
+/**
+ * Cache of per-row aggregate values computed across all multi_type_vector
+ * instances of a collection, for instance the sum of all numeric values in
+ * each row.  It keeps track of the row ranges that have been marked dirty
+ * since the last update, and only recomputes the aggregate values of those
+ * rows on the next query.  This makes the cost of keeping the aggregate
+ * values up-to-date proportional to the size of the edits rather than to
+ * the size of the collection.
+ *
+ * <p>The aggregate values are computed by a user-provided function object
+ * which gets called with a collection::row_segment_type instance and an
+ * iterator to the output values of the rows in the segment.  The output
+ * values are initialized with <code>_ValueT()</code> prior to the call, and
+ * the function object is expected to fold the values of all vector
+ * instances into them.</p>
+ *
+ * <p>Note that element block events alone are not sufficient to detect
+ * value changes, since overwriting existing values does not acquire or
+ * release any element block, and the events do not carry the positions of
+ * the blocks.  It is therefore the responsibility of the caller to call
+ * mark_dirty() after modifying any of the vector instances.  Modifications
+ * that change the length of the vector instances, or changes to the
+ * collection or element range of the collection, require a new cache
+ * instance.</p>
+ */
+template<typename _MtvT, typename _ValueT, typename _Func>
+class row_aggregate_cache
+{
+public:
+    typedef _MtvT mtv_type;
+    typedef _ValueT value_type;
+    typedef collection<mtv_type> collection_type;
+    typedef typename mtv_type::size_type size_type;
+    typedef typename std::vector<value_type>::iterator output_iterator;
+
+private:
+    typedef flat_segment_tree<size_type, bool> dirty_ranges_type;
+
+    const collection_type& m_collection;
+    _Func m_func;
+    size_type m_start;
+    std::vector<value_type> m_values;
+    dirty_ranges_type m_dirty;
+    bool m_has_dirty;
+
+public:
+
+    /**
+     * Constructor.  All rows are initially marked dirty.
+     *
+     * @param cols collection whose current element range and collection
+     *             range the cache covers.  The collection instance must
+     *             outlive the cache.
+     * @param func function object that computes the aggregate values.
+     */
+    row_aggregate_cache(const collection_type& cols, _Func func);
+
+    /**
+     * Mark a range of rows dirty so that their aggregate values get
+     * recomputed on the next query.  Any part of the range that falls
+     * outside the element range of the collection is ignored.
+     *
+     * @param start_pos logical position of the first row to mark dirty.
+     * @param end_pos logical position of the last row to mark dirty,
+     *                inclusive.
+     */
+    void mark_dirty(size_type start_pos, size_type end_pos);
+
+    /**
+     * Mark all rows dirty.
+     */
+    void mark_all_dirty();
+
+    /**
+     * Recompute the aggregate values of all dirty rows.
+     */
+    void update();
+
+    /**
+     * Get the aggregate value of a row.  It recomputes the aggregate values
+     * of all dirty rows first if there are any.
+     *
+     * <p>The method will throw an <code>std::out_of_range</code> exception
+     * if the specified position is outside the element range of the
+     * collection.</p>
+     *
+     * @param pos logical position of the row.
+     *
+     * @return aggregate value of the row.
+     */
+    const value_type& get(size_type pos);
+
+    /**
+     * Check whether or not any rows are currently marked dirty.
+     *
+     * @return true if there are dirty rows, false otherwise.
+     */
+    bool is_dirty() const;
+
+    /**
+     * Return the number of rows the cache covers.
+     *
+     * @return number of rows.
+     */
+    size_type size() const;
+};
+
+}}
+
+#include "row_aggregate_cache_def.inl"
+
+#endif
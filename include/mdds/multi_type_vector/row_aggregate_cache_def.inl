@@ -0,0 +1,136 @@
+/*************************************************************************
+ *
+ * Copyright (c) 2021 Kohei Yoshida
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ ************************************************************************/
+
+
+#include <stdexcept>
+#include <sstream>
+
+namespace mdds { namespace mtv {
+
+template<typename _MtvT, typename _ValueT, typename _Func>
+row_aggregate_cache<_MtvT, _ValueT, _Func>::row_aggregate_cache(const collection_type& cols, _Func func) :
+    m_collection(cols),
+    m_func(std::move(func)),
+    m_start(cols.m_elem_range.start),
+    m_values(cols.m_elem_range.size),
+    m_dirty(0, cols.m_elem_range.size, false),
+    m_has_dirty(false)
+{
+    mark_all_dirty();
+}
+
+template<typename _MtvT, typename _ValueT, typename _Func>
+void row_aggregate_cache<_MtvT, _ValueT, _Func>::mark_dirty(size_type start_pos, size_type end_pos)
+{
+    if (start_pos > end_pos)
+        throw std::out_of_range("Start row is larger than the end row.");
+
+    // Convert to positions relative to the start of the element range, and
+    // clip them to the element range.
+    size_type end_range = m_start + m_values.size();
+    if (end_pos < m_start || start_pos >= end_range)
+        return;
+
+    // Clamp the end position before converting it to an open-ended one, so
+    // that it doesn't overflow.
+    end_pos = std::min(end_pos, end_range - 1);
+
+    size_type start = std::max(start_pos, m_start) - m_start;
+    size_type end = end_pos + 1 - m_start;
+
+    m_dirty.insert_front(start, end, true);
+    m_has_dirty = true;
+}
+
+template<typename _MtvT, typename _ValueT, typename _Func>
+void row_aggregate_cache<_MtvT, _ValueT, _Func>::mark_all_dirty()
+{
+    if (m_values.empty())
+        return;
+
+    m_dirty.insert_front(0, m_values.size(), true);
+    m_has_dirty = true;
+}
+
+template<typename _MtvT, typename _ValueT, typename _Func>
+void row_aggregate_cache<_MtvT, _ValueT, _Func>::update()
+{
+    if (!m_has_dirty)
+        return;
+
+    auto func = [this](const typename collection_type::row_segment_type& seg)
+    {
+        output_iterator it = m_values.begin();
+        std::advance(it, seg.position() - m_start);
+        output_iterator it_end = it;
+        std::advance(it_end, seg.size());
+        std::fill(it, it_end, value_type());
+        m_func(seg, it);
+    };
+
+    auto it = m_dirty.begin_segment(), it_end = m_dirty.end_segment();
+    for (; it != it_end; ++it)
+    {
+        if (!it->value)
+            continue;
+
+        m_collection.walk_row_segments_in_range(func, m_start + it->start, m_start + it->end);
+    }
+
+    m_dirty.clear();
+    m_has_dirty = false;
+}
+
+template<typename _MtvT, typename _ValueT, typename _Func>
+const typename row_aggregate_cache<_MtvT, _ValueT, _Func>::value_type&
+row_aggregate_cache<_MtvT, _ValueT, _Func>::get(size_type pos)
+{
+    if (pos < m_start || pos >= m_start + m_values.size())
+    {
+        std::ostringstream os;
+        os << "row_aggregate_cache::get: position " << pos << " is outside the element range.";
+        throw std::out_of_range(os.str());
+    }
+
+    update();
+    return m_values[pos - m_start];
+}
+
+template<typename _MtvT, typename _ValueT, typename _Func>
+bool row_aggregate_cache<_MtvT, _ValueT, _Func>::is_dirty() const
+{
+    return m_has_dirty;
+}
+
+template<typename _MtvT, typename _ValueT, typename _Func>
+typename row_aggregate_cache<_MtvT, _ValueT, _Func>::size_type
+row_aggregate_cache<_MtvT, _ValueT, _Func>::size() const
+{
+    return m_values.size();
+}
+
+}}
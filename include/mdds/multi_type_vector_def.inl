@@ -125,6 +125,30 @@ bool compare_blocks(const _Blk& left, const _Blk& right)
     return left.m_position < right.m_position;
 }
 
+template<typename _Blk, typename _SizeT, typename _Func>
+bool for_each_value_in_block(
+    const mdds::mtv::base_element_block& data, _SizeT pos, _SizeT offset, _SizeT len, _Func& func)
+{
+    if (mdds::mtv::get_block_type(data) != _Blk::block_type)
+        return false;
+
+    auto it = _Blk::cbegin(data);
+    std::advance(it, offset);
+
+    for (_SizeT i = 0; i < len; ++i, ++it, ++pos)
+        func(pos, *it);
+
+    return true;
+}
+
+template<typename... _Blks, typename _SizeT, typename _Func>
+void for_each_value_in_typed_block(
+    const mdds::mtv::base_element_block& data, _SizeT pos, _SizeT offset, _SizeT len, _Func& func)
+{
+    // Stop at the first block type that matches.
+    (for_each_value_in_block<_Blks>(data, pos, offset, len, func) || ...);
+}
+
 }} // namespace detail::mtv
 
 MDDS_MTV_DEFINE_ELEMENT_CALLBACKS(bool, mtv::element_type_boolean, false, mtv::boolean_element_block)
@@ -173,6 +197,124 @@ void multi_type_vector<_CellBlockFunc, _EventFunc>::block::clone_to(block& other
 template<typename _CellBlockFunc, typename _EventFunc>
 multi_type_vector<_CellBlockFunc, _EventFunc>::blocks_to_transfer::blocks_to_transfer() : insert_index(0) {}
 
+template<typename _CellBlockFunc, typename _EventFunc>
+multi_type_vector<_CellBlockFunc, _EventFunc>::builder::builder() : m_cur_size(0) {}
+
+template<typename _CellBlockFunc, typename _EventFunc>
+multi_type_vector<_CellBlockFunc, _EventFunc>::builder::~builder()
+{
+    clear();
+}
+
+template<typename _CellBlockFunc, typename _EventFunc>
+template<typename _T>
+void multi_type_vector<_CellBlockFunc, _EventFunc>::builder::push_back(const _T& value)
+{
+    element_category_type cat = mdds_mtv_get_element_type(value);
+
+    if (m_blocks.empty() || !m_blocks.back().mp_data || cat != get_block_type(*m_blocks.back().mp_data))
+    {
+        // Start a new block.
+        element_block_type* data = mdds_mtv_create_new_block(1, value);
+        m_blocks.emplace_back(m_cur_size, 1, data);
+    }
+    else
+    {
+        // Append to the last block of the same type.
+        block& blk_last = m_blocks.back();
+        mdds_mtv_append_value(*blk_last.mp_data, value);
+        ++blk_last.m_size;
+    }
+
+    ++m_cur_size;
+}
+
+template<typename _CellBlockFunc, typename _EventFunc>
+template<typename _T>
+void multi_type_vector<_CellBlockFunc, _EventFunc>::builder::push_back(const _T& it_begin, const _T& it_end)
+{
+    size_type length = std::distance(it_begin, it_end);
+    if (!length)
+        // Nothing to append.
+        return;
+
+    element_category_type cat = mdds_mtv_get_element_type(*it_begin);
+
+    if (m_blocks.empty() || !m_blocks.back().mp_data || cat != get_block_type(*m_blocks.back().mp_data))
+    {
+        // Create a new element block directly from the source range, which
+        // allocates its storage exactly once.
+        element_block_type* data = mdds_mtv_create_new_block(*it_begin, it_begin, it_end);
+        m_blocks.emplace_back(m_cur_size, length, data);
+    }
+    else
+    {
+        block& blk_last = m_blocks.back();
+        mdds_mtv_append_values(*blk_last.mp_data, *it_begin, it_begin, it_end);
+        blk_last.m_size += length;
+    }
+
+    m_cur_size += length;
+}
+
+template<typename _CellBlockFunc, typename _EventFunc>
+void multi_type_vector<_CellBlockFunc, _EventFunc>::builder::push_back_empty(size_type length)
+{
+    if (!length)
+        // Nothing to append.
+        return;
+
+    if (m_blocks.empty() || m_blocks.back().mp_data)
+        m_blocks.emplace_back(m_cur_size, length);
+    else
+        // Last block is empty.  Just extend it.
+        m_blocks.back().m_size += length;
+
+    m_cur_size += length;
+}
+
+template<typename _CellBlockFunc, typename _EventFunc>
+typename multi_type_vector<_CellBlockFunc, _EventFunc>::size_type
+multi_type_vector<_CellBlockFunc, _EventFunc>::builder::size() const
+{
+    return m_cur_size;
+}
+
+template<typename _CellBlockFunc, typename _EventFunc>
+void multi_type_vector<_CellBlockFunc, _EventFunc>::builder::finalize(multi_type_vector& dest)
+{
+    dest.clear();
+    dest.m_blocks.swap(m_blocks);
+    dest.m_cur_size = m_cur_size;
+    m_cur_size = 0;
+
+    for (block& blk : dest.m_blocks)
+    {
+        if (blk.mp_data)
+            dest.m_hdl_event.element_block_acquired(blk.mp_data);
+    }
+
+#ifdef MDDS_MULTI_TYPE_VECTOR_DEBUG
+    if (!dest.check_block_integrity())
+    {
+        cerr << "block integrity check failed in builder::finalize" << endl;
+        abort();
+    }
+#endif
+}
+
+template<typename _CellBlockFunc, typename _EventFunc>
+void multi_type_vector<_CellBlockFunc, _EventFunc>::builder::clear()
+{
+    // The element blocks have never been handed to any container, so no
+    // event handler gets notified.
+    for (block& blk : m_blocks)
+        element_block_func::delete_block(blk.mp_data);
+
+    m_blocks.clear();
+    m_cur_size = 0;
+}
+
 template<typename _CellBlockFunc, typename _EventFunc>
 typename multi_type_vector<_CellBlockFunc, _EventFunc>::position_type
 multi_type_vector<_CellBlockFunc, _EventFunc>::next_position(const position_type& pos)
@@ -1841,6 +1983,52 @@ mtv::element_t multi_type_vector<_CellBlockFunc, _EventFunc>::get_type(size_type
     return mtv::get_block_type(*blk->mp_data);
 }
 
+template<typename _CellBlockFunc, typename _EventFunc>
+template<typename... _Blks, typename _Func>
+_Func multi_type_vector<_CellBlockFunc, _EventFunc>::for_each_value(
+    size_type start_pos, size_type end_pos, _Func func) const
+{
+    if (start_pos > end_pos)
+        throw std::out_of_range("Start row is larger than the end row.");
+
+    if (end_pos >= m_cur_size)
+        throw std::out_of_range("End row is outside the container range.");
+
+    size_type block_index = get_block_position(start_pos);
+    if (block_index == m_blocks.size())
+        detail::mtv::throw_block_position_not_found(
+            "multi_type_vector::for_each_value", __LINE__, start_pos, block_size(), size());
+
+    for (size_type n = m_blocks.size(); block_index < n; ++block_index)
+    {
+        const block& blk = m_blocks[block_index];
+        if (blk.m_position > end_pos)
+            break;
+
+        if (!blk.mp_data)
+            // Skip empty blocks.
+            continue;
+
+        size_type pos = std::max(start_pos, blk.m_position);
+        size_type last_pos = std::min(end_pos, blk.m_position + blk.m_size - 1);
+
+        detail::mtv::for_each_value_in_typed_block<_Blks...>(
+            *blk.mp_data, pos, pos - blk.m_position, last_pos - pos + 1, func);
+    }
+
+    return func;
+}
+
+template<typename _CellBlockFunc, typename _EventFunc>
+template<typename... _Blks, typename _Func>
+_Func multi_type_vector<_CellBlockFunc, _EventFunc>::for_each_value(_Func func) const
+{
+    if (!m_cur_size)
+        return func;
+
+    return for_each_value<_Blks...>(0, m_cur_size-1, std::move(func));
+}
+
 template<typename _CellBlockFunc, typename _EventFunc>
 bool multi_type_vector<_CellBlockFunc, _EventFunc>::is_empty(size_type pos) const
 {
@@ -30,7 +30,10 @@
 
 #include <iostream>
 #include <vector>
+#include <memory>
 #include <cassert>
+#include <cstdint>
+#include <new>
 
 #include <boost/intrusive_ptr.hpp>
 
@@ -160,6 +163,7 @@ struct node : public node_base
 #endif
     }
 
+    bool                pooled; /// whether or not the node lives in a node_pool.
     leaf_value_type     value_leaf;
 
     node_ptr    prev;   /// previous sibling leaf node.
@@ -174,7 +178,7 @@ private:
 #endif
 
 public:
-    node() : node_base(true), refcount(0)
+    node() : node_base(true), pooled(false), refcount(0)
     {
 #ifdef MDDS_DEBUG_NODE_BASE
         ++node_instance_count;
@@ -186,7 +190,7 @@ public:
      * When copying node, only the stored values should be copied.
      * Connections to the parent, left and right nodes must not be copied.
      */
-    node(const node& r) : node_base(r), refcount(0)
+    node(const node& r) : node_base(r), pooled(false), refcount(0)
     {
 #ifdef MDDS_DEBUG_NODE_BASE
         ++node_instance_count;
@@ -238,6 +242,216 @@ public:
 #endif
 };
 
+/**
+ * Storage for leaf nodes, carved out of contiguous chunks instead of being
+ * allocated individually.  Each chunk is aligned to its own size and starts
+ * with a header, so that the chunk of a pooled node can be found from the
+ * address of the node alone.  A pooled node gets destroyed and its slot
+ * recycled as soon as its last reference goes away, same as an individually
+ * allocated node gets deleted.
+ *
+ * The chunks don't depend on the lifetime of the pool itself.  When the
+ * pool gets destroyed, any chunk still holding live nodes stays around
+ * until its last node gets released.
+ */
+template<typename T>
+class node_pool
+{
+public:
+    typedef node<T> node_type;
+
+    node_pool() : m_free_chunks(nullptr) {}
+
+    node_pool(const node_pool&) = delete;
+    node_pool& operator=(const node_pool&) = delete;
+
+    ~node_pool()
+    {
+        for (chunk_header* chunk : m_chunks)
+        {
+            chunk->pool = nullptr;
+            if (!chunk->live_count)
+                deallocate_chunk(chunk);
+        }
+    }
+
+    node_type* create()
+    {
+        void* slot = allocate_slot();
+        node_type* p = nullptr;
+        try
+        {
+            p = new (slot) node_type();
+        }
+        catch (...)
+        {
+            recycle_slot(get_chunk(slot), slot);
+            throw;
+        }
+
+        p->pooled = true;
+        return p;
+    }
+
+    node_type* create(const node_type& r)
+    {
+        void* slot = allocate_slot();
+        node_type* p = nullptr;
+        try
+        {
+            p = new (slot) node_type(r);
+        }
+        catch (...)
+        {
+            recycle_slot(get_chunk(slot), slot);
+            throw;
+        }
+
+        p->pooled = true;
+        return p;
+    }
+
+    /**
+     * Destroy a pooled node, and recycle its slot.  This gets called when
+     * the last reference to the node goes away.
+     */
+    static void destroy(node_type* p)
+    {
+        chunk_header* chunk = get_chunk(p);
+        p->~node_type();
+        recycle_slot(chunk, p);
+    }
+
+    /**
+     * Free all chunks at once without destroying the nodes in them.  The
+     * caller must ensure that no node pointers reference any of the nodes,
+     * and that destroying the nodes would have no side effects other than
+     * releasing other nodes in this pool.
+     */
+    void discard_all()
+    {
+        for (chunk_header* chunk : m_chunks)
+        {
+#ifdef MDDS_DEBUG_NODE_BASE
+            node_instance_count -= chunk->live_count;
+#endif
+            deallocate_chunk(chunk);
+        }
+
+        m_chunks.clear();
+        m_free_chunks = nullptr;
+    }
+
+private:
+    struct free_slot
+    {
+        free_slot* next;
+    };
+
+    struct chunk_header
+    {
+        node_pool* pool;                /// owning pool, or null once the pool is gone.
+        chunk_header* next_free_chunk;  /// next chunk in the pool's list of chunks with free slots.
+        free_slot* free_slots;          /// slots of destroyed nodes.
+        size_t used_count;              /// number of slots that have ever been used.
+        size_t live_count;              /// number of slots that hold a node.
+        bool in_free_chunks;            /// whether or not the chunk is in the pool's list.
+    };
+
+    static constexpr size_t get_chunk_size(size_t min_size)
+    {
+        size_t size = 65536;
+        while (size < min_size)
+            size *= 2;
+        return size;
+    }
+
+    static constexpr size_t slot_offset =
+        (sizeof(chunk_header) + alignof(node_type) - 1) / alignof(node_type) * alignof(node_type);
+
+    /** Size of each chunk in bytes, which is also its alignment. */
+    static constexpr size_t chunk_size = get_chunk_size(slot_offset + sizeof(node_type) * 64);
+
+    static constexpr size_t slots_per_chunk = (chunk_size - slot_offset) / sizeof(node_type);
+
+    static chunk_header* get_chunk(const void* p)
+    {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(p);
+        return reinterpret_cast<chunk_header*>(addr & ~uintptr_t(chunk_size - 1));
+    }
+
+    static node_type* get_slots(chunk_header* chunk)
+    {
+        return reinterpret_cast<node_type*>(reinterpret_cast<char*>(chunk) + slot_offset);
+    }
+
+    static void deallocate_chunk(chunk_header* chunk)
+    {
+        chunk->~chunk_header();
+        ::operator delete(chunk, std::align_val_t(chunk_size));
+    }
+
+    static void recycle_slot(chunk_header* chunk, void* slot)
+    {
+        chunk->free_slots = new (slot) free_slot{chunk->free_slots};
+        --chunk->live_count;
+
+        if (!chunk->pool)
+        {
+            // The pool is gone.  Free the chunk with its last node.
+            if (!chunk->live_count)
+                deallocate_chunk(chunk);
+            return;
+        }
+
+        if (!chunk->in_free_chunks)
+        {
+            chunk->next_free_chunk = chunk->pool->m_free_chunks;
+            chunk->pool->m_free_chunks = chunk;
+            chunk->in_free_chunks = true;
+        }
+    }
+
+    void append_chunk()
+    {
+        m_chunks.reserve(m_chunks.size() + 1);
+        void* mem = ::operator new(chunk_size, std::align_val_t(chunk_size));
+        chunk_header* chunk = new (mem) chunk_header{this, m_free_chunks, nullptr, 0, 0, true};
+        m_chunks.push_back(chunk);
+        m_free_chunks = chunk;
+    }
+
+    void* allocate_slot()
+    {
+        if (!m_free_chunks)
+            append_chunk();
+
+        chunk_header* chunk = m_free_chunks;
+        void* slot = nullptr;
+        if (chunk->free_slots)
+        {
+            slot = chunk->free_slots;
+            chunk->free_slots = chunk->free_slots->next;
+        }
+        else
+            slot = get_slots(chunk) + chunk->used_count++;
+
+        ++chunk->live_count;
+
+        if (!chunk->free_slots && chunk->used_count == slots_per_chunk)
+        {
+            // This chunk is full.
+            m_free_chunks = chunk->next_free_chunk;
+            chunk->in_free_chunks = false;
+        }
+
+        return slot;
+    }
+
+    std::vector<chunk_header*> m_chunks;
+    chunk_header* m_free_chunks; /// chunks with free slots, most recently freed first.
+};
+
 template<typename T>
 inline void intrusive_ptr_add_ref(node<T>* p)
 {
@@ -248,7 +462,12 @@ template<typename T>
 inline void intrusive_ptr_release(node<T>* p)
 {
     --p->refcount;
-    if (!p->refcount)
+    if (p->refcount)
+        return;
+
+    if (p->pooled)
+        node_pool<T>::destroy(p);
+    else
         delete p;
 }
 
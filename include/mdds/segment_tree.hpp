@@ -35,7 +35,9 @@
 #include <iostream>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
+#include <cstdint>
 
 #ifdef MDDS_UNIT_TEST
 #include <sstream>
@@ -43,6 +45,128 @@
 
 namespace mdds {
 
+template<typename _Key, typename _Value>
+class segment_tree;
+
+/**
+ * Immutable snapshot of a segment_tree, created by segment_tree::freeze().
+ * All nodes of the tree are stored in one array in breadth-first order,
+ * and the data chains of all nodes are packed into one array of values
+ * indexed by an array of per-node offsets.  Compared to the source tree,
+ * this eliminates the separate allocation of each node and each data
+ * chain, and a search touches far fewer cache lines.  Since none of its
+ * methods modify its content, any number of threads can query the same
+ * instance concurrently without synchronization.
+ */
+template<typename _Key, typename _Value>
+class frozen_segment_tree
+{
+    friend class segment_tree<_Key, _Value>;
+
+public:
+    typedef _Key        key_type;
+    typedef _Value      value_type;
+    typedef size_t      size_type;
+    typedef ::std::vector<value_type> search_result_type;
+
+    /**
+     * Default constructor creates an empty instance with no segments.
+     */
+    frozen_segment_tree();
+
+    /**
+     * Search for all segments that include a specified point, and pass the
+     * data instance of each segment to a function object.
+     *
+     * @param point specified point value
+     * @param func function object whose operator() takes a data instance as
+     *             its only argument.
+     *
+     * @return function object passed to this method, after it has visited
+     *         all data instances.
+     */
+    template<typename _Func>
+    _Func search(key_type point, _Func func) const;
+
+    /**
+     * Search for all segments that include a specified point.
+     *
+     * @param point specified point value
+     * @param result array to which the data instances associated with the
+     *               segments that include the point get appended.
+     */
+    void search(key_type point, search_result_type& result) const;
+
+    /**
+     * Count the segments that include a specified point.
+     *
+     * @param point specified point value
+     *
+     * @return number of segments that include the point.
+     */
+    size_type count(key_type point) const;
+
+    /**
+     * @return number of segments stored.
+     */
+    size_type size() const
+    {
+        return m_segment_count;
+    }
+
+    bool empty() const
+    {
+        return m_segment_count == 0;
+    }
+
+    /**
+     * @return number of nodes, leaf or non-leaf, stored.
+     */
+    size_type node_size() const
+    {
+        return m_nodes.size();
+    }
+
+private:
+    static constexpr uint32_t no_child = UINT32_MAX;
+
+    struct node_type
+    {
+        key_type low;   /// low range value (inclusive)
+        key_type high;  /// high range value (non-inclusive)
+        uint32_t left;  /// position of the left child, or no_child for leaf
+        uint32_t right; /// position of the right child, or no_child
+    };
+
+    /**
+     * Segment that was pending in the source tree, and is not part of the
+     * packed nodes.
+     */
+    struct extra_segment
+    {
+        key_type begin_key;
+        key_type end_key;
+        value_type value;
+    };
+
+    /**
+     * Call the function object with the range of values stored in each node
+     * that includes the point.
+     */
+    template<typename _Func>
+    void descend(key_type point, _Func& func) const;
+
+private:
+    std::vector<node_type> m_nodes;
+
+    /** Start position of each node's data chain, plus the end position. */
+    std::vector<uint32_t> m_chain_offsets;
+    std::vector<value_type> m_chain_values;
+
+    std::vector<extra_segment> m_extra_segments;
+    size_type m_segment_count;
+};
+
 template<typename _Key, typename _Value>
 class segment_tree
 {
@@ -121,6 +245,8 @@ public:
     typedef __st::node<segment_tree> node;
     typedef typename node::node_ptr node_ptr;
 
+    typedef frozen_segment_tree<key_type, value_type> frozen_type;
+
     typedef typename __st::nonleaf_node<segment_tree> nonleaf_node;
 
     struct fill_nonleaf_value_handler
@@ -284,6 +410,30 @@ private:
             mp_res_chains->push_back(chain);
         }
 
+        /**
+         * Append a chain of values not stored in the tree.  The result takes
+         * ownership of the chain, which stays alive as long as any iterator
+         * referencing the result.
+         */
+        void push_back_owned_chain(data_chain_type&& chain)
+        {
+            if (chain.empty())
+                return;
+
+            struct res_store
+            {
+                res_chains_type chains;
+                data_chain_type owned;
+            };
+
+            auto store = std::make_shared<res_store>();
+            if (mp_res_chains)
+                store->chains = *mp_res_chains;
+            store->owned = std::move(chain);
+            store->chains.push_back(&store->owned);
+            mp_res_chains = res_chains_ptr(store, &store->chains);
+        }
+
     res_chains_ptr& get_res_chains() { return mp_res_chains; }
 
     private:
@@ -536,7 +686,8 @@ public:
     void build_tree();
 
     /**
-     * Insert a new segment.
+     * Insert a new segment.  This invalidates the tree unless incremental
+     * insertion is enabled.
      *
      * @param begin_key begin point of the segment.  The value is inclusive.
      * @param end_key end point of the segment.  The value is non-inclusive.
@@ -546,6 +697,30 @@ public:
      */
     bool insert(key_type begin_key, key_type end_key, value_type pdata);
 
+    /**
+     * Enable or disable incremental insertion.  When enabled, inserting a
+     * new segment into a valid tree keeps the tree valid, and the new
+     * segment can be searched right away.  A segment whose end points both
+     * coincide with existing leaf nodes gets marked directly in the tree.
+     * Any other segment goes into a pending buffer which gets scanned on
+     * each search, and the tree gets re-built once the buffer grows beyond
+     * the square root of the number of stored segments.
+     *
+     * This setting has no effect while the tree is not valid.
+     *
+     * @param enabled true to enable incremental insertion, or false to
+     *                disable it.
+     */
+    void set_incremental_insert(bool enabled);
+
+    /**
+     * @return true if incremental insertion is enabled, otherwise false.
+     */
+    bool is_incremental_insert() const
+    {
+        return m_incremental_insert;
+    }
+
     /**
      * Search the tree and collect all segments that include a specified
      * point.
@@ -575,15 +750,129 @@ public:
      */
     search_result search(key_type point) const;
 
+    /**
+     * Search the tree for all segments that include a specified point, and
+     * pass the data instance of each segment to a function object.  The
+     * data instances are read directly from the tree nodes, and no result
+     * object gets created.  Nothing happens if the tree is not valid.
+     *
+     * @param point specified point value
+     * @param func function object whose operator() takes a data instance as
+     *             its only argument.
+     *
+     * @return function object passed to this method, after it has visited
+     *         all data instances.
+     */
+    template<typename _Func>
+    _Func search(key_type point, _Func func) const;
+
+    /**
+     * Count the segments that include a specified point, without creating
+     * any result object.
+     *
+     * @param point specified point value
+     *
+     * @return number of segments that include the point, or 0 if the tree
+     *         is not valid.
+     */
+    size_type count(key_type point) const;
+
+    /**
+     * Search the tree for all segments that include each of the specified
+     * points, in a single pass.  The points get sorted first, and the tree
+     * is then walked once while the sorted points get partitioned between
+     * the child nodes at each level, so that the points sharing the same
+     * part of the search path only descend it once.
+     *
+     * @param keys_begin forward iterator pointing to the first point.
+     * @param keys_end forward iterator pointing to the position past the
+     *                 last point.
+     * @param func function object whose operator() takes the position of a
+     *             point in the input sequence and a data instance associated
+     *             with a segment that includes the point.  The order in which
+     *             the pairs get passed is unspecified.
+     *
+     * @return function object passed to this method, after it has visited
+     *         all results.  Nothing gets visited if the tree is not valid.
+     */
+    template<typename _KeyIter, typename _Func>
+    _Func search_many(_KeyIter keys_begin, _KeyIter keys_end, _Func func) const;
+
+    /**
+     * Search the tree and collect all segments that overlap with a specified
+     * range.  A segment overlaps with the range when the two share at least
+     * one point.  The tree is walked only once, and each segment is reported
+     * only once even when it is stored in more than one node that overlaps
+     * with the range.
+     *
+     * @param begin_key begin point of the range.  The value is inclusive.
+     * @param end_key end point of the range.  The value is non-inclusive.
+     * @param result array of data instances associated with the segments
+     *               that overlap with the range.  <i>Note that the search
+     *               result gets appended to the array</i>, and the
+     *               de-duplication is performed only on the newly appended
+     *               portion of it.  The order of the appended data instances
+     *               is unspecified.
+     *
+     * @return true if the search is performed successfully, false if the
+     *         tree is not valid or the range is empty.
+     */
+    bool search_range(key_type begin_key, key_type end_key, search_result_type& result) const;
+
+    /**
+     * Create an immutable snapshot of the current set of segments, which
+     * stores all nodes of the tree and their data chains in a few
+     * contiguous arrays.  The tree must be valid.  Segments that are still
+     * pending in incremental insertion mode get copied into the snapshot
+     * as they are.
+     *
+     * @return immutable snapshot of the current content.
+     *
+     * @exception mdds::general_error if the tree is not valid.
+     * @exception mdds::size_error if the tree is too large to be packed.
+     */
+    frozen_type freeze() const;
+
     /**
      * Remove a segment that matches by the value.  This will <i>not</i>
      * invalidate the tree; however, if you have removed lots of segments, you
      * might want to re-build the tree to shrink its size.
      *
+     * When lazy removal is enabled, the value is only recorded as removed,
+     * and gets filtered out of the search results until the next re-build
+     * of the tree physically removes it from the nodes.
+     *
      * @param value value to remove a segment by.
      */
     void remove(value_type value);
 
+    /**
+     * Enable or disable lazy removal.  By default, the container keeps
+     * track of all nodes that store each value so that remove() can erase
+     * the value from those nodes right away, at the cost of one node list
+     * per stored segment.  When lazy removal is enabled, the container
+     * does not keep these node lists at all.  Instead, each removed value
+     * gets recorded as a tombstone which gets filtered out of the search
+     * results, and the tombstones get compacted away when the tree is
+     * re-built.  The tree gets re-built automatically once the tombstones
+     * outnumber the stored segments.
+     *
+     * Enabling lazy removal releases the node lists right away.  Disabling
+     * it invalidates the tree, since the node lists need to be re-created
+     * by build_tree().
+     *
+     * @param enabled true to enable lazy removal, or false to disable it.
+     */
+    void set_lazy_removal(bool enabled);
+
+    /**
+     * @return true if lazy removal is enabled, otherwise false.
+     */
+    bool is_lazy_removal() const
+    {
+        return m_lazy_removal;
+    }
+
     /**
      * Remove all segments data.
      */
@@ -638,6 +927,19 @@ private:
     typedef std::vector<__st::node_base*> node_list_type;
     typedef std::map<value_type, std::unique_ptr<node_list_type>> data_node_map_type;
 
+    /**
+     * Segment inserted into a valid tree whose end points don't coincide with
+     * the existing leaf nodes.
+     */
+    struct pending_segment
+    {
+        key_type begin_key;
+        key_type end_key;
+        value_type pdata;
+    };
+
+    typedef std::vector<pending_segment> pending_segments_type;
+
     static void create_leaf_node_instances(const ::std::vector<key_type>& keys, node_ptr& left, node_ptr& right);
 
     /**
@@ -650,6 +952,24 @@ private:
 
     void build_leaf_nodes();
 
+    /**
+     * Check whether or not a leaf node with the specified key exists, by
+     * descending the tree.  The tree must be valid.
+     */
+    bool has_leaf_key(key_type key) const;
+
+    /**
+     * Insert a new segment into a valid tree, without invalidating it.
+     */
+    void insert_into_valid_tree(key_type begin_key, key_type end_key, value_type pdata);
+
+    /**
+     * Pass the data instances of all pending segments that include the
+     * specified point to the function object.
+     */
+    template<typename _Func>
+    void search_pending(key_type point, _Func& func) const;
+
     /**
      * Go through the list of nodes, and remove the specified data pointer
      * value from the nodes.
@@ -657,6 +977,17 @@ private:
     void remove_data_from_nodes(node_list_type* plist, const value_type pdata);
     void remove_data_from_chain(data_chain_type& chain, const value_type pdata);
 
+    /**
+     * Remove the values that have been removed lazily from the search
+     * result, starting at the specified position.
+     */
+    void erase_tombstones(search_result_type& result, size_type start_pos) const;
+
+    bool is_tombstone(const value_type& value) const
+    {
+        return !m_tombstones.empty() && m_tombstones.count(value) > 0;
+    }
+
     void clear_all_nodes();
 
 #ifdef MDDS_UNIT_TEST
@@ -676,10 +1007,217 @@ private:
      */
     data_node_map_type m_tagged_node_map;
 
+    /**
+     * Segments inserted into a valid tree in incremental mode that are yet
+     * to be merged into the tree.
+     */
+    pending_segments_type m_pending_segments;
+
+    /**
+     * Values removed lazily, which are still stored in the tree nodes.
+     */
+    std::unordered_set<value_type> m_tombstones;
+
     nonleaf_node* m_root_node;
     node_ptr   m_left_leaf;
     node_ptr   m_right_leaf;
     bool m_valid_tree:1;
+    bool m_incremental_insert:1;
+    bool m_lazy_removal:1;
+};
+
+/**
+ * Segment tree variant which identifies each segment by a dense integer id
+ * assigned at insertion time, rather than by its value.  The segments are
+ * stored in a plain array indexed by their ids, and the tree nodes store
+ * the ids.  This allows any number of segments to share the same value,
+ * and requires the value type to be neither hashable nor comparable.
+ *
+ * The tree is laid out implicitly in one array, with its leaves
+ * corresponding to the elementary intervals between adjacent end points.
+ * The ids of all nodes are packed into one array indexed by an array of
+ * per-node offsets, so that building the tree makes no per-node or
+ * per-segment allocations.
+ *
+ * Like segment_tree, inserting a segment invalidates the tree, which needs
+ * to be re-built by calling build_tree() before it can be searched.
+ * Removing a segment does not invalidate the tree.  The removed segment
+ * only gets flagged, and its id gets filtered out of the search results
+ * until the next re-build.  The ids of removed segments don't get reused
+ * until clear() is called.
+ */
+template<typename _Key, typename _Value>
+class indexed_segment_tree
+{
+public:
+    typedef _Key        key_type;
+    typedef _Value      value_type;
+    typedef size_t      size_type;
+    typedef uint32_t    id_type;
+    typedef ::std::vector<id_type> search_result_type;
+
+    /**
+     * Segment stored in the container, with its begin key (inclusive), end
+     * key (non-inclusive) and value.
+     */
+    struct segment_type
+    {
+        key_type begin_key;
+        key_type end_key;
+        value_type value;
+    };
+
+    indexed_segment_tree();
+
+    /**
+     * Insert a new segment.  This invalidates the tree.
+     *
+     * @param begin_key begin point of the segment.  The value is inclusive.
+     * @param end_key end point of the segment.  The value is non-inclusive.
+     * @param value value associated with the segment.
+     *
+     * @return id of the inserted segment.
+     *
+     * @exception mdds::invalid_arg_error if the end key is not greater than
+     *            the begin key.
+     * @exception mdds::size_error if the number of segments has reached the
+     *            maximum value that the id type can represent.
+     */
+    id_type insert(key_type begin_key, key_type end_key, value_type value);
+
+    /**
+     * Remove a segment by its id.  This does not invalidate the tree.
+     * Removing a segment that has already been removed does nothing.
+     *
+     * @param id id of the segment to remove.
+     *
+     * @exception std::out_of_range if the id is invalid.
+     */
+    void remove(id_type id);
+
+    /**
+     * @param id id of a segment.
+     *
+     * @return true if the segment has been removed, otherwise false.
+     *
+     * @exception std::out_of_range if the id is invalid.
+     */
+    bool is_removed(id_type id) const;
+
+    /**
+     * Get a segment by its id.  The segment is still accessible after its
+     * removal, until clear() is called.
+     *
+     * @param id id of the segment.
+     *
+     * @return segment associated with the id.
+     *
+     * @exception std::out_of_range if the id is invalid.
+     */
+    const segment_type& get_segment(id_type id) const;
+
+    /**
+     * Build or re-build the tree based on the current set of segments.
+     */
+    void build_tree();
+
+    /**
+     * Check whether or not the tree is in a valid state.  The tree must be
+     * valid in order to perform searches.
+     *
+     * @return true if the tree is valid, false otherwise.
+     */
+    bool is_tree_valid() const { return m_valid_tree; }
+
+    /**
+     * Search the tree and collect the ids of all segments that include a
+     * specified point.
+     *
+     * @param point specified point value
+     * @param result array to which the ids of the segments that include the
+     *               point get appended.  The order of the ids is
+     *               unspecified.
+     *
+     * @return true if the search is performed successfully, false if the
+     *         tree is not valid.
+     */
+    bool search(key_type point, search_result_type& result) const;
+
+    /**
+     * Search the tree for all segments that include a specified point, and
+     * pass the id of each segment to a function object.  Nothing happens
+     * if the tree is not valid.
+     *
+     * @param point specified point value
+     * @param func function object whose operator() takes a segment id as
+     *             its only argument.
+     *
+     * @return function object passed to this method, after it has visited
+     *         all ids.
+     */
+    template<typename _Func>
+    _Func search(key_type point, _Func func) const;
+
+    /**
+     * Count the segments that include a specified point.
+     *
+     * @param point specified point value
+     *
+     * @return number of segments that include the point, or 0 if the tree
+     *         is not valid.
+     */
+    size_type count(key_type point) const;
+
+    /**
+     * Remove all segments, and reset the ids.
+     */
+    void clear();
+
+    /**
+     * @return number of segments currently stored, excluding the removed
+     *         ones.
+     */
+    size_type size() const
+    {
+        return m_segments.size() - m_removed_count;
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+private:
+    /**
+     * Call the function object with the range of ids stored in each node
+     * that includes the point.
+     */
+    template<typename _Func>
+    void descend(key_type point, _Func& func) const;
+
+private:
+    std::vector<segment_type> m_segments;
+    std::vector<bool> m_removed;
+    size_type m_removed_count;
+
+    /** Number of segments removed since the tree was last built. */
+    size_type m_stale_count;
+
+    /** Sorted unique end points of all segments. */
+    std::vector<key_type> m_keys;
+
+    /**
+     * Number of leaf positions in the implicit tree, which is a power of
+     * two.  The node at position 1 is the root, and the children of the
+     * node at position i are at 2i and 2i+1.
+     */
+    size_type m_leaf_capacity;
+
+    /** Start position of each node's ids, plus the end position. */
+    std::vector<uint32_t> m_chain_offsets;
+    std::vector<id_type> m_chain_ids;
+
+    bool m_valid_tree;
 };
 
 }
@@ -26,6 +26,9 @@
 ************************************************************************/
 
 #include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
 
 namespace mdds {
 
@@ -108,12 +111,211 @@ void descend_tree_for_search(
     descend_tree_for_search<T,_Inserter>(point, pchild, result);
 }
 
+/**
+ * Descend the tree and pass the data chain of every node whose range
+ * overlaps with [begin_key, end_key) to the inserter.  The range of a leaf
+ * node spans from its key to the key of the next leaf node.
+ */
+template<typename T, typename _Inserter>
+void descend_tree_for_range_search(
+    typename T::key_type begin_key, typename T::key_type end_key,
+    const __st::node_base* pnode, _Inserter& result)
+{
+    typedef typename T::node leaf_node;
+    typedef typename T::nonleaf_node nonleaf_node;
+
+    if (!pnode)
+        return;
+
+    if (pnode->is_leaf)
+    {
+        const leaf_node* pleaf = static_cast<const leaf_node*>(pnode);
+        if (!pleaf->next)
+            // The right-most leaf node has an empty range.
+            return;
+
+        if (pleaf->value_leaf.key < end_key && begin_key < pleaf->next->value_leaf.key)
+            result(pleaf->value_leaf.data_chain);
+        return;
+    }
+
+    const nonleaf_node* pnonleaf = static_cast<const nonleaf_node*>(pnode);
+    const typename T::nonleaf_value_type& v = pnonleaf->value_nonleaf;
+    if (end_key <= v.low || v.high <= begin_key)
+        // No overlap.
+        return;
+
+    result(v.data_chain);
+
+    descend_tree_for_range_search<T,_Inserter>(begin_key, end_key, pnonleaf->left, result);
+    descend_tree_for_range_search<T,_Inserter>(begin_key, end_key, pnonleaf->right, result);
+}
+
+/**
+ * Descend the tree with a range of points sorted by their keys, and pass the
+ * data chain of every node that includes a point, along with the point, to
+ * the function object.  The points get partitioned between the child nodes
+ * the same way descend_tree_for_search() picks a child for each point.
+ */
+template<typename T, typename _Iter, typename _Func>
+void descend_tree_for_search_many(
+    const __st::node_base* pnode, _Iter it_begin, _Iter it_end, _Func& func)
+{
+    typedef typename T::node leaf_node;
+    typedef typename T::nonleaf_node nonleaf_node;
+    typedef typename T::key_type key_type;
+
+    if (!pnode || it_begin == it_end)
+        return;
+
+    auto key_less = [](const typename std::iterator_traits<_Iter>::value_type& v, key_type key)
+    {
+        return v.first < key;
+    };
+
+    if (pnode->is_leaf)
+    {
+        const typename T::data_chain_type* chain = static_cast<const leaf_node*>(pnode)->value_leaf.data_chain;
+        if (!chain || chain->empty())
+            return;
+
+        for (; it_begin != it_end; ++it_begin)
+            func(it_begin->second, *chain);
+        return;
+    }
+
+    const nonleaf_node* pnonleaf = static_cast<const nonleaf_node*>(pnode);
+    const typename T::nonleaf_value_type& v = pnonleaf->value_nonleaf;
+
+    // Drop the points that are outside the range of this node.
+    it_begin = std::lower_bound(it_begin, it_end, v.low, key_less);
+    it_end = std::lower_bound(it_begin, it_end, v.high, key_less);
+    if (it_begin == it_end)
+        return;
+
+    if (v.data_chain && !v.data_chain->empty())
+    {
+        for (_Iter it = it_begin; it != it_end; ++it)
+            func(it->second, *v.data_chain);
+    }
+
+    const __st::node_base* pleft = pnonleaf->left;
+    const __st::node_base* pright = pnonleaf->right;
+    if (!pleft)
+        return;
+
+    if (pleft->is_leaf)
+    {
+        it_begin = std::lower_bound(
+            it_begin, it_end, static_cast<const leaf_node*>(pleft)->value_leaf.key, key_less);
+
+        _Iter it_mid = it_end;
+        if (pright)
+            it_mid = std::lower_bound(
+                it_begin, it_end, static_cast<const leaf_node*>(pright)->value_leaf.key, key_less);
+
+        descend_tree_for_search_many<T>(pleft, it_begin, it_mid, func);
+        descend_tree_for_search_many<T>(pright, it_mid, it_end, func);
+        return;
+    }
+
+    _Iter it_mid = it_end;
+    if (pright)
+        it_mid = std::lower_bound(
+            it_begin, it_end, static_cast<const nonleaf_node*>(pleft)->value_nonleaf.high, key_less);
+
+    descend_tree_for_search_many<T>(pleft, it_begin, it_mid, func);
+    descend_tree_for_search_many<T>(pright, it_mid, it_end, func);
+}
+
 } // namespace __st
 
+template<typename _Key, typename _Value>
+frozen_segment_tree<_Key, _Value>::frozen_segment_tree() : m_segment_count(0)
+{
+}
+
+template<typename _Key, typename _Value>
+template<typename _Func>
+void frozen_segment_tree<_Key, _Value>::descend(key_type point, _Func& func) const
+{
+    if (m_nodes.empty())
+        return;
+
+    size_type pos = 0;
+    const node_type* nd = &m_nodes[pos];
+    if (point < nd->low || nd->high <= point)
+        return;
+
+    while (true)
+    {
+        const value_type* p = m_chain_values.data();
+        func(p + m_chain_offsets[pos], p + m_chain_offsets[pos+1]);
+
+        if (nd->left == no_child)
+            break;
+
+        // The child nodes partition the range of their parent.
+        pos = nd->left;
+        if (nd->right != no_child && m_nodes[nd->right].low <= point)
+            pos = nd->right;
+
+        nd = &m_nodes[pos];
+        if (point < nd->low || nd->high <= point)
+            break;
+    }
+}
+
+template<typename _Key, typename _Value>
+template<typename _Func>
+_Func frozen_segment_tree<_Key, _Value>::search(key_type point, _Func func) const
+{
+    auto visitor = [&func](const value_type* it, const value_type* it_end)
+    {
+        for (; it != it_end; ++it)
+            func(*it);
+    };
+
+    descend(point, visitor);
+
+    for (const extra_segment& seg : m_extra_segments)
+    {
+        if (seg.begin_key <= point && point < seg.end_key)
+            func(seg.value);
+    }
+
+    return func;
+}
+
+template<typename _Key, typename _Value>
+void frozen_segment_tree<_Key, _Value>::search(key_type point, search_result_type& result) const
+{
+    search(point, [&result](const value_type& v) { result.push_back(v); });
+}
+
+template<typename _Key, typename _Value>
+typename frozen_segment_tree<_Key, _Value>::size_type
+frozen_segment_tree<_Key, _Value>::count(key_type point) const
+{
+    size_type n = 0;
+    auto counter = [&n](const value_type* it, const value_type* it_end) { n += it_end - it; };
+    descend(point, counter);
+
+    for (const extra_segment& seg : m_extra_segments)
+    {
+        if (seg.begin_key <= point && point < seg.end_key)
+            ++n;
+    }
+
+    return n;
+}
+
 template<typename _Key, typename _Value>
 segment_tree<_Key, _Value>::segment_tree()
     : m_root_node(nullptr)
     , m_valid_tree(false)
+    , m_incremental_insert(false)
+    , m_lazy_removal(false)
 {
 }
 
@@ -122,6 +324,8 @@ segment_tree<_Key, _Value>::segment_tree(const segment_tree& r)
     : m_segment_data(r.m_segment_data)
     , m_root_node(nullptr)
     , m_valid_tree(r.m_valid_tree)
+    , m_incremental_insert(r.m_incremental_insert)
+    , m_lazy_removal(r.m_lazy_removal)
 {
     if (m_valid_tree)
         build_tree();
@@ -184,17 +388,24 @@ void segment_tree<_Key, _Value>::build_tree()
     for (itr = itr_beg; itr != itr_end; ++itr)
     {
         value_type pdata = itr->first;
-        auto r = tagged_node_map.insert(
-            typename data_node_map_type::value_type(
-                pdata, std::make_unique<node_list_type>()));
+        node_list_type* plist = nullptr;
+
+        if (!m_lazy_removal)
+        {
+            auto r = tagged_node_map.insert(
+                typename data_node_map_type::value_type(
+                    pdata, std::make_unique<node_list_type>()));
 
-        node_list_type* plist = r.first->second.get();
-        plist->reserve(10);
+            plist = r.first->second.get();
+            plist->reserve(10);
+        }
 
         descend_tree_and_mark(m_root_node, pdata, itr->second.first, itr->second.second, plist);
     }
 
     m_tagged_node_map.swap(tagged_node_map);
+    m_pending_segments.clear();
+    m_tombstones.clear();
     m_valid_tree = true;
 }
 
@@ -215,7 +426,8 @@ void segment_tree<_Key, _Value>::descend_tree_and_mark(
             if (!v.data_chain)
                 v.data_chain = new data_chain_type;
             v.data_chain->push_back(pdata);
-            plist->push_back(pnode);
+            if (plist)
+                plist->push_back(pnode);
         }
         return;
     }
@@ -231,7 +443,8 @@ void segment_tree<_Key, _Value>::descend_tree_and_mark(
         if (!v.data_chain)
             v.data_chain = new data_chain_type;
         v.data_chain->push_back(pdata);
-        plist->push_back(pnode);
+        if (plist)
+            plist->push_back(pnode);
         return;
     }
 
@@ -263,6 +476,81 @@ void segment_tree<_Key, _Value>::build_leaf_nodes()
     create_leaf_node_instances(keys_uniq, m_left_leaf, m_right_leaf);
 }
 
+template<typename _Key, typename _Value>
+bool segment_tree<_Key, _Value>::has_leaf_key(key_type key) const
+{
+    if (!m_root_node)
+        return false;
+
+    if (key == m_right_leaf->value_leaf.key)
+        // The right-most leaf node is outside the range of the root node.
+        return true;
+
+    const __st::node_base* pnode = m_root_node;
+    while (!pnode->is_leaf)
+    {
+        const nonleaf_node* pnonleaf = static_cast<const nonleaf_node*>(pnode);
+        const nonleaf_value_type& v = pnonleaf->value_nonleaf;
+        if (key < v.low || v.high <= key)
+            return false;
+
+        const __st::node_base* pchild = pnonleaf->left;
+        if (pnonleaf->right)
+        {
+            if (pchild->is_leaf)
+            {
+                if (static_cast<const node*>(pnonleaf->right)->value_leaf.key <= key)
+                    pchild = pnonleaf->right;
+            }
+            else if (static_cast<const nonleaf_node*>(pchild)->value_nonleaf.high <= key)
+                pchild = pnonleaf->right;
+        }
+
+        pnode = pchild;
+    }
+
+    return static_cast<const node*>(pnode)->value_leaf.key == key;
+}
+
+template<typename _Key, typename _Value>
+void segment_tree<_Key, _Value>::insert_into_valid_tree(
+    key_type begin_key, key_type end_key, value_type pdata)
+{
+    if (has_leaf_key(begin_key) && has_leaf_key(end_key))
+    {
+        // The leaf nodes stay the same.  Mark the nodes the same way a
+        // re-build would.
+        node_list_type* plist = nullptr;
+        if (!m_lazy_removal)
+        {
+            auto r = m_tagged_node_map.insert(
+                typename data_node_map_type::value_type(
+                    pdata, std::make_unique<node_list_type>()));
+            plist = r.first->second.get();
+        }
+
+        descend_tree_and_mark(m_root_node, pdata, begin_key, end_key, plist);
+        return;
+    }
+
+    m_pending_segments.push_back({begin_key, end_key, pdata});
+
+    size_t limit = std::sqrt(double(m_segment_data.size()));
+    if (m_pending_segments.size() > std::max<size_t>(limit, 16))
+        build_tree();
+}
+
+template<typename _Key, typename _Value>
+template<typename _Func>
+void segment_tree<_Key, _Value>::search_pending(key_type point, _Func& func) const
+{
+    for (const pending_segment& seg : m_pending_segments)
+    {
+        if (seg.begin_key <= point && point < seg.end_key)
+            func(seg.pdata);
+    }
+}
+
 template<typename _Key, typename _Value>
 void segment_tree<_Key, _Value>::create_leaf_node_instances(const ::std::vector<key_type>& keys, node_ptr& left, node_ptr& right)
 {
@@ -313,10 +601,46 @@ bool segment_tree<_Key, _Value>::insert(key_type begin_key, key_type end_key, va
     range.second = end_key;
     m_segment_data.insert(typename segment_map_type::value_type(pdata, range));
 
+    if (m_valid_tree && is_tombstone(pdata))
+    {
+        // The tree nodes still store this value from its removed segment.
+        if (m_incremental_insert)
+            build_tree();
+        else
+            m_valid_tree = false;
+        return true;
+    }
+
+    if (m_valid_tree && m_incremental_insert)
+    {
+        insert_into_valid_tree(begin_key, end_key, pdata);
+        return true;
+    }
+
     m_valid_tree = false;
     return true;
 }
 
+template<typename _Key, typename _Value>
+void segment_tree<_Key, _Value>::set_incremental_insert(bool enabled)
+{
+    m_incremental_insert = enabled;
+}
+
+template<typename _Key, typename _Value>
+void segment_tree<_Key, _Value>::set_lazy_removal(bool enabled)
+{
+    if (m_lazy_removal == enabled)
+        return;
+
+    m_lazy_removal = enabled;
+
+    if (enabled)
+        m_tagged_node_map.clear();
+    else
+        m_valid_tree = false;
+}
+
 template<typename _Key, typename _Value>
 bool segment_tree<_Key, _Value>::search(key_type point, search_result_type& result) const
 {
@@ -324,43 +648,296 @@ bool segment_tree<_Key, _Value>::search(key_type point, search_result_type& resu
         // Tree is invalidated.
         return false;
 
-    if (!m_root_node)
+    if (!m_root_node && m_pending_segments.empty())
         // Tree doesn't exist.  Since the tree is flagged valid, this means no
         // segments have been inserted.
         return true;
 
+    size_type n_prev = result.size();
     search_result_vector_inserter result_inserter(result);
     typedef segment_tree<_Key,_Value> tree_type;
     __st::descend_tree_for_search<
         tree_type, search_result_vector_inserter>(point, m_root_node, result_inserter);
+    erase_tombstones(result, n_prev);
+
+    auto push_back = [&result](value_type pdata) { result.push_back(pdata); };
+    search_pending(point, push_back);
     return true;
 }
 
+template<typename _Key, typename _Value>
+void segment_tree<_Key, _Value>::erase_tombstones(search_result_type& result, size_type start_pos) const
+{
+    if (m_tombstones.empty())
+        return;
+
+    auto it = std::remove_if(result.begin() + start_pos, result.end(),
+        [this](const value_type& v) { return m_tombstones.count(v) > 0; });
+    result.erase(it, result.end());
+}
+
 template<typename _Key, typename _Value>
 typename segment_tree<_Key, _Value>::search_result
 segment_tree<_Key, _Value>::search(key_type point) const
 {
     search_result result;
-    if (!m_valid_tree || !m_root_node)
-        return result;
+    search(point, static_cast<search_result_base&>(result));
+    return result;
+}
 
-    search_result_inserter result_inserter(result);
-    typedef segment_tree<_Key,_Value> tree_type;
-    __st::descend_tree_for_search<tree_type, search_result_inserter>(
-        point, m_root_node, result_inserter);
+template<typename _Key, typename _Value>
+bool segment_tree<_Key, _Value>::search_range(
+    key_type begin_key, key_type end_key, search_result_type& result) const
+{
+    if (!m_valid_tree || end_key <= begin_key)
+        return false;
 
-    return result;
+    size_t n_prev = result.size();
+
+    if (m_root_node)
+    {
+        search_result_vector_inserter result_inserter(result);
+        typedef segment_tree<_Key,_Value> tree_type;
+        __st::descend_tree_for_range_search<tree_type, search_result_vector_inserter>(
+            begin_key, end_key, m_root_node, result_inserter);
+        erase_tombstones(result, n_prev);
+    }
+
+    for (const pending_segment& seg : m_pending_segments)
+    {
+        if (seg.begin_key < end_key && begin_key < seg.end_key)
+            result.push_back(seg.pdata);
+    }
+
+    // A segment may be stored in more than one node that overlaps with the
+    // range.  Remove the duplicates in place.
+    typename search_result_type::iterator it_beg = result.begin() + n_prev;
+    std::sort(it_beg, result.end());
+    result.erase(std::unique(it_beg, result.end()), result.end());
+    return true;
+}
+
+template<typename _Key, typename _Value>
+template<typename _Func>
+_Func segment_tree<_Key, _Value>::search(key_type point, _Func func) const
+{
+    if (!m_valid_tree)
+        return func;
+
+    if (m_root_node)
+    {
+        auto visitor = [this, &func](const data_chain_type* chain)
+        {
+            if (!chain)
+                return;
+
+            for (const value_type& v : *chain)
+            {
+                if (!is_tombstone(v))
+                    func(v);
+            }
+        };
+
+        typedef segment_tree<_Key,_Value> tree_type;
+        __st::descend_tree_for_search<tree_type>(point, m_root_node, visitor);
+    }
+
+    search_pending(point, func);
+    return func;
+}
+
+template<typename _Key, typename _Value>
+template<typename _KeyIter, typename _Func>
+_Func segment_tree<_Key, _Value>::search_many(_KeyIter keys_begin, _KeyIter keys_end, _Func func) const
+{
+    if (!m_valid_tree)
+        return func;
+
+    // Sort the points by their keys while keeping their original positions.
+    typedef std::pair<key_type, size_type> key_pos_type;
+    std::vector<key_pos_type> keys;
+    keys.reserve(std::distance(keys_begin, keys_end));
+    for (size_type pos = 0; keys_begin != keys_end; ++keys_begin, ++pos)
+        keys.emplace_back(*keys_begin, pos);
+
+    std::sort(keys.begin(), keys.end());
+
+    if (m_root_node)
+    {
+        auto visitor = [this, &func](size_type pos, const data_chain_type& chain)
+        {
+            for (const value_type& v : chain)
+            {
+                if (!is_tombstone(v))
+                    func(pos, v);
+            }
+        };
+
+        typedef segment_tree<_Key,_Value> tree_type;
+        __st::descend_tree_for_search_many<tree_type>(m_root_node, keys.cbegin(), keys.cend(), visitor);
+    }
+
+    auto key_less = [](const key_pos_type& v, key_type key) { return v.first < key; };
+
+    for (const pending_segment& seg : m_pending_segments)
+    {
+        auto it = std::lower_bound(keys.cbegin(), keys.cend(), seg.begin_key, key_less);
+        auto it_end = std::lower_bound(it, keys.cend(), seg.end_key, key_less);
+        for (; it != it_end; ++it)
+            func(it->second, seg.pdata);
+    }
+
+    return func;
+}
+
+template<typename _Key, typename _Value>
+typename segment_tree<_Key, _Value>::size_type
+segment_tree<_Key, _Value>::count(key_type point) const
+{
+    size_type n = 0;
+    if (!m_valid_tree)
+        return n;
+
+    if (m_root_node)
+    {
+        auto counter = [this, &n](const data_chain_type* chain)
+        {
+            if (!chain)
+                return;
+
+            if (m_tombstones.empty())
+            {
+                n += chain->size();
+                return;
+            }
+
+            for (const value_type& v : *chain)
+            {
+                if (!m_tombstones.count(v))
+                    ++n;
+            }
+        };
+
+        typedef segment_tree<_Key,_Value> tree_type;
+        __st::descend_tree_for_search<tree_type>(point, m_root_node, counter);
+    }
+
+    auto pending_counter = [&n](const value_type&) { ++n; };
+    search_pending(point, pending_counter);
+    return n;
 }
 
 template<typename _Key, typename _Value>
 void segment_tree<_Key, _Value>::search(key_type point, search_result_base& result) const
 {
-    if (!m_valid_tree || !m_root_node)
+    if (!m_valid_tree)
         return;
 
-    search_result_inserter result_inserter(result);
-    typedef segment_tree<_Key,_Value> tree_type;
-    __st::descend_tree_for_search<tree_type>(point, m_root_node, result_inserter);
+    if (!m_tombstones.empty())
+    {
+        // The data chains contain removed values.  Collect the live ones.
+        data_chain_type values;
+        search(point, [&values](const value_type& v) { values.push_back(v); });
+        result.push_back_owned_chain(std::move(values));
+        return;
+    }
+
+    if (m_root_node)
+    {
+        search_result_inserter result_inserter(result);
+        typedef segment_tree<_Key,_Value> tree_type;
+        __st::descend_tree_for_search<tree_type>(point, m_root_node, result_inserter);
+    }
+
+    if (m_pending_segments.empty())
+        return;
+
+    data_chain_type pending;
+    auto push_back = [&pending](value_type pdata) { pending.push_back(pdata); };
+    search_pending(point, push_back);
+    result.push_back_owned_chain(std::move(pending));
+}
+
+template<typename _Key, typename _Value>
+typename segment_tree<_Key, _Value>::frozen_type
+segment_tree<_Key, _Value>::freeze() const
+{
+    if (!m_valid_tree)
+        throw general_error("segment_tree::freeze: tree is not valid.");
+
+    frozen_type frozen;
+    frozen.m_segment_count = m_segment_data.size();
+
+    for (const pending_segment& seg : m_pending_segments)
+        frozen.m_extra_segments.push_back({seg.begin_key, seg.end_key, seg.pdata});
+
+    if (!m_root_node)
+        return frozen;
+
+    // Lay out the nodes in breadth-first order.  The position of each node
+    // in the queue becomes its position in the node array.
+    size_type node_count = m_nonleaf_node_pool.size() + leaf_size();
+    std::vector<const __st::node_base*> queue;
+    queue.reserve(node_count);
+    queue.push_back(m_root_node);
+    frozen.m_nodes.reserve(node_count);
+    frozen.m_chain_offsets.reserve(node_count + 1);
+
+    for (size_type i = 0; i < queue.size(); ++i)
+    {
+        if (queue.size() >= frozen_type::no_child)
+            throw size_error("segment_tree::freeze: too many nodes.");
+
+        const __st::node_base* p = queue[i];
+        typename frozen_type::node_type nd;
+        nd.left = frozen_type::no_child;
+        nd.right = frozen_type::no_child;
+        const data_chain_type* chain = nullptr;
+
+        if (p->is_leaf)
+        {
+            const node* pleaf = static_cast<const node*>(p);
+            nd.low = pleaf->value_leaf.key;
+            nd.high = pleaf->next ? pleaf->next->value_leaf.key : pleaf->value_leaf.key;
+            chain = pleaf->value_leaf.data_chain;
+        }
+        else
+        {
+            const nonleaf_node* pnonleaf = static_cast<const nonleaf_node*>(p);
+            nd.low = pnonleaf->value_nonleaf.low;
+            nd.high = pnonleaf->value_nonleaf.high;
+            chain = pnonleaf->value_nonleaf.data_chain;
+
+            if (pnonleaf->left)
+            {
+                nd.left = queue.size();
+                queue.push_back(pnonleaf->left);
+            }
+
+            if (pnonleaf->right)
+            {
+                nd.right = queue.size();
+                queue.push_back(pnonleaf->right);
+            }
+        }
+
+        frozen.m_nodes.push_back(nd);
+        frozen.m_chain_offsets.push_back(frozen.m_chain_values.size());
+        if (chain)
+        {
+            for (const value_type& v : *chain)
+            {
+                if (!is_tombstone(v))
+                    frozen.m_chain_values.push_back(v);
+            }
+        }
+
+        if (frozen.m_chain_values.size() >= frozen_type::no_child)
+            throw size_error("segment_tree::freeze: too many data chain entries.");
+    }
+
+    frozen.m_chain_offsets.push_back(frozen.m_chain_values.size());
+    return frozen;
 }
 
 template<typename _Key, typename _Value>
@@ -368,6 +945,26 @@ void segment_tree<_Key, _Value>::remove(value_type value)
 {
     using namespace std;
 
+    if (m_lazy_removal)
+    {
+        auto it_pending = std::find_if(m_pending_segments.begin(), m_pending_segments.end(),
+            [value](const pending_segment& seg) { return seg.pdata == value; });
+
+        if (it_pending != m_pending_segments.end())
+            // Pending segments are not stored in the tree nodes.
+            m_pending_segments.erase(it_pending);
+        else if (m_valid_tree && m_segment_data.count(value))
+            m_tombstones.insert(value);
+
+        m_segment_data.erase(value);
+
+        if (m_valid_tree && m_tombstones.size() > std::max<size_t>(m_segment_data.size(), 16))
+            // Compact the tombstones away.
+            build_tree();
+
+        return;
+    }
+
     typename data_node_map_type::iterator itr = m_tagged_node_map.find(value);
     if (itr != m_tagged_node_map.end())
     {
@@ -382,6 +979,11 @@ void segment_tree<_Key, _Value>::remove(value_type value)
         m_tagged_node_map.erase(itr);
     }
 
+    auto it_pending = std::find_if(m_pending_segments.begin(), m_pending_segments.end(),
+        [value](const pending_segment& seg) { return seg.pdata == value; });
+    if (it_pending != m_pending_segments.end())
+        m_pending_segments.erase(it_pending);
+
     // Remove from the segment data array.
     m_segment_data.erase(value);
 }
@@ -391,6 +993,8 @@ void segment_tree<_Key, _Value>::clear()
 {
     m_tagged_node_map.clear();
     m_segment_data.clear();
+    m_pending_segments.clear();
+    m_tombstones.clear();
     clear_all_nodes();
     m_valid_tree = false;
 }
@@ -454,6 +1058,222 @@ void segment_tree<_Key, _Value>::clear_all_nodes()
     m_root_node = nullptr;
 }
 
+template<typename _Key, typename _Value>
+indexed_segment_tree<_Key, _Value>::indexed_segment_tree() :
+    m_removed_count(0), m_stale_count(0), m_leaf_capacity(0), m_valid_tree(false)
+{
+}
+
+template<typename _Key, typename _Value>
+typename indexed_segment_tree<_Key, _Value>::id_type
+indexed_segment_tree<_Key, _Value>::insert(key_type begin_key, key_type end_key, value_type value)
+{
+    if (begin_key >= end_key)
+        throw invalid_arg_error("indexed_segment_tree::insert: the end key must be greater than the begin key.");
+
+    if (m_segments.size() >= std::numeric_limits<id_type>::max())
+        throw size_error("indexed_segment_tree::insert: too many segments.");
+
+    id_type id = m_segments.size();
+    m_segments.push_back({begin_key, end_key, std::move(value)});
+    m_removed.push_back(false);
+    m_valid_tree = false;
+    return id;
+}
+
+template<typename _Key, typename _Value>
+void indexed_segment_tree<_Key, _Value>::remove(id_type id)
+{
+    if (m_removed.at(id))
+        return;
+
+    m_removed[id] = true;
+    ++m_removed_count;
+    ++m_stale_count;
+}
+
+template<typename _Key, typename _Value>
+bool indexed_segment_tree<_Key, _Value>::is_removed(id_type id) const
+{
+    return m_removed.at(id);
+}
+
+template<typename _Key, typename _Value>
+const typename indexed_segment_tree<_Key, _Value>::segment_type&
+indexed_segment_tree<_Key, _Value>::get_segment(id_type id) const
+{
+    return m_segments.at(id);
+}
+
+template<typename _Key, typename _Value>
+void indexed_segment_tree<_Key, _Value>::build_tree()
+{
+    m_keys.clear();
+    m_chain_offsets.clear();
+    m_chain_ids.clear();
+    m_leaf_capacity = 0;
+    m_stale_count = 0;
+
+    m_keys.reserve(size() * 2);
+    for (size_type i = 0, n = m_segments.size(); i < n; ++i)
+    {
+        if (m_removed[i])
+            continue;
+
+        m_keys.push_back(m_segments[i].begin_key);
+        m_keys.push_back(m_segments[i].end_key);
+    }
+
+    std::sort(m_keys.begin(), m_keys.end());
+    m_keys.erase(std::unique(m_keys.begin(), m_keys.end()), m_keys.end());
+
+    m_valid_tree = true;
+
+    if (m_keys.size() < 2)
+        return;
+
+    // Each leaf corresponds to the interval between two adjacent keys.
+    size_type interval_count = m_keys.size() - 1;
+    m_leaf_capacity = 1;
+    while (m_leaf_capacity < interval_count)
+        m_leaf_capacity *= 2;
+
+    size_type node_count = m_leaf_capacity * 2;
+
+    // Visit the minimum set of nodes that cover the leaves [lo, hi) of each
+    // segment, from the bottom up.
+    auto for_each_node = [this](const segment_type& seg, auto func)
+    {
+        size_type lo = std::lower_bound(m_keys.begin(), m_keys.end(), seg.begin_key) - m_keys.begin();
+        size_type hi = std::lower_bound(m_keys.begin(), m_keys.end(), seg.end_key) - m_keys.begin();
+
+        for (lo += m_leaf_capacity, hi += m_leaf_capacity; lo < hi; lo /= 2, hi /= 2)
+        {
+            if (lo & 1)
+                func(lo++);
+            if (hi & 1)
+                func(--hi);
+        }
+    };
+
+    // 1st pass counts the ids in each node, and the 2nd pass stores them.
+    std::vector<uint32_t> offsets(node_count + 1, 0);
+    for (size_type i = 0, n = m_segments.size(); i < n; ++i)
+    {
+        if (!m_removed[i])
+            for_each_node(m_segments[i], [&offsets](size_type node) { ++offsets[node+1]; });
+    }
+
+    for (size_type i = 1; i <= node_count; ++i)
+    {
+        if (size_type(offsets[i-1]) + offsets[i] >= std::numeric_limits<uint32_t>::max())
+            throw size_error("indexed_segment_tree::build_tree: too many node entries.");
+        offsets[i] += offsets[i-1];
+    }
+
+    m_chain_ids.resize(offsets.back());
+    std::vector<uint32_t> cursors(offsets.begin(), offsets.end() - 1);
+    for (size_type i = 0, n = m_segments.size(); i < n; ++i)
+    {
+        if (m_removed[i])
+            continue;
+
+        id_type id = i;
+        for_each_node(m_segments[i], [this, &cursors, id](size_type node) { m_chain_ids[cursors[node]++] = id; });
+    }
+
+    m_chain_offsets.swap(offsets);
+}
+
+template<typename _Key, typename _Value>
+template<typename _Func>
+void indexed_segment_tree<_Key, _Value>::descend(key_type point, _Func& func) const
+{
+    if (!m_leaf_capacity)
+        return;
+
+    if (point < m_keys.front() || m_keys.back() <= point)
+        return;
+
+    size_type node = std::upper_bound(m_keys.begin(), m_keys.end(), point) - m_keys.begin() - 1;
+    const id_type* p = m_chain_ids.data();
+
+    // Walk up from the leaf to the root.
+    for (node += m_leaf_capacity; node; node /= 2)
+        func(p + m_chain_offsets[node], p + m_chain_offsets[node+1]);
+}
+
+template<typename _Key, typename _Value>
+bool indexed_segment_tree<_Key, _Value>::search(key_type point, search_result_type& result) const
+{
+    if (!m_valid_tree)
+        return false;
+
+    search(point, [&result](id_type id) { result.push_back(id); });
+    return true;
+}
+
+template<typename _Key, typename _Value>
+template<typename _Func>
+_Func indexed_segment_tree<_Key, _Value>::search(key_type point, _Func func) const
+{
+    if (!m_valid_tree)
+        return func;
+
+    auto visitor = [this, &func](const id_type* it, const id_type* it_end)
+    {
+        for (; it != it_end; ++it)
+        {
+            if (!m_stale_count || !m_removed[*it])
+                func(*it);
+        }
+    };
+
+    descend(point, visitor);
+    return func;
+}
+
+template<typename _Key, typename _Value>
+typename indexed_segment_tree<_Key, _Value>::size_type
+indexed_segment_tree<_Key, _Value>::count(key_type point) const
+{
+    size_type n = 0;
+    if (!m_valid_tree)
+        return n;
+
+    auto counter = [this, &n](const id_type* it, const id_type* it_end)
+    {
+        if (!m_stale_count)
+        {
+            n += it_end - it;
+            return;
+        }
+
+        for (; it != it_end; ++it)
+        {
+            if (!m_removed[*it])
+                ++n;
+        }
+    };
+
+    descend(point, counter);
+    return n;
+}
+
+template<typename _Key, typename _Value>
+void indexed_segment_tree<_Key, _Value>::clear()
+{
+    m_segments.clear();
+    m_removed.clear();
+    m_removed_count = 0;
+    m_stale_count = 0;
+    m_keys.clear();
+    m_chain_offsets.clear();
+    m_chain_ids.clear();
+    m_leaf_capacity = 0;
+    m_valid_tree = false;
+}
+
 #ifdef MDDS_UNIT_TEST
 template<typename _Key, typename _Value>
 void segment_tree<_Key, _Value>::dump_tree() const
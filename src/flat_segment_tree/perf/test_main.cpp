@@ -0,0 +1,1088 @@
+/*************************************************************************
+ *
+ * Copyright (c) 2021 Kohei Yoshida
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ ************************************************************************/
+
+#include "test_global.hpp" // This must be the first header to be included.
+
+#include <mdds/flat_segment_tree.hpp>
+
+#include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <memory>
+#include <iterator>
+#include <random>
+#include <algorithm>
+
+using namespace std;
+using namespace mdds;
+
+/**
+ * Benchmark suite for flat_segment_tree.  Each measurement is written to
+ * stdout as one tab-separated record:
+ *
+ *   benchmark <TAB> distribution <TAB> size <TAB> operations <TAB> seconds <TAB> checksum
+ *
+ * Lines starting with '#' are comments.  The checksum is derived from the
+ * results of each run so that the work cannot be optimized away, and it
+ * also makes it easy to spot a behavioral change between two runs.
+ *
+ * The sized runs are followed by a set of benchmarks that each compare
+ * alternative code paths on one fixed data set.  For those, the
+ * distribution column names the data set, and the paths being compared
+ * produce the same checksum.
+ *
+ * Usage: flat-segment-tree-test-perf [max size]
+ */
+
+namespace {
+
+typedef flat_segment_tree<long, long> fst_type;
+
+/**
+ * Trait for the row height benchmarks, which store the aggregates and the
+ * key offsets in the non-leaf nodes.
+ */
+struct row_height_trait : public __fst::default_trait
+{
+    constexpr static bool range_aggregate = true;
+    constexpr static bool lazy_shift = true;
+};
+
+enum class dist_type { sequential, uniform, clustered };
+
+const char* to_string(dist_type dist)
+{
+    switch (dist)
+    {
+        case dist_type::sequential:
+            return "sequential";
+        case dist_type::uniform:
+            return "uniform";
+        case dist_type::clustered:
+            return "clustered";
+    }
+    return "unknown";
+}
+
+struct segment
+{
+    long start;
+    long end;
+    long value;
+};
+
+/**
+ * Generate a set of segments whose start positions follow the specified
+ * distribution.  The key space of the tree is [0, size*4).
+ */
+vector<segment> generate_segments(dist_type dist, long size, size_t count)
+{
+    std::mt19937 gen(size + static_cast<long>(dist));
+    long range = size * 4;
+    vector<segment> segments;
+    segments.reserve(count);
+
+    switch (dist)
+    {
+        case dist_type::sequential:
+        {
+            // Back-to-back segments of equal length, in ascending order.
+            long len = std::max<long>(range / count, 1);
+            for (size_t i = 0; i < count; ++i)
+            {
+                long start = (i * len) % range;
+                segments.push_back({start, start + len, long(i % 7)});
+            }
+            break;
+        }
+        case dist_type::uniform:
+        {
+            std::uniform_int_distribution<long> pos(0, range - 2);
+            std::uniform_int_distribution<long> len(1, 16);
+            for (size_t i = 0; i < count; ++i)
+            {
+                long start = pos(gen);
+                long end = std::min(start + len(gen), range);
+                segments.push_back({start, end, long(i % 7)});
+            }
+            break;
+        }
+        case dist_type::clustered:
+        {
+            // Most segments fall into a handful of narrow hot spots.
+            const long cluster_count = 8;
+            long cluster_width = std::max<long>(range / 64, 16);
+            std::uniform_int_distribution<long> cluster(0, cluster_count - 1);
+            std::normal_distribution<double> offset(0.0, cluster_width / 4.0);
+            std::uniform_int_distribution<long> len(1, 8);
+            for (size_t i = 0; i < count; ++i)
+            {
+                long center = (range / cluster_count) * cluster(gen) + range / (cluster_count * 2);
+                long start = center + static_cast<long>(offset(gen));
+                start = std::max<long>(0, std::min(start, range - 2));
+                long end = std::min(start + len(gen), range);
+                segments.push_back({start, end, long(i % 7)});
+            }
+            break;
+        }
+    }
+
+    return segments;
+}
+
+vector<long> generate_queries(long size, size_t count)
+{
+    std::mt19937 gen(size * 31);
+    std::uniform_int_distribution<long> pos(0, size * 4 - 1);
+    vector<long> keys(count);
+    for (long& key : keys)
+        key = pos(gen);
+    return keys;
+}
+
+void print_record(
+    const char* name, const char* data_set, long size, size_t ops, double duration, long checksum)
+{
+    fprintf(stdout, "%s\t%s\t%ld\t%zu\t%.6f\t%ld\n", name, data_set, size, ops, duration, checksum);
+    fflush(stdout);
+}
+
+void print_record(
+    const char* name, dist_type dist, long size, size_t ops, double duration, long checksum)
+{
+    print_record(name, to_string(dist), size, ops, duration, checksum);
+}
+
+long segment_checksum(const fst_type& db)
+{
+    long checksum = 0;
+    for (auto it = db.begin_segment(), it_end = db.end_segment(); it != it_end; ++it)
+        checksum = checksum * 31 + it->start + it->value;
+    return checksum;
+}
+
+/**
+ * Operations that walk the leaf nodes linearly get quadratic over the full
+ * data set, so they only run on a prefix of the segments or queries, sized
+ * to keep the total number of visited nodes roughly constant.
+ */
+size_t get_linear_op_count(long size, size_t count)
+{
+    return std::min<size_t>(count, 200000000L / size);
+}
+
+/**
+ * Fill the tree with the segments sorted by their start positions, so that
+ * large trees can be set up in linear time regardless of the distribution.
+ */
+void populate(fst_type& db, vector<segment> segments)
+{
+    std::stable_sort(segments.begin(), segments.end(),
+        [](const segment& left, const segment& right) { return left.start < right.start; });
+
+    fst_type::const_iterator it = db.begin();
+    for (const segment& seg : segments)
+        it = db.insert(it, seg.start, seg.end, seg.value).first;
+}
+
+void perf_insert_front(dist_type dist, long size, const vector<segment>& segments)
+{
+    fst_type db(0, size * 4, -1);
+    stack_watch sw;
+    for (const segment& seg : segments)
+        db.insert_front(seg.start, seg.end, seg.value);
+    double duration = sw.get_duration();
+    print_record("insert_front", dist, size, segments.size(), duration, segment_checksum(db));
+}
+
+void perf_insert_back(dist_type dist, long size, const vector<segment>& segments)
+{
+    fst_type db(0, size * 4, -1);
+    stack_watch sw;
+    for (const segment& seg : segments)
+        db.insert_back(seg.start, seg.end, seg.value);
+    double duration = sw.get_duration();
+    print_record("insert_back", dist, size, segments.size(), duration, segment_checksum(db));
+}
+
+void perf_insert_hint(dist_type dist, long size, const vector<segment>& segments)
+{
+    fst_type db(0, size * 4, -1);
+    stack_watch sw;
+    fst_type::const_iterator it = db.begin();
+    for (const segment& seg : segments)
+        it = db.insert(it, seg.start, seg.end, seg.value).first;
+    double duration = sw.get_duration();
+    print_record("insert_hint", dist, size, segments.size(), duration, segment_checksum(db));
+}
+
+void perf_build_tree(dist_type dist, long size, fst_type& db)
+{
+    stack_watch sw;
+    db.build_tree();
+    double duration = sw.get_duration();
+    print_record("build_tree", dist, size, db.leaf_size(), duration, db.is_tree_valid());
+}
+
+void perf_search(dist_type dist, long size, const fst_type& db, const vector<long>& queries)
+{
+    size_t linear_count = get_linear_op_count(size, queries.size());
+    auto linear_end = queries.begin() + linear_count;
+
+    long checksum = 0;
+    stack_watch sw;
+    fst_type::const_iterator it = db.begin();
+    for (auto key = queries.begin(); key != linear_end; ++key)
+    {
+        long value = 0;
+        it = db.search(it, *key, value).first;
+        checksum += value;
+    }
+    double duration = sw.get_duration();
+    print_record("search_hint", dist, size, linear_count, duration, checksum);
+
+    checksum = 0;
+    sw.reset();
+    for (auto key = queries.begin(); key != linear_end; ++key)
+    {
+        long value = 0;
+        db.search(*key, value);
+        checksum += value;
+    }
+    duration = sw.get_duration();
+    print_record("search", dist, size, linear_count, duration, checksum);
+
+    checksum = 0;
+    sw.reset();
+    for (long key : queries)
+    {
+        long value = 0;
+        db.search_tree(key, value);
+        checksum += value;
+    }
+    duration = sw.get_duration();
+    print_record("search_tree", dist, size, queries.size(), duration, checksum);
+
+    vector<long> sorted_queries = queries;
+    std::sort(sorted_queries.begin(), sorted_queries.end());
+    vector<long> values(sorted_queries.size());
+    sw.reset();
+    db.search_many(sorted_queries.begin(), sorted_queries.end(), values.begin());
+    duration = sw.get_duration();
+    checksum = 0;
+    for (long v : values)
+        checksum += v;
+    print_record("search_many_sorted", dist, size, queries.size(), duration, checksum);
+}
+
+void perf_iterate(dist_type dist, long size, const fst_type& db)
+{
+    long checksum = 0;
+    stack_watch sw;
+    for (auto it = db.begin(), it_end = db.end(); it != it_end; ++it)
+        checksum += it->first + it->second;
+    double duration = sw.get_duration();
+    print_record("iterate_leaf", dist, size, db.leaf_size(), duration, checksum);
+
+    checksum = 0;
+    sw.reset();
+    for (auto it = db.begin_segment(), it_end = db.end_segment(); it != it_end; ++it)
+        checksum += it->end - it->start + it->value;
+    duration = sw.get_duration();
+    print_record("iterate_segment", dist, size, db.leaf_size() - 1, duration, checksum);
+}
+
+void perf_copy(dist_type dist, long size, const fst_type& db)
+{
+    stack_watch sw;
+    fst_type copied(db);
+    double duration = sw.get_duration();
+    print_record("copy", dist, size, db.leaf_size(), duration, copied.leaf_size());
+
+    sw.reset();
+    copied.build_tree();
+    duration = sw.get_duration();
+    print_record("copy_build_tree", dist, size, db.leaf_size(), duration, copied.is_tree_valid());
+}
+
+void perf_shift(dist_type dist, long size, const fst_type& db, size_t shift_count)
+{
+    std::mt19937 gen(size * 17);
+    std::uniform_int_distribution<long> pos(size, size * 2);
+
+    vector<long> positions(shift_count);
+    for (long& p : positions)
+        p = pos(gen);
+
+    // Alternate right and left shifts of the same amount so that the key
+    // space stays populated throughout the run.
+    {
+        fst_type copied(db);
+        copied.build_tree();
+        stack_watch sw;
+        for (long p : positions)
+        {
+            copied.shift_right(p, 4, false);
+            copied.shift_left(p, p + 4);
+        }
+        double duration = sw.get_duration();
+        long value = 0;
+        copied.search_tree(size, value);
+        print_record("shift_right_left", dist, size, shift_count * 2, duration, value + segment_checksum(copied));
+    }
+
+    // Shifts followed by a tree search, which is what a scrolling view does.
+    {
+        fst_type copied(db);
+        copied.build_tree();
+        long checksum = 0;
+        stack_watch sw;
+        for (long p : positions)
+        {
+            copied.shift_right(p, 4, false);
+            if (!copied.is_tree_valid())
+                copied.build_tree();
+            long value = 0;
+            copied.search_tree(p, value);
+            checksum += value;
+        }
+        double duration = sw.get_duration();
+        print_record("shift_right_search_tree", dist, size, shift_count, duration, checksum);
+    }
+}
+
+void run(dist_type dist, long size)
+{
+    size_t count = size;
+    vector<segment> segments = generate_segments(dist, size, count);
+    vector<long> queries = generate_queries(size, count);
+
+    {
+        size_t n = get_linear_op_count(size, count);
+        vector<segment> head(segments.begin(), segments.begin() + n);
+        perf_insert_front(dist, size, head);
+        perf_insert_back(dist, size, head);
+        perf_insert_hint(dist, size, head);
+    }
+
+    fst_type db(0, size * 4, -1);
+    populate(db, segments);
+    perf_build_tree(dist, size, db);
+    perf_search(dist, size, db, queries);
+    perf_iterate(dist, size, db);
+    perf_copy(dist, size, db);
+    perf_shift(dist, size, db, std::min<size_t>(20000000L / size, 200));
+}
+
+/**
+ * Search unit-length segments via the leaf nodes.
+ */
+void perf_fixed_search_leaf()
+{
+    typedef flat_segment_tree<int, int> db_type;
+    int lower = 0, upper = 50000;
+    db_type db(lower, upper, 0);
+    for (int i = upper-1; i >= lower; --i)
+        db.insert_front(i, i+1, i);
+
+    long success = 0;
+    stack_watch sw;
+    int val = 0;
+    for (int i = lower; i < upper; ++i)
+    {
+        if (db.search(i, val).second)
+            ++success;
+    }
+    double duration = sw.get_duration();
+    print_record("search", "unit", upper - lower, upper - lower, duration, success);
+}
+
+void perf_fixed_search_tree()
+{
+    typedef flat_segment_tree<int, int> db_type;
+    int lower = 0, upper = 5000000;
+    db_type db(lower, upper, 0);
+    for (int i = upper-1; i >= lower; --i)
+        db.insert_front(i, i+1, i);
+
+    stack_watch sw;
+    db.build_tree();
+    double duration = sw.get_duration();
+    print_record("build_tree", "unit", upper - lower, db.leaf_size(), duration, db.is_tree_valid());
+
+    long success = 0;
+    sw.reset();
+    int val = 0;
+    for (int i = lower; i < upper; ++i)
+    {
+        if (db.search_tree(i, val).second)
+            ++success;
+    }
+    duration = sw.get_duration();
+    print_record("search_tree", "unit", upper - lower, upper - lower, duration, success);
+}
+
+/**
+ * Compare search_tree() against the search array, and against a frozen
+ * copy of the same tree.
+ */
+void perf_fixed_search_tree_array()
+{
+    typedef flat_segment_tree<int, int> db_type;
+    int lower = 0, upper = 2000000;
+    db_type db(lower, upper, 0);
+
+    // 1M segments, with every other segment holding a non-default value.
+    for (int i = lower; i < upper; i += 2)
+        db.insert_back(i, i+1, i+1);
+
+    stack_watch sw;
+    db.build_tree_array();
+    double duration = sw.get_duration();
+    print_record("build_tree_array", "alternating", upper - lower, db.leaf_size(), duration, db.is_tree_valid());
+
+    // Random search keys, to defeat the caches.
+    std::mt19937 gen(upper);
+    std::uniform_int_distribution<int> pos(lower, upper - 1);
+    vector<int> keys(upper - lower);
+    for (int& key : keys)
+        key = pos(gen);
+
+    long checksum = 0;
+    int val = 0;
+    sw.reset();
+    for (int key : keys)
+    {
+        db.search_tree(key, val);
+        checksum += val;
+    }
+    duration = sw.get_duration();
+    print_record("search_tree", "alternating", upper - lower, keys.size(), duration, checksum);
+
+    checksum = 0;
+    sw.reset();
+    for (int key : keys)
+    {
+        db.search_tree_array(key, val);
+        checksum += val;
+    }
+    duration = sw.get_duration();
+    print_record("search_tree_array", "alternating", upper - lower, keys.size(), duration, checksum);
+
+    sw.reset();
+    db_type::frozen_type frozen = db.freeze();
+    duration = sw.get_duration();
+    print_record("freeze", "alternating", upper - lower, db.leaf_size(), duration, frozen.size());
+
+    checksum = 0;
+    sw.reset();
+    for (int key : keys)
+    {
+        frozen.search(key, val);
+        checksum += val;
+    }
+    duration = sw.get_duration();
+    print_record("search_frozen", "alternating", upper - lower, keys.size(), duration, checksum);
+}
+
+/**
+ * Interleave insertions and searches at positions spread across the entire
+ * range, with and without incremental search.
+ */
+void perf_fixed_incremental_search()
+{
+    typedef flat_segment_tree<int, int> db_type;
+    int lower = 0, upper = 100000;
+    int n_edits = 10000;
+
+    db_type db(lower, upper, 0);
+    for (int i = lower; i < upper; i += 2)
+        db.insert_back(i, i+1, 1);
+
+    {
+        db_type db_copy(db);
+        long checksum = 0;
+        int val = 0;
+        stack_watch sw;
+        for (int i = 0; i < n_edits; ++i)
+        {
+            int pos = (i * 7919) % upper;
+            db_copy.insert_front(pos, pos+1, i % 3);
+            db_copy.search((pos * 31) % upper, val);
+            checksum += val;
+        }
+        double duration = sw.get_duration();
+        print_record("insert_search", "alternating", upper - lower, n_edits, duration, checksum);
+    }
+
+    {
+        db_type db_copy(db);
+        db_copy.set_incremental_search(true);
+        long checksum = 0;
+        int val = 0;
+        stack_watch sw;
+        for (int i = 0; i < n_edits; ++i)
+        {
+            int pos = (i * 7919) % upper;
+            db_copy.insert_front(pos, pos+1, i % 3);
+            db_copy.search_tree((pos * 31) % upper, val);
+            checksum += val;
+        }
+        double duration = sw.get_duration();
+        print_record("insert_search_incremental", "alternating", upper - lower, n_edits, duration, checksum);
+    }
+}
+
+void perf_fixed_node_pool()
+{
+    typedef flat_segment_tree<int, int> db_type;
+    int lower = 0, upper = 2000000;
+
+    // Insert the segments in several interleaving passes, so that the leaf
+    // nodes do not end up in key order in memory.
+    db_type db(lower, upper, 0);
+    int n_passes = 16;
+    for (int pass = 0; pass < n_passes; ++pass)
+    {
+        db_type::const_iterator it = db.begin();
+        for (int i = lower + pass * 2; i < upper; i += n_passes * 2)
+            it = db.insert(it, i, i+1, 1).first;
+    }
+
+    db_type db_pooled(db);
+    db_pooled.set_node_pool(true);
+
+    const int n_repeats = 10;
+    const db_type* dbs[] = { &db, &db_pooled };
+    const char* iterate_names[] = { "iterate_leaf", "iterate_leaf_pooled" };
+    const char* copy_names[] = { "copy_destroy", "copy_destroy_pooled" };
+
+    for (int i = 0; i < 2; ++i)
+    {
+        long checksum = 0;
+        stack_watch sw;
+        for (int j = 0; j < n_repeats; ++j)
+        {
+            for (const auto& node : *dbs[i])
+                checksum += node.second;
+        }
+        double duration = sw.get_duration();
+        print_record(iterate_names[i], "interleaved", upper - lower, dbs[i]->leaf_size() * n_repeats, duration, checksum);
+
+        sw.reset();
+        size_t leaf_size = 0;
+        {
+            db_type db_copy(*dbs[i]);
+            leaf_size = db_copy.leaf_size();
+        }
+        duration = sw.get_duration();
+        print_record(copy_names[i], "interleaved", upper - lower, leaf_size, duration, leaf_size);
+    }
+}
+
+void perf_fixed_assign()
+{
+    typedef flat_segment_tree<int, int> db_type;
+    typedef db_type::const_segment_iterator::value_type segment_type;
+    int lower = 0, upper = 2000000;
+
+    vector<segment_type> segments;
+    segments.reserve(upper / 2);
+    for (int i = lower; i < upper; i += 2)
+    {
+        segment_type seg;
+        seg.start = i;
+        seg.end = i + 1;
+        seg.value = (i / 2) % 3;
+        segments.push_back(seg);
+    }
+
+    db_type db1(lower, upper, 0), db2(lower, upper, 0);
+
+    stack_watch sw;
+    for (const segment_type& seg : segments)
+        db1.insert_back(seg.start, seg.end, seg.value);
+    db1.build_tree();
+    double duration = sw.get_duration();
+    print_record("insert_back_build_tree", "alternating", upper - lower, segments.size(), duration, db1.leaf_size());
+
+    sw.reset();
+    db2.assign(segments.begin(), segments.end());
+    duration = sw.get_duration();
+    print_record("assign", "alternating", upper - lower, segments.size(), duration, db2.leaf_size());
+}
+
+/**
+ * Look up a window of consecutive rows, one key at a time and in batch.
+ */
+void perf_fixed_search_many()
+{
+    typedef flat_segment_tree<int, int> db_type;
+    int lower = 0, upper = 2000000;
+
+    db_type db(lower, upper, 0);
+    for (int i = lower; i < upper; i += 2)
+        db.insert_back(i, i+1, 1);
+    db.build_tree();
+
+    vector<int> keys;
+    for (int i = 0; i < 200000; ++i)
+        keys.push_back(upper / 3 + i);
+
+    long checksum = 0;
+    int val = 0;
+    stack_watch sw;
+    for (int key : keys)
+    {
+        db.search_tree(key, val);
+        checksum += val;
+    }
+    double duration = sw.get_duration();
+    print_record("search_tree", "alternating_window", upper - lower, keys.size(), duration, checksum);
+
+    vector<int> values;
+    values.reserve(keys.size());
+    sw.reset();
+    db.search_many(keys.begin(), keys.end(), std::back_inserter(values));
+    duration = sw.get_duration();
+    checksum = 0;
+    for (int v : values)
+        checksum += v;
+    print_record("search_many", "alternating_window", upper - lower, keys.size(), duration, checksum);
+}
+
+/**
+ * Sum row heights over ranges, and map pixel offsets back to rows, by
+ * walking the segments and via the tree.
+ */
+void perf_fixed_aggregate()
+{
+    typedef flat_segment_tree<long, int, row_height_trait> db_type;
+    long lower = 0, upper = 2000000;
+
+    // Row heights, with every other row having a custom height.
+    db_type db(lower, upper, 255);
+    for (long i = lower; i < upper; i += 2)
+        db.insert_back(i, i+1, 300 + (i % 7));
+
+    // Cost of maintaining the aggregates in the non-leaf nodes.
+    {
+        flat_segment_tree<long, int> db_plain(lower, upper, 255);
+        for (long i = lower; i < upper; i += 2)
+            db_plain.insert_back(i, i+1, 300 + (i % 7));
+
+        stack_watch sw;
+        db_plain.build_tree();
+        double duration = sw.get_duration();
+        print_record("build_tree", "row_heights", upper - lower, db_plain.leaf_size(), duration, db_plain.is_tree_valid());
+
+        db_type db_copy(db);
+        sw.reset();
+        db_copy.build_tree();
+        duration = sw.get_duration();
+        print_record("build_tree_aggregate", "row_heights", upper - lower, db_copy.leaf_size(), duration, db_copy.is_tree_valid());
+    }
+
+    std::mt19937 gen(upper);
+    std::uniform_int_distribution<long> pos(lower, upper - 1);
+    vector<std::pair<long, long>> ranges;
+    for (int i = 0; i < 200; ++i)
+    {
+        long start = pos(gen);
+        long end = pos(gen);
+        if (end < start)
+            std::swap(start, end);
+        ranges.emplace_back(start, end);
+    }
+
+    long checksum = 0;
+    stack_watch sw;
+    for (const auto& range : ranges)
+    {
+        for (auto it = db.begin_segment(), it_end = db.end_segment(); it != it_end; ++it)
+        {
+            long start = std::max(range.first, it->start);
+            long end = std::min(range.second, it->end);
+            if (start < end)
+                checksum += (end - start) * it->value;
+        }
+    }
+    double duration = sw.get_duration();
+    print_record("aggregate_iterate_segment", "row_heights", upper - lower, ranges.size(), duration, checksum);
+
+    checksum = 0;
+    sw.reset();
+    db.build_tree();
+    for (const auto& range : ranges)
+        checksum += db.aggregate(range.first, range.second).sum;
+    duration = sw.get_duration();
+    print_record("aggregate", "row_heights", upper - lower, ranges.size(), duration, checksum);
+
+    // Map the end of each range back to a row.
+    long total = db.aggregate(lower, upper).sum;
+    vector<long> offsets;
+    for (const auto& range : ranges)
+        offsets.push_back(total / upper * range.second);
+
+    checksum = 0;
+    sw.reset();
+    for (long offset : offsets)
+    {
+        long cum = 0;
+        for (auto it = db.begin_segment(), it_end = db.end_segment(); it != it_end; ++it)
+        {
+            long seg_weight = (it->end - it->start) * it->value;
+            if (offset < cum + seg_weight)
+            {
+                checksum += it->start + (offset - cum) / it->value;
+                break;
+            }
+            cum += seg_weight;
+        }
+    }
+    duration = sw.get_duration();
+    print_record("offset_to_row_iterate_segment", "row_heights", upper - lower, offsets.size(), duration, checksum);
+
+    checksum = 0;
+    sw.reset();
+    for (long offset : offsets)
+    {
+        long key = 0;
+        db.search_weight(offset, key);
+        checksum += key;
+    }
+    duration = sw.get_duration();
+    print_record("search_weight", "row_heights", upper - lower, offsets.size(), duration, checksum);
+}
+
+/**
+ * Insert and delete rows near the top, and look up a row after each edit.
+ */
+void perf_fixed_lazy_shift()
+{
+    typedef flat_segment_tree<long, int, row_height_trait> db_type;
+    long lower = 0, upper = 2000000;
+    int n_edits = 200;
+
+    // Row heights, with every other row below the first 1000 rows having a
+    // custom height.
+    db_type db(lower, upper, 255);
+    for (long i = 1000; i < upper / 2; i += 2)
+        db.insert_back(i, i+1, 300 + (i % 7));
+
+    const char* names[] = { "shift_search_incremental", "shift_search_lazy" };
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        db_type db_copy(db);
+        if (pass == 0)
+            db_copy.set_incremental_search(true);
+        else
+            db_copy.build_tree();
+
+        long checksum = 0;
+        int val = 0;
+        stack_watch sw;
+        for (int i = 0; i < n_edits; ++i)
+        {
+            long pos = 11 + i % 100;
+            if (i % 2)
+                db_copy.shift_left(pos, pos + 3);
+            else
+                db_copy.shift_right(pos, 4, false);
+            db_copy.search_tree((pos * 7919) % upper, val);
+            checksum += val;
+        }
+        double duration = sw.get_duration();
+        print_record(names[pass], "row_heights", upper - lower, n_edits, duration, checksum);
+    }
+}
+
+/**
+ * Overlay one formatting layer onto another, by insertion and via merge().
+ */
+void perf_fixed_merge()
+{
+    typedef flat_segment_tree<long, int> db_type;
+    long lower = 0, upper = 2000000;
+
+    // Two formatting layers with interleaving segments.
+    db_type db1(lower, upper, 0), db2(lower, upper, 0);
+    for (long i = lower; i < upper; i += 10)
+    {
+        db1.insert_back(i, i+4, 1 + (i % 3));
+        db2.insert_back(i+3, i+7, 4 + (i % 5));
+    }
+
+    {
+        stack_watch sw;
+        db_type db_inserted(db1);
+        db_type::const_iterator pos = db_inserted.begin();
+        for (auto it = db2.begin_segment(); it != db2.end_segment(); ++it)
+        {
+            if (it->value)
+                pos = db_inserted.insert(pos, it->start, it->end, it->value).first;
+        }
+        double duration = sw.get_duration();
+        print_record("merge_insert", "two_layers", upper - lower, db2.leaf_size(), duration, db_inserted.leaf_size());
+    }
+
+    {
+        stack_watch sw;
+        db_type db_merged = db_type::merge(db1, db2, [](int v1, int v2) { return v2 ? v2 : v1; });
+        double duration = sw.get_duration();
+        print_record("merge", "two_layers", upper - lower, db2.leaf_size(), duration, db_merged.leaf_size());
+    }
+}
+
+/**
+ * Restore a tree from its saved state, by insertion, via load_state() and
+ * via a view over the state buffer.
+ */
+void perf_fixed_load_state()
+{
+    typedef flat_segment_tree<long, int> db_type;
+    long lower = 0, upper = 2000000;
+
+    // Row heights, with every other row having a custom height.
+    db_type db(lower, upper, 255);
+    for (long i = lower; i < upper; i += 2)
+        db.insert_back(i, i+1, 300 + (i % 7));
+
+    std::ostringstream os;
+    db.save_state(os);
+    std::string state = os.str();
+
+    {
+        stack_watch sw;
+        db_type db2(lower, upper, 255);
+        for (auto it = db.begin_segment(); it != db.end_segment(); ++it)
+            db2.insert_back(it->start, it->end, it->value);
+        double duration = sw.get_duration();
+        print_record("insert_back", "row_heights", upper - lower, db.leaf_size(), duration, db2 == db);
+    }
+
+    for (bool pooled : { false, true })
+    {
+        stack_watch sw;
+        db_type db2(0, 1, 0);
+        db2.set_node_pool(pooled);
+        std::istringstream is(state);
+        db2.load_state(is);
+        double duration = sw.get_duration();
+        print_record(pooled ? "load_state_pooled" : "load_state", "row_heights", upper - lower, db.leaf_size(), duration, db2 == db);
+    }
+
+    vector<uint64_t> buffer(state.size() / 8 + 1);
+    std::memcpy(buffer.data(), state.data(), state.size());
+
+    long checksum = 0;
+    size_t ops = 0;
+    stack_watch sw;
+    db_type::view_type view(reinterpret_cast<const char*>(buffer.data()), state.size());
+    int val = 0;
+    for (long i = lower; i < upper; i += 1000, ++ops)
+    {
+        view.search(i, val);
+        checksum += val;
+    }
+    double duration = sw.get_duration();
+    print_record("view_search", "row_heights", upper - lower, ops, duration, checksum);
+}
+
+void perf_fixed_insert_front_back()
+{
+    typedef flat_segment_tree<unsigned long, int> db_type;
+    unsigned long upper = 20000;
+
+    {
+        db_type db(0, upper, 0);
+        int val = 0;
+        stack_watch sw;
+        for (unsigned long i = 0; i < upper; ++i)
+        {
+            db.insert_front(i, i+1, val);
+            if (++val > 10)
+                val = 0;
+        }
+        double duration = sw.get_duration();
+        print_record("insert_front", "unit", upper, upper, duration, db.leaf_size());
+    }
+
+    {
+        db_type db(0, upper, 0);
+        int val = 0;
+        stack_watch sw;
+        for (unsigned long i = 0; i < upper; ++i)
+        {
+            db.insert_back(i, i+1, val);
+            if (++val > 10)
+                val = 0;
+        }
+        double duration = sw.get_duration();
+        print_record("insert_back", "unit", upper, upper, duration, db.leaf_size());
+    }
+}
+
+void perf_fixed_insert_position()
+{
+    typedef flat_segment_tree<long, bool> db_type;
+    long upper = 60000;
+
+    {
+        db_type db(0, upper, false);
+        bool val = false;
+        stack_watch sw;
+        for (long i = 0; i < upper; ++i)
+        {
+            db.insert_front(i, i+1, val);
+            val = !val;
+        }
+        double duration = sw.get_duration();
+        print_record("insert_front", "unit_bool", upper, upper, duration, db.leaf_size());
+    }
+
+    {
+        db_type db(0, upper, false);
+        bool val = false;
+        stack_watch sw;
+        for (long i = 0; i < upper; ++i)
+        {
+            db.insert_back(i, i+1, val);
+            val = !val;
+        }
+        double duration = sw.get_duration();
+        print_record("insert_back", "unit_bool", upper, upper, duration, db.leaf_size());
+    }
+
+    db_type db(0, upper, false);
+    const char* names[] = { "insert_hint", "insert_hint_reinsert" };
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        // The second pass inserts the opposite values over the same keys.
+        bool val = pass == 1;
+        stack_watch sw;
+        db_type::const_iterator itr = db.begin();
+        for (long i = 0; i < upper; ++i)
+        {
+            itr = db.insert(itr, i, i+1, val).first;
+            val = !val;
+        }
+        double duration = sw.get_duration();
+        print_record(names[pass], "unit_bool", upper, upper, duration, db.leaf_size());
+    }
+}
+
+void perf_fixed_position_search()
+{
+    typedef flat_segment_tree<long, bool> db_type;
+    long upper = 60000;
+    db_type db(0, upper, false);
+
+    // Fill the leaf nodes first.
+    db_type::const_iterator itr = db.begin();
+    bool val = false;
+    for (long i = 0; i < upper; ++i)
+    {
+        itr = db.insert(itr, i, i+1, val).first;
+        val = !val;
+    }
+
+    long checksum = 0;
+    stack_watch sw;
+    for (long i = 0; i < upper; ++i)
+    {
+        bool val2 = false;
+        db.search(i, val2);
+        checksum += val2;
+    }
+    double duration = sw.get_duration();
+    print_record("search", "unit_bool", upper, upper, duration, checksum);
+
+    checksum = 0;
+    sw.reset();
+    itr = db.begin();
+    for (long i = 0; i < upper; ++i)
+    {
+        bool val2 = false;
+        itr = db.search(itr, i, val2).first;
+        checksum += val2;
+    }
+    duration = sw.get_duration();
+    print_record("search_hint", "unit_bool", upper, upper, duration, checksum);
+}
+
+void run_fixed()
+{
+    perf_fixed_search_leaf();
+    perf_fixed_search_tree();
+    perf_fixed_search_tree_array();
+    perf_fixed_incremental_search();
+    perf_fixed_node_pool();
+    perf_fixed_assign();
+    perf_fixed_search_many();
+    perf_fixed_aggregate();
+    perf_fixed_lazy_shift();
+    perf_fixed_merge();
+    perf_fixed_load_state();
+    perf_fixed_insert_front_back();
+    perf_fixed_insert_position();
+    perf_fixed_position_search();
+}
+
+}
+
+int main (int argc, char **argv)
+{
+    long max_size = 1000000;
+    if (argc > 1)
+    {
+        max_size = strtol(argv[1], nullptr, 10);
+        if (max_size <= 0)
+        {
+            cerr << "invalid maximum size: " << argv[1] << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    const dist_type dists[] = { dist_type::sequential, dist_type::uniform, dist_type::clustered };
+
+    fprintf(stdout, "# benchmark\tdistribution\tsize\toperations\tseconds\tchecksum\n");
+
+    for (long size = 1000; size <= max_size; size *= 10)
+    {
+        for (dist_type dist : dists)
+            run(dist, size);
+    }
+
+    run_fixed();
+
+    return EXIT_SUCCESS;
+}
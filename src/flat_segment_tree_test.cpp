@@ -35,12 +35,26 @@
 #include <iterator>
 #include <algorithm>
 #include <memory>
+#include <sstream>
+#include <cstring>
+#include <cstdint>
 
 #define ARRAY_SIZE(x) sizeof(x)/sizeof(x[0])
 
 using namespace std;
 using namespace mdds;
 
+struct aggregate_trait : public __fst::default_trait
+{
+    constexpr static bool range_aggregate = true;
+};
+
+struct lazy_shift_trait : public __fst::default_trait
+{
+    constexpr static bool range_aggregate = true;
+    constexpr static bool lazy_shift = true;
+};
+
 void print_title(const char* msg)
 {
     cout << "+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++" << endl;
@@ -162,57 +176,6 @@ void fst_test_tree_build()
     }
 }
 
-void fst_perf_test_search_leaf()
-{
-    stack_printer __stack_printer__("fst_perf_test_search_leaf");
-
-    int lower = 0, upper = 50000;
-    flat_segment_tree<int, int> db(lower, upper, 0);
-    for (int i = upper-1; i >= lower; --i)
-        db.insert_front(i, i+1, i);
-
-    int success = 0, failure = 0;
-    int val;
-    for (int i = lower; i < upper; ++i)
-    {
-        if (db.search(i, val).second)
-            ++success;
-        else
-            ++failure;
-    }
-    fprintf(stdout, "fst_perf_test_search_leaf:   success (%d)  failure (%d)\n", success, failure);
-}
-
-void fst_perf_test_search_tree()
-{
-    stack_printer __stack_printer__("fst_perf_test_leaf_search");
-
-    int lower = 0, upper = 5000000;
-    flat_segment_tree<int, int> db(lower, upper, 0);
-    for (int i = upper-1; i >= lower; --i)
-        db.insert_front(i, i+1, i);
-
-    {
-        stack_printer sp2("::fst_perf_test_search_tree (build tree)");
-        db.build_tree();
-    }
-
-    int success = 0, failure = 0;
-    {
-        stack_printer sp2("::fst_perf_test_search_tree (search tree)");
-        int val;
-        for (int i = lower; i < upper; ++i)
-        {
-            if (db.search_tree(i, val).second)
-                ++success;
-            else
-                ++failure;
-        }
-    }
-
-    fprintf(stdout, "fst_perf_test_search:   success (%d)  failure (%d)\n", success, failure);
-}
-
 void fst_test_tree_search()
 {
     stack_printer __stack_printer__("::fst_test_tree_search");
@@ -280,6 +243,674 @@ void fst_test_tree_search()
     assert(ret.first == db.end());
 }
 
+void fst_test_tree_search_array()
+{
+    stack_printer __stack_printer__("::fst_test_tree_search_array");
+    typedef flat_segment_tree<int, int> fst_type;
+    typedef pair<fst_type::const_iterator,bool> ret_type;
+
+    int lower = 0, upper = 200;
+    fst_type db(lower, upper, 0);
+
+    int val, start, end;
+
+    // Array search should fail until the tree is built.
+    assert(!db.search_tree_array(5, val).second);
+
+    // Building the tree alone doesn't build the array.
+    db.build_tree();
+    assert(!db.has_search_array());
+    assert(db.search_tree_array(5, val).second);
+
+    db.build_tree_array();
+    assert(db.has_search_array());
+    ret_type ret = db.search_tree_array(5, val, &start, &end);
+    assert(ret.second);
+    assert(start == lower && end == upper && val == 0);
+    assert(ret.first == db.begin());
+
+    // Try different leaf counts, to cover both full and partially-filled
+    // bottom levels of the array.
+    for (int delta = 1; delta <= 13; ++delta)
+    {
+        db.clear();
+        for (int i = lower + delta; i < upper; i += delta * 2)
+            db.insert_back(i, i + delta, i);
+
+        assert(!db.search_tree_array(lower, val).second);
+        db.build_tree_array();
+        assert(db.is_tree_valid() && db.has_search_array());
+
+        for (int i = lower - 10; i < upper + 10; ++i)
+        {
+            int val2, start2, end2;
+            ret_type ret1 = db.search_tree(i, val, &start, &end);
+            ret_type ret2 = db.search_tree_array(i, val2, &start2, &end2);
+            assert(ret1.second == ret2.second);
+            assert(ret1.first == ret2.first);
+            if (ret1.second)
+                assert(val == val2 && start == start2 && end == end2);
+        }
+    }
+
+    // The index should go away along with the tree.
+    fst_type db2(db);
+    assert(!db2.has_search_array());
+    assert(!db2.search_tree_array(5, val).second);
+    db.swap(db2);
+    assert(!db.search_tree_array(5, val).second);
+    assert(db2.has_search_array());
+    assert(db2.search_tree_array(5, val).second);
+
+    db2.insert_back(upper - 5, upper, 1);
+    assert(!db2.is_tree_valid() && !db2.has_search_array());
+}
+
+void fst_test_incremental_search()
+{
+    stack_printer __stack_printer__("::fst_test_incremental_search");
+    typedef flat_segment_tree<int, int> fst_type;
+
+    int lower = 0, upper = 300;
+    fst_type db(lower, upper, 0);
+    assert(!db.is_incremental_search());
+    db.set_incremental_search(true);
+    assert(db.is_incremental_search());
+
+    // Check every key against the linear leaf search.
+    auto check_all = [&](const fst_type& db_check)
+    {
+        for (int i = lower - 5; i < upper + 5; ++i)
+        {
+            int val1 = -1, start1 = -1, end1 = -1;
+            int val2 = -1, start2 = -1, end2 = -1;
+            auto ret1 = db_check.search(i, val1, &start1, &end1);
+            auto ret2 = db_check.search_tree(i, val2, &start2, &end2);
+            assert(ret1.second == ret2.second);
+            assert(ret1.first == ret2.first);
+            if (ret1.second)
+                assert(val1 == val2 && start1 == start2 && end1 == end2);
+        }
+    };
+
+    check_all(db);
+
+    // Mix insertions and shifts, without ever building the tree.
+    unsigned int seed = 7;
+    auto next_rand = [&seed](int range)
+    {
+        seed = seed * 1103515245u + 12345u;
+        return static_cast<int>((seed >> 8) % static_cast<unsigned int>(range));
+    };
+
+    for (int i = 0; i < 400; ++i)
+    {
+        int start = next_rand(upper + 20) - 10;
+        int len = next_rand(30) + 1;
+        int val = next_rand(4);
+
+        switch (next_rand(6))
+        {
+            case 0:
+                db.insert_front(start, start + len, val);
+                break;
+            case 1:
+                db.insert_back(start, start + len, val);
+                break;
+            case 2:
+                db.insert(db.begin(), start, start + len, val);
+                break;
+            case 3:
+                db.shift_left(start, start + len);
+                break;
+            case 4:
+                db.shift_right(start, len, false);
+                break;
+            case 5:
+                db.shift_right(start, len, true);
+                break;
+            default:
+                ;
+        }
+
+        assert(!db.is_tree_valid());
+        check_all(db);
+    }
+
+    // Copies retain the mode.
+    fst_type db2(db);
+    assert(db2.is_incremental_search());
+    check_all(db2);
+    db2.insert_front(10, 20, 99);
+    check_all(db2);
+    assert(db2 != db);
+
+    fst_type db3(lower, upper, 0);
+    db3 = db2;
+    assert(db3.is_incremental_search());
+    check_all(db3);
+
+    db.swap(db3);
+    check_all(db);
+    check_all(db3);
+
+    db.clear();
+    check_all(db);
+    db.insert_back(50, 60, 1);
+    check_all(db);
+
+    // Disabling it falls back to the regular tree search.
+    db.set_incremental_search(false);
+    int val;
+    assert(!db.search_tree(55, val).second);
+    db.build_tree();
+    assert(db.search_tree(55, val).second && val == 1);
+}
+
+void fst_test_node_pool()
+{
+    stack_printer __stack_printer__("::fst_test_node_pool");
+    typedef flat_segment_tree<int, std::string> fst_type;
+
+    int lower = 0, upper = 500;
+    fst_type db(lower, upper, "-");
+    fst_type db_pooled(lower, upper, "-");
+    assert(!db_pooled.has_node_pool());
+    db_pooled.insert_back(10, 20, "A");
+    db_pooled.set_node_pool(true);
+    assert(db_pooled.has_node_pool());
+    db.insert_back(10, 20, "A");
+    assert(db == db_pooled);
+
+    // Run the same sequence of operations on both containers, which should
+    // stay identical throughout.
+    unsigned int seed = 11;
+    auto next_rand = [&seed](int range)
+    {
+        seed = seed * 1103515245u + 12345u;
+        return static_cast<int>((seed >> 8) % static_cast<unsigned int>(range));
+    };
+
+    const char* values[] = { "-", "A", "B", "C" };
+
+    for (int i = 0; i < 1000; ++i)
+    {
+        int start = next_rand(upper);
+        int len = next_rand(20) + 1;
+        std::string val = values[next_rand(4)];
+
+        switch (next_rand(4))
+        {
+            case 0:
+                db.insert_front(start, start + len, val);
+                db_pooled.insert_front(start, start + len, val);
+                break;
+            case 1:
+                db.insert_back(start, start + len, val);
+                db_pooled.insert_back(start, start + len, val);
+                break;
+            case 2:
+                db.shift_left(start, start + len);
+                db_pooled.shift_left(start, start + len);
+                break;
+            case 3:
+                db.shift_right(start, len, false);
+                db_pooled.shift_right(start, len, false);
+                break;
+            default:
+                ;
+        }
+
+        assert(db == db_pooled);
+    }
+
+    // Copies of a pooled container are pooled too.
+    fst_type db_copy(db_pooled);
+    assert(db_copy.has_node_pool());
+    assert(db_copy == db);
+
+    // Toggling the pool should not change the content, and the tree should
+    // still be buildable and searchable.
+    db_copy.set_node_pool(false);
+    db_copy.insert_front(5, 8, "X");
+    db_copy.set_node_pool(true);
+    db_copy.insert_front(50, 80, "Y");
+    db.insert_front(5, 8, "X");
+    db.insert_front(50, 80, "Y");
+    assert(db_copy == db);
+
+    db_copy.build_tree();
+    for (int i = lower; i < upper; ++i)
+    {
+        std::string val1, val2;
+        int start1, end1, start2, end2;
+        assert(db.search(i, val1, &start1, &end1).second);
+        assert(db_copy.search_tree(i, val2, &start2, &end2).second);
+        assert(val1 == val2 && start1 == start2 && end1 == end2);
+    }
+
+    db_copy.swap(db);
+    assert(db.has_node_pool());
+    assert(!db_copy.has_node_pool());
+    assert(db == db_copy);
+
+    db.clear();
+    assert(db.leaf_size() == 2);
+    db.insert_back(0, 10, "A");
+    assert(db.leaf_size() == 3);
+}
+
+void fst_test_node_pool_release()
+{
+    stack_printer __stack_printer__("::fst_test_node_pool_release");
+    typedef flat_segment_tree<int, std::shared_ptr<int>> fst_type;
+
+    auto p = std::make_shared<int>(42);
+
+    fst_type db(0, 1000, nullptr);
+    db.set_node_pool(true);
+    for (int i = 0; i < 100; ++i)
+        db.insert_back(i * 2, i * 2 + 1, p);
+
+    assert(p.use_count() == 101);
+
+    // Removing segments should release their values right away.
+    db.shift_left(0, 100);
+    assert(p.use_count() == 51);
+
+    // The values should not stay in the pool once they're cleared.
+    db.clear();
+    assert(db.leaf_size() == 2);
+    assert(p.use_count() == 1);
+
+    // Recycled slots should be usable again.
+    for (int i = 0; i < 100; ++i)
+        db.insert_back(i * 2, i * 2 + 1, p);
+
+    assert(p.use_count() == 101);
+
+    // Disabling the pool should move the values out of it.
+    db.set_node_pool(false);
+    assert(p.use_count() == 101);
+    db.clear();
+    assert(p.use_count() == 1);
+
+    {
+        fst_type db2(0, 1000, nullptr);
+        db2.set_node_pool(true);
+        db2.insert_back(0, 10, p);
+        db2.insert_back(20, 30, p);
+        assert(p.use_count() == 3);
+    }
+
+    assert(p.use_count() == 1);
+}
+
+void fst_test_assign()
+{
+    stack_printer __stack_printer__("::fst_test_assign");
+    typedef flat_segment_tree<int, int> fst_type;
+    typedef fst_type::const_segment_iterator::value_type segment_type;
+
+    auto make_segment = [](int start, int end, int value)
+    {
+        segment_type seg;
+        seg.start = start;
+        seg.end = end;
+        seg.value = value;
+        return seg;
+    };
+
+    std::vector<segment_type> segments = {
+        make_segment(-5, 2, 1),   // gets clipped at 0.
+        make_segment(2, 4, 1),    // gets merged with the previous one.
+        make_segment(6, 6, 3),    // empty segment to be ignored.
+        make_segment(6, 8, 0),    // same as the default value.
+        make_segment(8, 10, 2),
+        make_segment(12, 15, 3),
+        make_segment(15, 30, 4),  // gets clipped at 20.
+    };
+
+    fst_type db(0, 20, 0);
+    db.insert_back(3, 7, 9);
+    db.assign(segments.begin(), segments.end());
+    assert(db.is_tree_valid());
+
+    fst_type expected(0, 20, 0);
+    for (const segment_type& seg : segments)
+        expected.insert_back(seg.start, seg.end, seg.value);
+    assert(db == expected);
+
+    {
+        std::vector<int> keys = { 0, 4, 8, 10, 12, 15, 20 };
+        std::vector<int> values = { 1, 0, 2, 0, 3, 4 };
+        assert(db.verify_keys(keys));
+        assert(db.verify_values(values));
+    }
+
+    int val, start, end;
+    assert(db.search_tree(9, val, &start, &end).second);
+    assert(val == 2 && start == 8 && end == 10);
+
+    // Assign from the segments of another instance.
+    fst_type db2(0, 20, 0);
+    db2.assign(db.begin_segment(), db.end_segment());
+    assert(db2 == db);
+
+    // Empty sequence resets the content.
+    db2.assign(segments.end(), segments.end());
+    assert(db2.leaf_size() == 2);
+    assert(db2.search_tree(5, val).second && val == 0);
+
+    // Segments that are not sorted should leave the content unchanged.
+    std::vector<segment_type> bad = {
+        make_segment(2, 4, 1),
+        make_segment(3, 5, 2),
+    };
+
+    try
+    {
+        db.assign(bad.begin(), bad.end());
+        assert(!"exception should have been thrown.");
+    }
+    catch (const mdds::invalid_arg_error&)
+    {
+        // good.
+    }
+    assert(db == expected);
+
+    // Pooled storage and incremental search should be retained.
+    fst_type db3(0, 20, 0);
+    db3.set_node_pool(true);
+    db3.set_incremental_search(true);
+    db3.assign(segments.begin(), segments.end());
+    assert(db3.has_node_pool());
+    assert(db3.is_incremental_search());
+    assert(db3 == expected);
+    db3.insert_front(16, 18, 5);
+    expected.insert_front(16, 18, 5);
+    assert(db3 == expected);
+    assert(db3.search_tree(17, val).second && val == 5);
+}
+
+void fst_test_search_many()
+{
+    stack_printer __stack_printer__("::fst_test_search_many");
+    typedef flat_segment_tree<int, int> fst_type;
+
+    int lower = 0, upper = 100;
+    fst_type db(lower, upper, -1);
+    for (int i = lower; i < upper; i += 7)
+        db.insert_back(i, i + 3, i);
+
+    auto check = [&](const std::vector<int>& keys)
+    {
+        std::vector<int> expected;
+        size_t expected_found = 0;
+        for (int key : keys)
+        {
+            int val = -1;
+            if (db.search(key, val).second)
+                ++expected_found;
+            else
+                val = db.default_value();
+            expected.push_back(val);
+        }
+
+        std::vector<int> values;
+        size_t found = db.search_many(keys.begin(), keys.end(), std::back_inserter(values));
+        assert(found == expected_found);
+        assert(values == expected);
+    };
+
+    std::vector<int> sorted_keys;
+    for (int i = lower - 5; i < upper + 5; i += 2)
+        sorted_keys.push_back(i);
+
+    std::vector<int> unsorted_keys = { 50, 3, 99, -1, 3, 100, 0, 72, 71, 8 };
+    std::vector<int> empty_keys;
+
+    // Leaf walk only.
+    check(sorted_keys);
+    check(unsorted_keys);
+    check(empty_keys);
+
+    // Start via the tree.
+    db.build_tree();
+    check(sorted_keys);
+    check(unsorted_keys);
+
+    // Start via the incremental search index.
+    db.set_incremental_search(true);
+    db.insert_front(40, 60, 5);
+    check(sorted_keys);
+    check(unsorted_keys);
+
+    // Output to a plain array.
+    int keys[] = { 41, 45, 98 };
+    int values[3];
+    assert(db.search_many(keys, keys + 3, values) == 3);
+    assert(values[0] == 5 && values[1] == 5 && values[2] == 98);
+}
+
+void fst_test_aggregate()
+{
+    stack_printer __stack_printer__("::fst_test_aggregate");
+    typedef flat_segment_tree<int, int, aggregate_trait> fst_type;
+
+    int lower = 0, upper = 120;
+    fst_type db(lower, upper, 5);
+
+    unsigned int seed = 3;
+    auto next_rand = [&seed](int range)
+    {
+        seed = seed * 1103515245u + 12345u;
+        return static_cast<int>((seed >> 8) % static_cast<unsigned int>(range));
+    };
+
+    for (int i = 0; i < 40; ++i)
+    {
+        int start = next_rand(upper);
+        db.insert_front(start, start + next_rand(10) + 1, next_rand(20) - 5);
+    }
+
+    // Compute the expected aggregate by visiting every key in the range.
+    auto check = [&](int start, int end)
+    {
+        long sum = 0;
+        size_t count = 0;
+        int min_value = 0, max_value = 0;
+        int prev_start = -1;
+        for (int i = std::max(start, lower); i < std::min(end, upper); ++i)
+        {
+            int val, seg_start;
+            assert(db.search(i, val, &seg_start).second);
+            sum += val;
+            if (seg_start != prev_start)
+            {
+                if (!count || val < min_value)
+                    min_value = val;
+                if (!count || max_value < val)
+                    max_value = val;
+                ++count;
+                prev_start = seg_start;
+            }
+        }
+
+        fst_type::aggregate_type agg = db.aggregate(start, end);
+        assert(agg.sum == sum);
+        assert(agg.count == count);
+        if (count)
+            assert(agg.min_value == min_value && agg.max_value == max_value);
+    };
+
+    auto check_all = [&]()
+    {
+        for (int start = lower - 3; start < upper + 3; start += 3)
+            for (int end = start; end < upper + 5; end += 4)
+                check(start, end);
+    };
+
+    // Leaf walk.
+    check_all();
+
+    // Tree.
+    db.build_tree();
+    check_all();
+
+    fst_type::aggregate_type agg = db.aggregate(lower, upper);
+    assert(agg.count == db.leaf_size() - 1);
+
+    // Incremental search index.
+    db.set_incremental_search(true);
+    db.insert_front(30, 60, 100);
+    check_all();
+
+    // Boolean values count the length of the true segments.
+    flat_segment_tree<int, bool, aggregate_trait> db_bool(0, 100, false);
+    db_bool.insert_back(10, 20, true);
+    db_bool.insert_back(50, 55, true);
+    db_bool.build_tree();
+    auto agg_bool = db_bool.aggregate(15, 60);
+    assert(agg_bool.sum == 10);
+    assert(agg_bool.count == 4);
+    assert(!agg_bool.min_value && agg_bool.max_value);
+}
+
+void fst_test_search_weight()
+{
+    stack_printer __stack_printer__("::fst_test_search_weight");
+    typedef flat_segment_tree<int, int, aggregate_trait> fst_type;
+    typedef fst_type::aggregate_type::sum_type sum_type;
+
+    // Row heights, with hidden rows of zero height.
+    int lower = 0, upper = 60;
+    fst_type db(lower, upper, 10);
+    db.insert_back(5, 8, 25);
+    db.insert_back(8, 12, 0);
+    db.insert_back(20, 21, 3);
+    db.insert_back(30, 40, 7);
+    db.insert_back(59, 60, 0);
+
+    sum_type total = db.aggregate(lower, upper).sum;
+
+    auto check_all = [&]()
+    {
+        // Every key with a non-zero value should be found at each weight
+        // within its range.
+        int key;
+        sum_type start_weight;
+        for (sum_type w = 0; w < total; ++w)
+        {
+            auto ret = db.search_weight(w, key, &start_weight);
+            assert(ret.second);
+            assert(start_weight == db.aggregate(lower, key).sum);
+            assert(start_weight <= w && w < db.aggregate(lower, key + 1).sum);
+
+            int val, seg_start;
+            db.search(key, val, &seg_start);
+            assert(val > 0);
+            assert(ret.first->first == seg_start);
+        }
+
+        assert(!db.search_weight(total, key).second);
+        assert(!db.search_weight(total + 100, key).second);
+        assert(!db.search_weight(-1, key).second);
+    };
+
+    // Leaf walk.
+    check_all();
+
+    // Tree.
+    db.build_tree();
+    check_all();
+
+    int key;
+    sum_type start_weight;
+    assert(db.search_weight(50, key, &start_weight).second);
+    assert(key == 5 && start_weight == 50);
+    assert(db.search_weight(125, key, &start_weight).second);
+    assert(key == 12 && start_weight == 125);
+}
+
+void fst_test_aggregate_sum_type()
+{
+    stack_printer __stack_printer__("::fst_test_aggregate_sum_type");
+
+    // The sum should keep the sign of the values with an unsigned key type.
+    {
+        typedef flat_segment_tree<unsigned int, int, aggregate_trait> fst_type;
+        static_assert(std::is_same<fst_type::aggregate_type::sum_type, int64_t>::value, "wrong sum type");
+
+        fst_type db(0, 100, 0);
+        db.insert_back(0, 10, -5);
+        db.insert_back(10, 20, 3);
+        assert(db.aggregate(0, 10).sum == -50);
+        assert(db.aggregate(0, 100).sum == -20);
+        db.build_tree();
+        assert(db.aggregate(0, 10).sum == -50);
+        assert(db.aggregate(0, 100).sum == -20);
+        assert(db.aggregate(5, 15).min_value == -5);
+    }
+
+    // The sum should not overflow where the product of the key and value
+    // types would.
+    {
+        typedef flat_segment_tree<int, int, aggregate_trait> fst_type;
+        static_assert(std::is_same<fst_type::aggregate_type::sum_type, int64_t>::value, "wrong sum type");
+
+        fst_type db(0, 4000000, 0);
+        db.insert_back(0, 2000000, 2000);
+        db.insert_back(2000000, 4000000, 1500);
+        int64_t expected = int64_t(2000000) * 2000 + int64_t(2000000) * 1500;
+        assert(db.aggregate(0, 4000000).sum == expected);
+        db.build_tree();
+        assert(db.aggregate(0, 4000000).sum == expected);
+
+        int key;
+        int64_t start_weight;
+        assert(db.search_weight(int64_t(2000000) * 2000 + 1500 * 10, key, &start_weight).second);
+        assert(key == 2000010 && start_weight == int64_t(2000000) * 2000 + 1500 * 10);
+    }
+
+    // Unsigned keys and values sum into an unsigned type, and floating
+    // point ones into a floating point type.
+    static_assert(std::is_same<flat_segment_tree<uint32_t, uint16_t>::aggregate_type::sum_type, uint64_t>::value, "wrong sum type");
+    static_assert(std::is_same<flat_segment_tree<int, float>::aggregate_type::sum_type, double>::value, "wrong sum type");
+    static_assert(std::is_same<flat_segment_tree<int, long double>::aggregate_type::sum_type, long double>::value, "wrong sum type");
+
+    // Trees that don't store the aggregates should give the same results
+    // by walking the leaf nodes, with smaller non-leaf nodes.
+    {
+        typedef flat_segment_tree<int, int> fst_type;
+        typedef flat_segment_tree<int, int, aggregate_trait> agg_fst_type;
+        static_assert(sizeof(fst_type::nonleaf_value_type) < sizeof(agg_fst_type::nonleaf_value_type), "aggregates stored");
+        static_assert(sizeof(fst_type::nonleaf_value_type) == sizeof(int) * 2, "extra data stored");
+
+        fst_type db(0, 100, 1);
+        agg_fst_type db2(0, 100, 1);
+        for (int i = 0; i < 10; ++i)
+        {
+            db.insert_back(i * 10, i * 10 + 5, i);
+            db2.insert_back(i * 10, i * 10 + 5, i);
+        }
+
+        db.build_tree();
+        db2.build_tree();
+        for (int start = 0; start < 100; start += 7)
+        {
+            auto agg1 = db.aggregate(start, start + 33);
+            auto agg2 = db2.aggregate(start, start + 33);
+            assert(agg1.sum == agg2.sum && agg1.count == agg2.count);
+            assert(agg1.min_value == agg2.min_value && agg1.max_value == agg2.max_value);
+        }
+
+        // Shifts invalidate the tree without key offsets.
+        db.shift_right(50, 2, false);
+        assert(!db.is_tree_valid());
+    }
+}
+
 void test_single_tree_search(const flat_segment_tree<int, int>& db, int key, int val, int start, int end)
 {
     int r_val, r_start, r_end;
@@ -297,9 +928,9 @@ void build_and_dump(flat_segment_tree<key_type, value_type>&db)
     db.dump_leaf_nodes();
 }
 
-template<typename key_type, typename value_type>
+template<typename key_type, typename value_type, typename trait_type>
 bool check_leaf_nodes(
-    const flat_segment_tree<key_type, value_type>& db,
+    const flat_segment_tree<key_type, value_type, trait_type>& db,
     const key_type* keys, const value_type* values, size_t key_size)
 {
     if (key_size <= 1)
@@ -436,6 +1067,448 @@ bool is_iterator_valid(
     return true;
 }
 
+void fst_test_lazy_shift()
+{
+    stack_printer __stack_printer__("::fst_test_lazy_shift");
+    typedef flat_segment_tree<long, int, lazy_shift_trait> fst_type;
+    typedef fst_type::aggregate_type::sum_type sum_type;
+    long lower = 0, upper = 1000;
+
+    fst_type db(lower, upper, 0);
+    db.insert_back(100, 150, 3);
+    db.insert_back(200, 210, 1);
+    db.insert_back(300, 400, 2);
+    db.insert_back(500, 520, 4);
+    db.build_tree_array();
+
+    // Hold an iterator at the segment that starts at 200.
+    fst_type::const_iterator it = db.begin();
+    ++it; ++it; ++it;
+    assert(it->first == 200);
+
+    // Shifts that don't remove any nodes keep the tree valid.
+    db.shift_right(120, 30, false);
+    assert(db.is_tree_valid());
+    db.shift_left(250, 260);
+    assert(db.is_tree_valid());
+
+    int val;
+    long start, end;
+    assert(db.search_tree(235, val, &start, &end).second);
+    assert(val == 1 && start == 230 && end == 240);
+    assert(db.search_tree_array(335, val, &start, &end).second);
+    assert(val == 2 && start == 320 && end == 420);
+    assert(db.aggregate(lower, upper).sum == 80*3 + 10*1 + 100*2 + 20*4);
+
+    // Read-only access sees the shifted key values while the shift is still
+    // pending.
+    assert(it->first == 230);
+    assert(db.search(235, val, &start, &end).second);
+    assert(val == 1 && start == 230 && end == 240);
+    {
+        auto seg_it = db.begin_segment();
+        ++seg_it; ++seg_it; ++seg_it;
+        assert(seg_it->start == 230 && seg_it->end == 240 && seg_it->value == 1);
+    }
+    {
+        long k[] = {0, 100, 180, 230, 240, 320, 420, 520, 540, 1000};
+        int v[] = {0, 3, 0, 1, 0, 2, 0, 4, 0};
+        assert(check_leaf_nodes(db, k, v, ARRAY_SIZE(k)));
+    }
+
+    // Rebuilding the tree applies the pending shift to the array as well.
+    db.build_tree();
+    assert(db.has_search_array());
+    assert(db.search_tree_array(335, val, &start, &end).second);
+    assert(val == 2 && start == 320 && end == 420);
+
+    // Pushing the last segment out of the range takes the regular path.
+    db.shift_right(530, 500, false);
+    assert(!db.is_tree_valid());
+
+    // Random shifts against a reference that never builds its tree.
+    db.clear();
+    unsigned int seed = 11;
+    auto next_rand = [&seed](int range)
+    {
+        seed = seed * 1103515245u + 12345u;
+        return static_cast<long>((seed >> 8) % static_cast<unsigned int>(range));
+    };
+
+    for (int i = 0; i < 60; ++i)
+    {
+        long start_key = next_rand(upper);
+        db.insert_back(start_key, start_key + next_rand(20) + 1, next_rand(4));
+    }
+    db.build_tree_array();
+    fst_type ref(db);
+
+    auto check_all = [&]()
+    {
+        for (long key = lower; key < upper; key += 7)
+        {
+            int val1 = 0, val2 = 0;
+            long start1 = 0, start2 = 0, end1 = 0, end2 = 0;
+            auto ret1 = db.search_tree(key, val1, &start1, &end1);
+            auto ret2 = ref.search(key, val2, &start2, &end2);
+            assert(ret1.second && ret2.second);
+            assert(val1 == val2 && start1 == start2 && end1 == end2);
+
+            ret1 = db.search(key, val1, &start1, &end1);
+            assert(ret1.second);
+            assert(val1 == val2 && start1 == start2 && end1 == end2);
+
+            ret1 = db.search_tree_array(key, val1, &start1, &end1);
+            assert(ret1.second);
+            assert(val1 == val2 && start1 == start2 && end1 == end2);
+
+            long end_key = key + next_rand(300);
+            auto agg1 = db.aggregate(key, end_key);
+            auto agg2 = ref.aggregate(key, end_key);
+            assert(agg1.sum == agg2.sum && agg1.count == agg2.count);
+            assert(agg1.min_value == agg2.min_value && agg1.max_value == agg2.max_value);
+        }
+
+        sum_type total = ref.aggregate(lower, upper).sum;
+        for (sum_type w = 0; w < total; w += 13)
+        {
+            long key1, key2;
+            sum_type start_weight1, start_weight2;
+            assert(db.search_weight(w, key1, &start_weight1).second);
+            assert(ref.search_weight(w, key2, &start_weight2).second);
+            assert(key1 == key2 && start_weight1 == start_weight2);
+        }
+    };
+
+    size_t lazy_count = 0;
+    for (int i = 0; i < 300; ++i)
+    {
+        long pos = next_rand(upper);
+        long size = next_rand(i % 3 ? 5 : 50) + 1;
+        switch (next_rand(3))
+        {
+            case 0:
+                db.shift_left(pos, pos + size);
+                ref.shift_left(pos, pos + size);
+                break;
+            case 1:
+                db.shift_right(pos, size, false);
+                ref.shift_right(pos, size, false);
+                break;
+            default:
+                db.shift_right(pos, size, true);
+                ref.shift_right(pos, size, true);
+        }
+
+        if (db.is_tree_valid())
+            ++lazy_count;
+        else
+            db.build_tree_array();
+
+        check_all();
+
+        if (i % 50 == 0)
+        {
+            assert(db == ref);
+
+            // Copy and walk the segments while the shift may be pending.
+            const fst_type& cdb = db;
+            fst_type copied(cdb);
+            assert(copied == ref);
+
+            auto it1 = cdb.begin_segment(), it2 = ref.begin_segment();
+            for (; it2 != ref.end_segment(); ++it1, ++it2)
+            {
+                assert(it1 != cdb.end_segment());
+                assert(it1->start == it2->start && it1->end == it2->end && it1->value == it2->value);
+            }
+            assert(it1 == cdb.end_segment());
+        }
+    }
+
+    assert(lazy_count > 0);
+    assert(db == ref);
+}
+
+void fst_test_merge()
+{
+    stack_printer __stack_printer__("::fst_test_merge");
+    typedef flat_segment_tree<int, int> fst_type;
+    int lower = 0, upper = 100;
+
+    fst_type db1(lower, upper, 0);
+    db1.insert_back(10, 30, 1);
+    db1.insert_back(50, 60, 2);
+
+    fst_type db2(lower, upper, 0);
+    db2.insert_back(20, 40, 5);
+    db2.insert_back(55, 100, 2);
+
+    // Overlay the second onto the first.
+    fst_type db = fst_type::merge(db1, db2, [](int v1, int v2) { return v2 ? v2 : v1; });
+    assert(!db.is_tree_valid());
+    {
+        int k[] = {0, 10, 20, 40, 50, 100};
+        int v[] = {0, 1, 5, 0, 2};
+        assert(check_leaf_nodes(db, k, v, ARRAY_SIZE(k)));
+    }
+
+    db = fst_type::merge(db1, db2, [](int v1, int v2) { return std::min(v1, v2); });
+    {
+        int k[] = {0, 20, 30, 55, 60, 100};
+        int v[] = {0, 1, 0, 2, 0};
+        assert(check_leaf_nodes(db, k, v, ARRAY_SIZE(k)));
+    }
+
+    // The default value is also combined.
+    db = fst_type::merge(db1, db2, [](int v1, int v2) { return v1 + v2 + 1; });
+    assert(db.default_value() == 1);
+    {
+        int k[] = {0, 10, 20, 30, 40, 50, 55, 60, 100};
+        int v[] = {1, 2, 7, 6, 1, 3, 5, 3};
+        assert(check_leaf_nodes(db, k, v, ARRAY_SIZE(k)));
+    }
+
+    // Random segments against overlaying via insertion.
+    unsigned int seed = 3;
+    auto next_rand = [&seed](int range)
+    {
+        seed = seed * 1103515245u + 12345u;
+        return static_cast<int>((seed >> 8) % static_cast<unsigned int>(range));
+    };
+
+    fst_type db3(lower, upper, 0), db4(lower, upper, 0);
+    for (int i = 0; i < 50; ++i)
+    {
+        int start = next_rand(upper);
+        db3.insert_back(start, start + next_rand(10) + 1, next_rand(3));
+        start = next_rand(upper);
+        db4.insert_back(start, start + next_rand(10) + 1, next_rand(3));
+    }
+
+    fst_type expected(db3);
+    for (auto it = db4.begin_segment(); it != db4.end_segment(); ++it)
+    {
+        if (it->value)
+            expected.insert_back(it->start, it->end, it->value);
+    }
+
+    db = fst_type::merge(db3, db4, [](int v1, int v2) { return v2 ? v2 : v1; });
+    assert(db == expected);
+
+    // The key ranges must match.
+    fst_type db5(lower, upper + 1, 0);
+    try
+    {
+        fst_type::merge(db1, db5, [](int v1, int v2) { return v1 + v2; });
+        assert(!"exception was expected");
+    }
+    catch (const mdds::invalid_arg_error&)
+    {
+        // expected.
+    }
+}
+
+void fst_test_freeze()
+{
+    stack_printer __stack_printer__("::fst_test_freeze");
+    typedef flat_segment_tree<int, int> fst_type;
+    typedef fst_type::frozen_type frozen_type;
+    int lower = -10, upper = 100;
+
+    {
+        // Empty snapshot.
+        frozen_type frozen;
+        assert(frozen.empty());
+        assert(frozen.size() == 0);
+        int val;
+        assert(!frozen.search(0, val));
+    }
+
+    fst_type db(lower, upper, 0);
+    for (int n = 0; n < 20; ++n)
+    {
+        frozen_type frozen = db.freeze();
+        assert(frozen.size() == db.leaf_size() - 1);
+        assert(frozen.min_key() == lower);
+        assert(frozen.max_key() == upper);
+        assert(frozen.default_value() == 0);
+
+        // Same segments as the source.
+        size_t pos = 0;
+        for (auto it = db.begin_segment(); it != db.end_segment(); ++it, ++pos)
+        {
+            frozen_type::segment_type seg = frozen.get_segment(pos);
+            assert(seg.start == it->start && seg.end == it->end && seg.value == it->value);
+        }
+        assert(pos == frozen.size());
+
+        for (int key = lower - 5; key < upper + 5; ++key)
+        {
+            int val1 = -1, val2 = -1, start1 = 0, start2 = 0, end1 = 0, end2 = 0;
+            bool ret1 = db.search(key, val1, &start1, &end1).second;
+            bool ret2 = frozen.search(key, val2, &start2, &end2);
+            assert(ret1 == ret2);
+            if (ret1)
+                assert(val1 == val2 && start1 == start2 && end1 == end2);
+        }
+
+        db.insert_back(n * 5, n * 5 + 3, n % 4 + 1);
+    }
+
+    // The snapshot doesn't change with the source.
+    frozen_type frozen = db.freeze();
+    size_t size = frozen.size();
+    db.clear();
+    assert(frozen.size() == size);
+    int val, start, end;
+    assert(frozen.search(95, val, &start, &end));
+    assert(val == 4 && start == 95 && end == 98);
+
+    // Copies are independent.
+    frozen_type frozen2 = frozen;
+    frozen = db.freeze();
+    assert(frozen.size() == 1);
+    assert(frozen2.size() == size);
+}
+
+void fst_test_save_load_state()
+{
+    stack_printer __stack_printer__("::fst_test_save_load_state");
+    typedef flat_segment_tree<long, double> fst_type;
+
+    fst_type db(-20, 1000, 1.5);
+    db.insert_back(0, 10, 2.0);
+    db.insert_back(10, 35, -3.25);
+    db.insert_back(500, 999, 7.0);
+
+    std::ostringstream os;
+    db.save_state(os);
+    std::string state = os.str();
+
+    // Restore into an instance with a different key range.
+    fst_type db2(0, 10, 0.0);
+    db2.set_node_pool(true);
+    db2.set_incremental_search(true);
+    {
+        std::istringstream is(state);
+        db2.load_state(is);
+    }
+    assert(db2 == db);
+    assert(db2.min_key() == -20 && db2.max_key() == 1000);
+    assert(db2.default_value() == 1.5);
+    assert(db2.has_node_pool() && db2.is_incremental_search());
+    assert(!db2.is_tree_valid());
+    double val;
+    long start, end;
+    assert(db2.search_tree(20, val, &start, &end).second);
+    assert(val == -3.25 && start == 10 && end == 35);
+
+    // Query the state in place.  The buffer must be aligned to 8 bytes.
+    std::vector<uint64_t> buffer(state.size() / 8 + 1);
+    std::memcpy(buffer.data(), state.data(), state.size());
+    const char* p = reinterpret_cast<const char*>(buffer.data());
+    fst_type::view_type view(p, state.size());
+    assert(view.size() == 6);
+    assert(view.min_key() == -20 && view.max_key() == 1000);
+    assert(view.default_value() == 1.5);
+    assert(view.get_segment(2).start == 10 && view.get_segment(2).end == 35);
+    assert(view.get_segment(2).value == -3.25);
+    for (long key = -25; key < 1005; ++key)
+    {
+        double val1 = 0.0, val2 = 0.0;
+        long start1 = 0, start2 = 0, end1 = 0, end2 = 0;
+        bool ret1 = db2.search(key, val1, &start1, &end1).second;
+        bool ret2 = view.search(key, val2, &start2, &end2);
+        assert(ret1 == ret2);
+        if (ret1)
+            assert(val1 == val2 && start1 == start2 && end1 == end2);
+    }
+
+    // The restored instance behaves the same as the original.
+    db.shift_left(5, 15);
+    db2.shift_left(5, 15);
+    assert(db2 == db);
+
+    // Invalid states.
+    auto check_load_error = [](const std::string& s)
+    {
+        fst_type db3(0, 10, 0.0);
+        db3.insert_back(2, 4, 1.0);
+        fst_type db3_copy(db3);
+        try
+        {
+            std::istringstream is(s);
+            db3.load_state(is);
+            assert(!"exception was expected");
+        }
+        catch (const mdds::invalid_arg_error&)
+        {
+            // The content stays intact.
+            assert(db3 == db3_copy);
+        }
+    };
+
+    check_load_error(std::string());
+    check_load_error(state.substr(0, state.size() - 1));
+    check_load_error(state.substr(0, 20));
+
+    // Corrupt segment counts, including ones whose section sizes overflow.
+    for (uint64_t n : { uint64_t(1) << 61, uint64_t(1) << 40, uint64_t(7), ~uint64_t(0) })
+    {
+        std::string s = state;
+        std::memcpy(&s[8], &n, sizeof(n));
+        check_load_error(s);
+
+        try
+        {
+            std::memcpy(buffer.data(), s.data(), s.size());
+            fst_type::view_type view3(p, s.size());
+            assert(!"exception was expected");
+        }
+        catch (const mdds::invalid_arg_error&)
+        {
+            // expected.
+        }
+    }
+
+    {
+        // Different value type.
+        flat_segment_tree<long, int> db4(0, 10, 0);
+        std::ostringstream os4;
+        db4.save_state(os4);
+        check_load_error(os4.str());
+
+        try
+        {
+            std::string s4 = os4.str();
+            std::memcpy(buffer.data(), s4.data(), s4.size());
+            fst_type::view_type view4(p, s4.size());
+            assert(!"exception was expected");
+        }
+        catch (const mdds::invalid_arg_error&)
+        {
+            // expected.
+        }
+    }
+
+    try
+    {
+        // Misaligned buffer.
+        std::vector<char> misaligned(state.size() + 16);
+        char* p2 = misaligned.data();
+        while (reinterpret_cast<uintptr_t>(p2) % 8 != 1)
+            ++p2;
+        std::memcpy(p2, state.data(), state.size());
+        fst_type::view_type view5(p2, state.size());
+        assert(!"exception was expected");
+    }
+    catch (const mdds::invalid_arg_error&)
+    {
+        // expected.
+    }
+}
+
 void fst_test_insert_search_mix()
 {
     stack_printer __stack_printer__("fst_test_insert_search_mix");
@@ -1165,37 +2238,6 @@ void fst_test_insert_front_back(key_type start_key, key_type end_key, value_type
     }
 }
 
-void fst_perf_test_insert_front_back()
-{
-    typedef unsigned long key_type;
-    typedef int           value_type;
-    typedef flat_segment_tree<key_type, value_type> container_type;
-    key_type upper_bound = 20000;
-    {
-        stack_printer __stack_printer__("::fst_perf_test_insert (front insertion)");
-        container_type db(0, upper_bound, 0);
-        value_type val = 0;
-        for (key_type i = 0; i < upper_bound; ++i)
-        {
-            db.insert_front(i, i+1, val);
-            if (++val > 10)
-                val = 0;
-        }
-    }
-
-    {
-        stack_printer __stack_printer__("::fst_perf_test_insert (back insertion)");
-        container_type db(0, upper_bound, 0);
-        value_type val = 0;
-        for (key_type i = 0; i < upper_bound; ++i)
-        {
-            db.insert_back(i, i+1, val);
-            if (++val > 10)
-                val = 0;
-        }
-    }
-}
-
 void fst_test_copy_ctor()
 {
     stack_printer __stack_printer__("::fst_test_copy_ctor");
@@ -1566,101 +2608,6 @@ void fst_test_insert_state_changed()
     assert(!r.second);
 }
 
-void fst_perf_test_insert_position()
-{
-    typedef flat_segment_tree<long, bool> db_type;
-    typedef pair<db_type::const_iterator, bool> ret_type;
-    long upper = 60000;
-    {
-        stack_printer __stack_printer__("::fst_perf_test_insert_position (front)");
-        // Much smaller upper boundary because front insertion is very slow.
-        db_type db(0, upper, false);
-        bool val = false;
-        for (long i = 0; i < upper; ++i)
-        {
-            db.insert_front(i, i+1, val);
-            val = !val;
-        }
-    }
-
-    {
-        stack_printer __stack_printer__("::fst_perf_test_insert_position (back)");
-        db_type db(0, upper, false);
-        bool val = false;
-        for (long i = 0; i < upper; ++i)
-        {
-            db.insert_back(i, i+1, val);
-            val = !val;
-        }
-    }
-
-    {
-        db_type db(0, upper, false);
-        {
-            stack_printer __stack_printer__("::fst_perf_test_insert_position (position)");
-            db_type::const_iterator itr = db.begin();
-            bool val = false;
-            for (long i = 0; i < upper; ++i)
-            {
-                ret_type ret = db.insert(itr, i, i+1, val);
-                val = !val;
-                itr = ret.first;
-            }
-        }
-        {
-            stack_printer __stack_printer__("::fst_perf_test_insert_position (position re-insert)");
-            db_type::const_iterator itr = db.begin();
-            bool val = true;
-            for (long i = 0; i < upper; ++i)
-            {
-                ret_type ret = db.insert(itr, i, i+1, val);
-                val = !val;
-                itr = ret.first;
-            }
-        }
-    }
-}
-
-void fst_perf_test_position_search()
-{
-    typedef flat_segment_tree<long, bool> db_type;
-    typedef pair<db_type::const_iterator, bool> ret_type;
-    long upper = 60000;
-    db_type db(0, upper, false);
-
-    // Fill the leaf nodes first.
-    db_type::const_iterator itr = db.begin();
-    bool val = false;
-    for (long i = 0; i < upper; ++i)
-    {
-        ret_type ret = db.insert(itr, i, i+1, val);
-        val = !val;
-        itr = ret.first;
-    }
-
-    {
-        stack_printer __stack_printer__("::fst_perf_test_position_search (normal)");
-        for (long i = 0; i < upper; ++i)
-        {
-            bool val2;
-            ret_type ret = db.search(i, val2);
-            assert(ret.second);
-        }
-    }
-
-    {
-        stack_printer __stack_printer__("::fst_perf_test_position_search (positioned)");
-        itr = db.begin();
-        for (long i = 0; i < upper; ++i)
-        {
-            bool val2;
-            ret_type ret = db.search(itr, i, val2);
-            assert(ret.second);
-            itr = ret.first;
-        }
-    }
-}
-
 template<typename K, typename V>
 bool check_pos_search_result(
     const flat_segment_tree<K, V>& db,
@@ -2136,6 +3083,19 @@ int main (int argc, char **argv)
             fst_test_leaf_search();
             fst_test_tree_build();
             fst_test_tree_search();
+            fst_test_tree_search_array();
+            fst_test_incremental_search();
+            fst_test_node_pool();
+            fst_test_node_pool_release();
+            fst_test_assign();
+            fst_test_search_many();
+            fst_test_aggregate();
+            fst_test_search_weight();
+            fst_test_aggregate_sum_type();
+            fst_test_lazy_shift();
+            fst_test_merge();
+            fst_test_freeze();
+            fst_test_save_load_state();
             fst_test_insert_search_mix();
             fst_test_shift_left();
             fst_test_shift_left_right_edge();
@@ -2159,15 +3119,6 @@ int main (int argc, char **argv)
             fst_test_insert_out_of_bound_2();
             fst_test_segment_iterator();
         }
-
-        if (opt.test_perf)
-        {
-            fst_perf_test_search_leaf();
-            fst_perf_test_search_tree();
-            fst_perf_test_insert_front_back();
-            fst_perf_test_insert_position();
-            fst_perf_test_position_search();
-        }
     }
     catch (const std::exception& e)
     {
@@ -31,17 +31,24 @@
 #include <mdds/multi_type_vector.hpp>
 #include <mdds/multi_type_vector_trait.hpp>
 #include <mdds/multi_type_vector/collection.hpp>
+#include <mdds/multi_type_vector/batch_editor.hpp>
+#include <mdds/multi_type_vector/row_aggregate_cache.hpp>
 
 #include <iostream>
 #include <vector>
 #include <deque>
 #include <memory>
+#include <sstream>
+#include <numeric>
+#include <limits>
+#include <stdexcept>
 
 using namespace std;
 using namespace mdds;
 
 typedef multi_type_vector<mtv::element_block_func> mtv_type;
 typedef mtv::collection<mtv_type> cols_type;
+typedef mtv::batch_editor<mtv_type> batch_editor_type;
 
 void mtv_test_empty()
 {
@@ -401,6 +408,563 @@ void mtv_test_boolean_block()
     assert(++it == collection.end());
 }
 
+void mtv_test_batch_insert_erase()
+{
+    stack_printer __stack_printer__("::mtv_test_batch_insert_erase");
+
+    vector<mtv_type> vectors(3, mtv_type(5));
+    vectors[0].set(0, 1.1);
+    vectors[0].set(1, 1.2);
+    vectors[1].set(2, string("A"));
+    vectors[2].set(4, true);
+
+    batch_editor_type editor(vectors.begin(), vectors.end());
+    assert(editor.size() == 5);
+    assert(editor.vector_count() == 3);
+
+    // Insert 2 empty rows at row 1.
+    editor.insert_empty(1, 2);
+    assert(editor.size() == 7);
+    for (const mtv_type& v : vectors)
+        assert(v.size() == 7);
+
+    assert(vectors[0].get<double>(0) == 1.1);
+    assert(vectors[0].is_empty(1));
+    assert(vectors[0].is_empty(2));
+    assert(vectors[0].get<double>(3) == 1.2);
+    assert(vectors[1].get<string>(4) == "A");
+    assert(vectors[2].get<bool>(6) == true);
+
+    // Insert again past the previous insertion position, which should make
+    // use of the position hints.
+    editor.insert_empty(5, 1);
+    assert(editor.size() == 8);
+    assert(vectors[1].get<string>(4) == "A");
+    assert(vectors[1].is_empty(5));
+    assert(vectors[2].is_empty(6));
+    assert(vectors[2].get<bool>(7) == true);
+
+    // Insert at a position before the previous insertion position.
+    editor.insert_empty(0, 1);
+    assert(editor.size() == 9);
+    assert(vectors[0].is_empty(0));
+    assert(vectors[0].get<double>(1) == 1.1);
+    assert(vectors[2].get<bool>(8) == true);
+
+    // Remove rows 1 through 3.
+    editor.erase(1, 3);
+    assert(editor.size() == 6);
+    for (const mtv_type& v : vectors)
+        assert(v.size() == 6);
+
+    assert(vectors[0].is_empty(0));
+    assert(vectors[0].get<double>(1) == 1.2);
+    assert(vectors[1].get<string>(2) == "A");
+    assert(vectors[2].get<bool>(5) == true);
+
+    // Edits following an erase should still work.
+    editor.insert_empty(5, 2);
+    assert(editor.size() == 8);
+    assert(vectors[2].is_empty(5));
+    assert(vectors[2].is_empty(6));
+    assert(vectors[2].get<bool>(7) == true);
+
+    // Zero-length insertion should be a no-op.
+    editor.insert_empty(0, 0);
+    assert(editor.size() == 8);
+
+    // Out-of-range edits should not modify any of the vectors.
+    try
+    {
+        editor.insert_empty(8, 1);
+        assert(!"exception should have been thrown.");
+    }
+    catch (const std::out_of_range&)
+    {
+        // good.
+    }
+
+    try
+    {
+        editor.erase(2, 8);
+        assert(!"exception should have been thrown.");
+    }
+    catch (const std::out_of_range&)
+    {
+        // good.
+    }
+
+    try
+    {
+        editor.erase(3, 2);
+        assert(!"exception should have been thrown.");
+    }
+    catch (const std::out_of_range&)
+    {
+        // good.
+    }
+
+    for (const mtv_type& v : vectors)
+        assert(v.size() == 8);
+
+    // Modifying a vector externally requires the hints to be reset.
+    vectors[1].set(0, 3.3);
+    editor.reset_position_hints();
+    editor.insert_empty(1, 1);
+    assert(vectors[1].get<double>(0) == 3.3);
+    assert(vectors[1].is_empty(1));
+    assert(vectors[1].size() == 9);
+
+    // Erase the tail, then insert right before the new end.
+    editor.erase(7, 8);
+    assert(editor.size() == 7);
+    editor.insert_empty(6, 1);
+    assert(editor.size() == 8);
+    for (const mtv_type& v : vectors)
+    {
+        assert(v.size() == 8);
+        assert(v.is_empty(6));
+    }
+    assert(vectors[2].is_empty(7));
+}
+
+/**
+ * Event handler that throws when a new element block is acquired, if told
+ * to do so.
+ */
+struct throwing_event_handler
+{
+    bool throw_on_acquire = false;
+
+    void element_block_acquired(const mtv::base_element_block*)
+    {
+        if (throw_on_acquire)
+            throw std::runtime_error("element block acquired");
+    }
+
+    void element_block_released(const mtv::base_element_block*) {}
+};
+
+void mtv_test_batch_exception()
+{
+    stack_printer __stack_printer__("::mtv_test_batch_exception");
+
+    typedef multi_type_vector<mtv::element_block_func, throwing_event_handler> mtv_ev_type;
+
+    vector<mtv_ev_type> vectors(4, mtv_ev_type(10, 1.5));
+    vectors[2].event_handler().throw_on_acquire = true;
+
+    // Inserting in the middle of a block splits it into two, which acquires
+    // a new block.  The exception from the third vector gets rethrown after
+    // all vectors have been edited.
+    mtv::batch_editor<mtv_ev_type> editor(vectors.begin(), vectors.end());
+    try
+    {
+        editor.insert_empty(5, 2);
+        assert(!"exception should have been thrown.");
+    }
+    catch (const std::runtime_error&)
+    {
+        // good.
+    }
+
+    assert(editor.size() == 10);
+    for (size_t i : { 0, 1, 3 })
+    {
+        assert(vectors[i].size() == 12);
+        assert(vectors[i].is_empty(5));
+        assert(vectors[i].get<double>(7) == 1.5);
+    }
+}
+
+void mtv_test_batch_pointer_types()
+{
+    stack_printer __stack_printer__("::mtv_test_batch_pointer_types");
+
+    {
+        vector<unique_ptr<mtv_type>> vectors;
+        for (size_t i = 0; i < 4; ++i)
+            vectors.push_back(std::make_unique<mtv_type>(10, int32_t(i)));
+
+        batch_editor_type editor(vectors.begin(), vectors.end());
+        editor.insert_empty(5, 3);
+        editor.erase(0, 1);
+
+        for (size_t i = 0; i < vectors.size(); ++i)
+        {
+            const mtv_type& v = *vectors[i];
+            assert(v.size() == 11);
+            assert(v.block_size() == 3);
+            assert(v.get<int32_t>(0) == int32_t(i));
+            assert(v.is_empty(3));
+            assert(v.is_empty(5));
+            assert(v.get<int32_t>(6) == int32_t(i));
+        }
+    }
+
+    {
+        vector<shared_ptr<mtv_type>> vectors;
+        vectors.push_back(make_shared<mtv_type>(3, 2.3));
+        vectors.push_back(make_shared<mtv_type>(3, std::string("test")));
+
+        batch_editor_type editor(vectors.begin(), vectors.end());
+        editor.erase(0, 2);
+        assert(editor.size() == 0);
+        assert(vectors[0]->empty());
+        assert(vectors[1]->empty());
+    }
+
+    {
+        vector<mtv_type*> vectors;
+        vectors.push_back(new mtv_type(2));
+        vectors.push_back(new mtv_type(3));
+
+        try
+        {
+            batch_editor_type editor(vectors.begin(), vectors.end());
+            assert(!"exception should have been thrown due to size mismatch.");
+        }
+        catch (const invalid_arg_error&)
+        {
+            // good.
+        }
+
+        for_each(vectors.begin(), vectors.end(), [](const mtv_type* p) { delete p; });
+    }
+}
+
+void mtv_test_walk_row_segments()
+{
+    stack_printer __stack_printer__("::mtv_test_walk_row_segments");
+
+    vector<mtv_type> vectors(3, mtv_type(10));
+    vectors[0].set(0, 1.1);
+    vectors[0].set(1, 1.2);
+    vectors[0].set(2, 1.3);
+    vectors[1].set(2, string("A"));
+    vectors[1].set(3, string("B"));
+    vectors[1].set(4, string("C"));
+    vectors[1].set(5, string("D"));
+    vectors[2].set(7, true);
+    vectors[2].set(8, false);
+
+    cols_type collection(vectors.begin(), vectors.end());
+
+    struct seg_info
+    {
+        size_t position;
+        size_t size;
+        vector<mtv::element_t> types;
+    };
+
+    vector<seg_info> segs;
+    collection.walk_row_segments(
+        [&segs](const cols_type::row_segment_type& seg)
+        {
+            seg_info si;
+            si.position = seg.position();
+            si.size = seg.size();
+            for (size_t i = 0; i < seg.vector_count(); ++i)
+                si.types.push_back(seg[i].type);
+            segs.push_back(si);
+        }
+    );
+
+    // Segment boundaries are at 2, 3, 6, 7, 9.
+    assert(segs.size() == 6);
+    assert(segs[0].position == 0 && segs[0].size == 2);
+    assert(segs[1].position == 2 && segs[1].size == 1);
+    assert(segs[2].position == 3 && segs[2].size == 3);
+    assert(segs[3].position == 6 && segs[3].size == 1);
+    assert(segs[4].position == 7 && segs[4].size == 2);
+    assert(segs[5].position == 9 && segs[5].size == 1);
+
+    assert(segs[0].types[0] == mtv::element_type_double);
+    assert(segs[0].types[1] == mtv::element_type_empty);
+    assert(segs[1].types[0] == mtv::element_type_double);
+    assert(segs[1].types[1] == mtv::element_type_string);
+    assert(segs[2].types[0] == mtv::element_type_empty);
+    assert(segs[2].types[1] == mtv::element_type_string);
+    assert(segs[4].types[2] == mtv::element_type_boolean);
+    assert(segs[5].types[2] == mtv::element_type_empty);
+
+    // Make sure the segment values match the values retrieved via the side
+    // iterator, with a sub-range of the collection.
+    collection.set_collection_range(1, 2);
+    collection.set_element_range(3, 6);
+
+    vector<string> expected, actual;
+    for (const auto& node : collection)
+    {
+        std::ostringstream os;
+        os << node.index << ":" << node.position << ":";
+        if (node.type == mtv::element_type_string)
+            os << node.get<mtv::string_element_block>();
+        else if (node.type == mtv::element_type_boolean)
+            os << node.get<mtv::boolean_element_block>();
+        expected.push_back(os.str());
+    }
+
+    collection.walk_row_segments(
+        [&actual](const cols_type::row_segment_type& seg)
+        {
+            assert(seg.index_offset() == 1);
+            assert(seg.vector_count() == 2);
+
+            for (size_t row = 0; row < seg.size(); ++row)
+            {
+                for (size_t i = 0; i < seg.vector_count(); ++i)
+                {
+                    std::ostringstream os;
+                    os << (seg.index_offset() + i) << ":" << (seg.position() + row) << ":";
+                    if (seg[i].type == mtv::element_type_string)
+                        os << seg[i].get<mtv::string_element_block>(row);
+                    else if (seg[i].type == mtv::element_type_boolean)
+                        os << seg[i].get<mtv::boolean_element_block>(row);
+                    actual.push_back(os.str());
+                }
+            }
+        }
+    );
+
+    assert(expected.size() == 12);
+    assert(expected == actual);
+}
+
+void mtv_test_walk_row_segments_partitioned()
+{
+    stack_printer __stack_printer__("::mtv_test_walk_row_segments_partitioned");
+
+    vector<unique_ptr<mtv_type>> vectors;
+    for (size_t i = 0; i < 4; ++i)
+    {
+        vectors.push_back(std::make_unique<mtv_type>(100));
+        for (size_t row = i; row < 100; row += 7)
+            vectors.back()->set(row, double(row));
+    }
+
+    cols_type collection(vectors.begin(), vectors.end());
+
+    // Sum all numeric values per partition.
+    const size_t n_parts = 5;
+    vector<double> sums(n_parts, 0.0);
+    vector<size_t> rows(n_parts, 0);
+    vector<size_t> last_pos(n_parts, 0);
+
+    auto func = [&](size_t part, const cols_type::row_segment_type& seg)
+    {
+        assert(part < n_parts);
+        assert(seg.position() >= last_pos[part]);
+        last_pos[part] = seg.position() + seg.size();
+        rows[part] += seg.size();
+
+        for (size_t i = 0; i < seg.vector_count(); ++i)
+        {
+            if (seg[i].type != mtv::element_type_double)
+                continue;
+
+            for (size_t row = 0; row < seg.size(); ++row)
+                sums[part] += seg[i].get<mtv::double_element_block>(row);
+        }
+    };
+
+    collection.walk_row_segments(func, n_parts);
+
+    double expected = 0.0;
+    for (size_t i = 0; i < 4; ++i)
+        for (size_t row = i; row < 100; row += 7)
+            expected += row;
+
+    double total = 0.0;
+    size_t total_rows = 0;
+    for (size_t i = 0; i < n_parts; ++i)
+    {
+        assert(rows[i] == 20);
+        total += sums[i];
+        total_rows += rows[i];
+    }
+
+    assert(total_rows == 100);
+    assert(total == expected);
+
+    // More partitions than the element range.
+    collection.set_element_range(10, 3);
+    std::fill(rows.begin(), rows.end(), 0);
+    std::fill(last_pos.begin(), last_pos.end(), 0);
+    collection.walk_row_segments(func, n_parts);
+    assert(rows[0] == 1);
+    assert(rows[1] == 1);
+    assert(rows[2] == 1);
+    assert(rows[3] == 0);
+    assert(rows[4] == 0);
+
+    // Temporary function object.
+    vector<size_t> seg_counts(n_parts, 0);
+    collection.walk_row_segments(
+        [&seg_counts](size_t part, const cols_type::row_segment_type&)
+        {
+            ++seg_counts[part];
+        }, n_parts
+    );
+    assert(std::accumulate(seg_counts.begin(), seg_counts.end(), size_t(0)) == 3);
+
+    // An exception thrown by the function object gets rethrown after all
+    // partitions have been walked.
+    std::fill(seg_counts.begin(), seg_counts.end(), 0);
+    try
+    {
+        collection.walk_row_segments(
+            [&seg_counts](size_t part, const cols_type::row_segment_type&)
+            {
+                ++seg_counts[part];
+                if (part == 1)
+                    throw std::runtime_error("partition 1");
+            }, n_parts
+        );
+        assert(!"exception should have been thrown.");
+    }
+    catch (const std::runtime_error&)
+    {
+        // good.
+    }
+    assert(seg_counts[0] == 1);
+    assert(seg_counts[1] == 1);
+    assert(seg_counts[2] == 1);
+
+    try
+    {
+        collection.walk_row_segments(func, 0);
+        assert(!"exception should have been thrown.");
+    }
+    catch (const invalid_arg_error&)
+    {
+        // good.
+    }
+}
+
+/**
+ * Sum all numeric values in each row, and keep track of the total number
+ * of rows processed.
+ */
+struct row_sum_func
+{
+    size_t* rows_processed;
+
+    row_sum_func(size_t* p) : rows_processed(p) {}
+
+    void operator() (const cols_type::row_segment_type& seg, vector<double>::iterator out) const
+    {
+        *rows_processed += seg.size();
+
+        for (size_t i = 0; i < seg.vector_count(); ++i)
+        {
+            if (seg[i].type != mtv::element_type_double)
+                continue;
+
+            auto it = out;
+            for (size_t row = 0; row < seg.size(); ++row, ++it)
+                *it += seg[i].get<mtv::double_element_block>(row);
+        }
+    }
+};
+
+void mtv_test_row_aggregate_cache()
+{
+    stack_printer __stack_printer__("::mtv_test_row_aggregate_cache");
+
+    typedef mtv::row_aggregate_cache<mtv_type, double, row_sum_func> cache_type;
+
+    vector<mtv_type> vectors(4, mtv_type(20));
+    for (size_t i = 0; i < vectors.size(); ++i)
+    {
+        for (size_t row = 0; row < 20; row += 2)
+            vectors[i].set(row, double(i + 1));
+    }
+
+    vectors[2].set(5, string("not a number"));
+
+    cols_type collection(vectors.begin(), vectors.end());
+
+    size_t rows_processed = 0;
+    cache_type cache(collection, row_sum_func(&rows_processed));
+    assert(cache.size() == 20);
+    assert(cache.is_dirty());
+
+    // The first query should compute all rows.
+    assert(cache.get(0) == 10.0);
+    assert(cache.get(1) == 0.0);
+    assert(cache.get(5) == 0.0);
+    assert(!cache.is_dirty());
+    assert(rows_processed == 20);
+
+    // Modify some values and only mark the modified rows dirty.
+    vectors[0].set(1, 100.0);
+    vectors[3].set(3, 200.0);
+    vectors[1].set_empty(4, 4);
+    cache.mark_dirty(1, 1);
+    cache.mark_dirty(3, 4);
+    assert(cache.is_dirty());
+
+    rows_processed = 0;
+    assert(cache.get(1) == 100.0);
+    assert(cache.get(3) == 200.0);
+    assert(cache.get(4) == 8.0);
+    assert(cache.get(6) == 10.0);
+    assert(rows_processed == 3);
+
+    // Querying again without any modifications should not recompute.
+    rows_processed = 0;
+    assert(cache.get(4) == 8.0);
+    assert(rows_processed == 0);
+
+    // Out-of-range dirty ranges are ignored, or clipped.
+    cache.mark_dirty(25, 30);
+    assert(!cache.is_dirty());
+    cache.mark_dirty(18, 30);
+    cache.update();
+    assert(rows_processed == 2);
+    assert(cache.get(18) == 10.0);
+
+    // Open-ended range up to the maximum position.
+    rows_processed = 0;
+    cache.mark_dirty(17, std::numeric_limits<size_t>::max());
+    assert(cache.is_dirty());
+    cache.update();
+    assert(rows_processed == 3);
+
+    try
+    {
+        cache.get(20);
+        assert(!"exception should have been thrown.");
+    }
+    catch (const std::out_of_range&)
+    {
+        // good.
+    }
+
+    // Cache over a sub-range of the collection.
+    collection.set_collection_range(1, 2);
+    collection.set_element_range(2, 6);
+    rows_processed = 0;
+    cache_type sub_cache(collection, row_sum_func(&rows_processed));
+    assert(sub_cache.size() == 6);
+    assert(sub_cache.get(2) == 5.0);
+    assert(sub_cache.get(4) == 3.0);
+    assert(sub_cache.get(5) == 0.0);
+    assert(sub_cache.get(6) == 5.0);
+    assert(rows_processed == 6);
+
+    vectors[0].set(3, 1000.0); // outside the collection range.
+    vectors[1].set(3, 7.0);
+    sub_cache.mark_dirty(3, 3);
+    assert(sub_cache.get(3) == 7.0);
+    assert(rows_processed == 7);
+
+    sub_cache.mark_all_dirty();
+    assert(sub_cache.get(3) == 7.0);
+    assert(rows_processed == 13);
+}
+
 int main (int argc, char **argv)
 {
     try
@@ -415,6 +979,12 @@ int main (int argc, char **argv)
         mtv_test_sub_element_ranges_invalid();
         mtv_test_sub_collection_ranges_invalid();
         mtv_test_boolean_block();
+        mtv_test_batch_insert_erase();
+        mtv_test_batch_pointer_types();
+        mtv_test_batch_exception();
+        mtv_test_walk_row_segments();
+        mtv_test_walk_row_segments_partitioned();
+        mtv_test_row_aggregate_cache();
     }
     catch (const std::exception& e)
     {
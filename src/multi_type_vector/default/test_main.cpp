@@ -4986,6 +4986,198 @@ void mtv_test_push_back()
     assert(it->type == mtv::element_type_double);
 }
 
+void mtv_test_builder()
+{
+    stack_printer __stack_printer__(__FUNCTION__);
+
+    mtv_type db(5, 1.1); // this content should get replaced.
+
+    {
+        mtv_type::builder bd;
+        assert(bd.size() == 0);
+
+        bd.push_back_empty(2);
+        bd.push_back_empty(); // should extend the last empty block.
+        bd.push_back(1.1);
+        bd.push_back(1.2);
+
+        std::vector<double> doubles = { 1.3, 1.4, 1.5 };
+        bd.push_back(doubles.begin(), doubles.end()); // should extend the last numeric block.
+
+        std::vector<string> strs = { "A", "B" };
+        bd.push_back(strs.begin(), strs.end());
+        bd.push_back(string("C"));
+        bd.push_back(strs.begin(), strs.begin()); // empty range should be ignored.
+        bd.push_back_empty(0); // zero length should be ignored.
+        bd.push_back(int32_t(12));
+        bd.push_back_empty(4);
+        assert(bd.size() == 16);
+
+        bd.finalize(db);
+        assert(bd.size() == 0);
+    }
+
+    assert(db.size() == 16);
+    assert(db.block_size() == 5);
+    assert(db.check_block_integrity());
+
+    mtv_type::const_iterator it = db.begin();
+    assert(it->type == mtv::element_type_empty);
+    assert(it->position == 0);
+    assert(it->size == 3);
+
+    ++it;
+    assert(it->type == mtv::element_type_double);
+    assert(it->position == 3);
+    assert(it->size == 5);
+    assert(mtv::double_element_block::capacity(*it->data) >= 5);
+
+    ++it;
+    assert(it->type == mtv::element_type_string);
+    assert(it->position == 8);
+    assert(it->size == 3);
+
+    ++it;
+    assert(it->type == mtv::element_type_int32);
+    assert(it->position == 11);
+    assert(it->size == 1);
+
+    ++it;
+    assert(it->type == mtv::element_type_empty);
+    assert(it->position == 12);
+    assert(it->size == 4);
+
+    assert(db.get<double>(3) == 1.1);
+    assert(db.get<double>(7) == 1.5);
+    assert(db.get<string>(8) == "A");
+    assert(db.get<string>(10) == "C");
+    assert(db.get<int32_t>(11) == 12);
+    assert(db.is_empty(15));
+
+    {
+        // Build from a single range, which should allocate the element block
+        // storage exactly once.
+        std::vector<double> vals(1000, 2.5);
+        mtv_type::builder bd;
+        bd.push_back(vals.begin(), vals.end());
+        bd.finalize(db);
+        assert(db.size() == 1000);
+        assert(db.block_size() == 1);
+        assert(mtv::double_element_block::capacity(*db.begin()->data) == 1000);
+
+        // Finalizing an empty builder should leave the destination empty.
+        bd.finalize(db);
+        assert(db.empty());
+    }
+
+    {
+        // Unfinalized builder should clean up after itself.
+        mtv_type::builder bd;
+        bd.push_back(string("orphaned"));
+        bd.push_back_empty(3);
+    }
+}
+
+void mtv_test_for_each_value()
+{
+    stack_printer __stack_printer__(__FUNCTION__);
+
+    mtv_type db(12);
+    db.set(1, 1.1);
+    db.set(2, 1.2);
+    db.set(3, string("A"));
+    db.set(4, string("B"));
+    db.set(6, int32_t(5));
+    db.set(7, true);
+    db.set(8, false);
+    db.set(9, 2.1);
+    db.set(10, 2.2);
+
+    struct visited_value
+    {
+        size_t pos;
+        std::string value;
+
+        bool operator== (const visited_value& other) const
+        {
+            return pos == other.pos && value == other.value;
+        }
+    };
+
+    std::vector<visited_value> visited;
+
+    auto func = [&visited](size_t pos, const auto& val)
+    {
+        std::ostringstream os;
+        os << val;
+        visited.push_back({pos, os.str()});
+    };
+
+    // Visit all doubles and strings.  The int32 and boolean blocks should
+    // get skipped.
+    db.for_each_value<mtv::double_element_block, mtv::string_element_block>(func);
+    {
+        std::vector<visited_value> expected = {
+            { 1, "1.1" }, { 2, "1.2" }, { 3, "A" }, { 4, "B" }, { 9, "2.1" }, { 10, "2.2" }
+        };
+        assert(visited == expected);
+    }
+
+    // Visit a sub-range, with both ends in the middle of blocks.
+    visited.clear();
+    db.for_each_value<mtv::double_element_block, mtv::boolean_element_block, mtv::int32_element_block>(2, 9, func);
+    {
+        std::vector<visited_value> expected = {
+            { 2, "1.2" }, { 6, "5" }, { 7, "1" }, { 8, "0" }, { 9, "2.1" }
+        };
+        assert(visited == expected);
+    }
+
+    // Range within a single empty block.
+    visited.clear();
+    db.for_each_value<mtv::double_element_block>(11, 11, func);
+    assert(visited.empty());
+
+    // Overloaded function object, with its state returned.
+    struct counter
+    {
+        size_t numeric = 0;
+        size_t string = 0;
+
+        void operator() (size_t, double) { ++numeric; }
+        void operator() (size_t, const std::string&) { ++string; }
+    };
+
+    counter c = db.for_each_value<mtv::double_element_block, mtv::string_element_block>(counter());
+    assert(c.numeric == 4);
+    assert(c.string == 2);
+
+    // Empty container should be a no-op.
+    mtv_type db_empty;
+    c = db_empty.for_each_value<mtv::double_element_block>(counter());
+    assert(c.numeric == 0);
+
+    try
+    {
+        db.for_each_value<mtv::double_element_block>(3, 12, func);
+        assert(!"exception should have been thrown.");
+    }
+    catch (const std::out_of_range&)
+    {
+        // good.
+    }
+
+    try
+    {
+        db.for_each_value<mtv::double_element_block>(4, 3, func);
+        assert(!"exception should have been thrown.");
+    }
+    catch (const std::out_of_range&)
+    {
+        // good.
+    }
+}
+
 void mtv_test_capacity()
 {
     stack_printer __stack_printer__(__FUNCTION__);
@@ -5139,6 +5331,8 @@ int main (int argc, char **argv)
         mtv_test_block_identifier();
         mtv_test_transfer();
         mtv_test_push_back();
+        mtv_test_builder();
+        mtv_test_for_each_value();
         mtv_test_capacity();
         mtv_test_position_type_end_position();
         mtv_test_block_pos_adjustments();
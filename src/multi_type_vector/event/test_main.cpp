@@ -1132,6 +1132,28 @@ void mtv_test_block_counter()
         assert(db2.event_handler().block_count_int8 == 0);
         assert(db2.event_handler().block_count_string == 1);
     }
+
+    {
+        // Element blocks handed over by the builder should be acquired by the
+        // destination container, and its original blocks should be released.
+        mtv_type db(5, int8_t('a'));
+        assert(db.event_handler().block_count == 1);
+        assert(db.event_handler().block_count_int8 == 1);
+
+        mtv_type::builder bd;
+        bd.push_back(1.1);
+        bd.push_back(1.2);
+        bd.push_back_empty(2);
+        bd.push_back(string("A"));
+        bd.push_back(1.3);
+        bd.finalize(db);
+
+        assert(db.size() == 6);
+        assert(db.event_handler().block_count == 3);
+        assert(db.event_handler().block_count_numeric == 2);
+        assert(db.event_handler().block_count_string == 1);
+        assert(db.event_handler().block_count_int8 == 0);
+    }
 }
 
 void mtv_test_block_init()
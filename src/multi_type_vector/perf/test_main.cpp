@@ -117,12 +117,102 @@ void mtv_perf_test_insert_via_position_object()
     }
 }
 
+void mtv_perf_test_element_walk()
+{
+    size_t n_blocks = 2000;
+    size_t block_size = 500;
+
+    // Build a container with alternating numeric and string blocks.
+    mtv_type db;
+    {
+        mtv_type::builder bd;
+        std::vector<double> doubles(block_size, 1.5);
+        std::vector<std::string> strs(block_size, std::string("foo"));
+        for (size_t i = 0; i < n_blocks; ++i)
+        {
+            if (i % 2)
+                bd.push_back(strs.begin(), strs.end());
+            else
+                bd.push_back(doubles.begin(), doubles.end());
+        }
+        bd.finalize(db);
+    }
+
+    double sum1 = 0.0, sum2 = 0.0, sum3 = 0.0;
+    size_t len1 = 0, len2 = 0, len3 = 0;
+
+    {
+        stack_printer __stack_printer__("::mtv_perf_test_element_walk::per-element position object");
+        mtv_type::const_position_type pos = db.position(0);
+        for (; pos.first != db.cend(); pos = mtv_type::next_position(pos))
+        {
+            switch (pos.first->type)
+            {
+                case mtv::element_type_double:
+                    sum1 += mtv_type::get<mtv::double_element_block>(pos);
+                    break;
+                case mtv::element_type_string:
+                    len1 += mtv_type::get<mtv::string_element_block>(pos).size();
+                    break;
+                default:
+                    ;
+            }
+        }
+    }
+
+    {
+        stack_printer __stack_printer__("::mtv_perf_test_element_walk::block iterator with type dispatch");
+        for (const auto& blk : db)
+        {
+            switch (blk.type)
+            {
+                case mtv::element_type_double:
+                {
+                    auto it = mtv::double_element_block::begin(*blk.data);
+                    auto it_end = mtv::double_element_block::end(*blk.data);
+                    for (; it != it_end; ++it)
+                        sum2 += *it;
+                    break;
+                }
+                case mtv::element_type_string:
+                {
+                    auto it = mtv::string_element_block::begin(*blk.data);
+                    auto it_end = mtv::string_element_block::end(*blk.data);
+                    for (; it != it_end; ++it)
+                        len2 += it->size();
+                    break;
+                }
+                default:
+                    ;
+            }
+        }
+    }
+
+    {
+        stack_printer __stack_printer__("::mtv_perf_test_element_walk::for_each_value");
+        struct visitor
+        {
+            double& sum;
+            size_t& len;
+
+            void operator() (size_t, double v) { sum += v; }
+            void operator() (size_t, const std::string& v) { len += v.size(); }
+        };
+
+        db.for_each_value<mtv::double_element_block, mtv::string_element_block>(visitor{sum3, len3});
+    }
+
+    assert(sum1 == sum2 && sum2 == sum3);
+    assert(len1 == len2 && len2 == len3);
+}
+
 }
 
 int main (int argc, char **argv)
 {
     mtv_perf_test_block_position_lookup();
     mtv_perf_test_insert_via_position_object();
+    mtv_perf_test_element_walk();
 
     return EXIT_SUCCESS;
 }
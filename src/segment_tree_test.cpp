@@ -28,6 +28,7 @@
 #include "test_global.hpp" // This must be the first header to be included.
 #include "mdds/segment_tree.hpp"
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstdio>
 #include <iostream>
@@ -795,6 +796,26 @@ void st_test_perf_insertion()
         }
     }
 
+    {
+        stack_printer __stack_printer2__("::st_test_perf_insertion:: 200 searches with median results (visitor)");
+        for (key_type i = 0; i < 200; ++i)
+        {
+            db.search(data_count/2, [&test](const test_data* p)
+            {
+                test = p;
+                assert(test);
+            });
+        }
+    }
+
+    {
+        stack_printer __stack_printer2__("::st_test_perf_insertion:: 200000 counts with median results");
+        size_t n = 0;
+        for (key_type i = 0; i < 200000; ++i)
+            n += db.count(data_count/2 + i % 100);
+        assert(n > 0);
+    }
+
     {
         stack_printer __stack_printer2__("::st_test_perf_insertion:: 10000 segment removals");
         for (key_type i = 0; i < 10000; ++i)
@@ -811,6 +832,261 @@ void st_test_perf_insertion()
     }
 }
 
+void st_test_perf_incremental_insert()
+{
+    stack_printer __stack_printer__("::st_test_perf_incremental_insert");
+
+    typedef uint32_t key_type;
+    typedef test_data value_type;
+    typedef segment_tree<key_type, value_type*> db_type;
+
+    key_type data_count = 50000;
+    key_type insert_count = 50;
+
+    vector<unique_ptr<test_data>> data_store;
+    data_store.reserve(data_count + insert_count);
+    for (key_type i = 0; i < data_count + insert_count; ++i)
+    {
+        ostringstream os;
+        os << hex << i;
+        data_store.emplace_back(new test_data(os.str()));
+    }
+
+    db_type db1, db2;
+    for (key_type i = 0; i < data_count; ++i)
+    {
+        db1.insert(i, i + 20, data_store[i].get());
+        db2.insert(i, i + 20, data_store[i].get());
+    }
+    db1.build_tree();
+    db2.build_tree();
+    db2.set_incremental_insert(true);
+
+    size_t hits1 = 0, hits2 = 0;
+    {
+        stack_printer __stack_printer2__("::st_test_perf_incremental_insert:: insert and re-build");
+        for (key_type i = 0; i < insert_count; ++i)
+        {
+            key_type pos = (i * 197) % data_count;
+            db1.insert(pos, pos + 30 + i % 7, data_store[data_count + i].get());
+            db1.build_tree();
+            hits1 += db1.search(pos + 1).size();
+        }
+    }
+
+    {
+        stack_printer __stack_printer2__("::st_test_perf_incremental_insert:: incremental insert");
+        for (key_type i = 0; i < insert_count; ++i)
+        {
+            key_type pos = (i * 197) % data_count;
+            db2.insert(pos, pos + 30 + i % 7, data_store[data_count + i].get());
+            hits2 += db2.search(pos + 1).size();
+        }
+    }
+
+    assert(hits1 == hits2);
+}
+
+void st_test_perf_search_many()
+{
+    stack_printer __stack_printer__("::st_test_perf_search_many");
+
+    typedef uint32_t key_type;
+    typedef test_data value_type;
+    typedef segment_tree<key_type, value_type*> db_type;
+
+    key_type data_count = 200000;
+    key_type key_count = 50000;
+
+    vector<unique_ptr<test_data>> data_store;
+    data_store.reserve(data_count);
+    db_type db;
+    for (key_type i = 0; i < data_count; ++i)
+    {
+        ostringstream os;
+        os << hex << i;
+        data_store.emplace_back(new test_data(os.str()));
+        key_type begin_key = (i * 7919) % (data_count * 4);
+        db.insert(begin_key, begin_key + 1 + i % 64, data_store.back().get());
+    }
+    db.build_tree();
+
+    std::vector<key_type> keys;
+    keys.reserve(key_count);
+    for (key_type i = 0; i < key_count; ++i)
+        keys.push_back((i * 104729) % (data_count * 4));
+
+    size_t hits1 = 0, hits2 = 0;
+    {
+        stack_printer __stack_printer2__("::st_test_perf_search_many:: one search per point");
+        for (key_type key : keys)
+            hits1 += db.count(key);
+    }
+
+    {
+        stack_printer __stack_printer2__("::st_test_perf_search_many:: search_many");
+        db.search_many(keys.begin(), keys.end(), [&hits2](size_t, const value_type*) { ++hits2; });
+    }
+
+    assert(hits1 == hits2);
+}
+
+void st_test_perf_freeze()
+{
+    stack_printer __stack_printer__("::st_test_perf_freeze");
+
+    typedef uint32_t key_type;
+    typedef test_data value_type;
+    typedef segment_tree<key_type, value_type*> db_type;
+
+    key_type data_count = 500000;
+    key_type query_count = 1000000;
+
+    vector<unique_ptr<test_data>> data_store;
+    data_store.reserve(data_count);
+    db_type db;
+    for (key_type i = 0; i < data_count; ++i)
+    {
+        ostringstream os;
+        os << hex << i;
+        data_store.emplace_back(new test_data(os.str()));
+        key_type begin_key = (i * 7919) % (data_count * 4);
+        db.insert(begin_key, begin_key + 1 + i % 256, data_store.back().get());
+    }
+    db.build_tree();
+
+    db_type::frozen_type frozen;
+    {
+        stack_printer __stack_printer2__("::st_test_perf_freeze:: freeze");
+        frozen = db.freeze();
+    }
+
+    size_t hits1 = 0, hits2 = 0;
+    {
+        stack_printer __stack_printer2__("::st_test_perf_freeze:: search on tree");
+        for (key_type i = 0; i < query_count; ++i)
+            db.search((i * 104729) % (data_count * 4), [&hits1](const value_type*) { ++hits1; });
+    }
+
+    {
+        stack_printer __stack_printer2__("::st_test_perf_freeze:: search on frozen");
+        for (key_type i = 0; i < query_count; ++i)
+            frozen.search((i * 104729) % (data_count * 4), [&hits2](const value_type*) { ++hits2; });
+    }
+
+    cout << "hits: " << hits1 << " " << hits2 << endl;
+    assert(hits1 == hits2);
+}
+
+void st_test_perf_lazy_removal()
+{
+    stack_printer __stack_printer__("::st_test_perf_lazy_removal");
+
+    typedef uint32_t key_type;
+    typedef test_data value_type;
+    typedef segment_tree<key_type, value_type*> db_type;
+
+    key_type data_count = 500000;
+    key_type remove_count = 50000;
+
+    vector<unique_ptr<test_data>> data_store;
+    data_store.reserve(data_count);
+    db_type db1, db2;
+    db2.set_lazy_removal(true);
+    for (key_type i = 0; i < data_count; ++i)
+    {
+        ostringstream os;
+        os << hex << i;
+        data_store.emplace_back(new test_data(os.str()));
+        key_type begin_key = (i * 7919) % (data_count * 4);
+        db1.insert(begin_key, begin_key + 1 + i % 256, data_store.back().get());
+        db2.insert(begin_key, begin_key + 1 + i % 256, data_store.back().get());
+    }
+
+    {
+        stack_printer __stack_printer2__("::st_test_perf_lazy_removal:: build tree with node lists");
+        db1.build_tree();
+    }
+
+    {
+        stack_printer __stack_printer2__("::st_test_perf_lazy_removal:: build tree without node lists");
+        db2.build_tree();
+    }
+
+    {
+        stack_printer __stack_printer2__("::st_test_perf_lazy_removal:: removal via node lists");
+        for (key_type i = 0; i < remove_count; ++i)
+            db1.remove(data_store[(i * 13) % data_count].get());
+    }
+
+    {
+        stack_printer __stack_printer2__("::st_test_perf_lazy_removal:: lazy removal");
+        for (key_type i = 0; i < remove_count; ++i)
+            db2.remove(data_store[(i * 13) % data_count].get());
+    }
+
+    size_t hits1 = 0, hits2 = 0;
+    for (key_type i = 0; i < 100000; ++i)
+    {
+        hits1 += db1.count((i * 104729) % (data_count * 4));
+        hits2 += db2.count((i * 104729) % (data_count * 4));
+    }
+
+    cout << "hits: " << hits1 << " " << hits2 << endl;
+    assert(hits1 == hits2);
+}
+
+void st_test_perf_indexed()
+{
+    stack_printer __stack_printer__("::st_test_perf_indexed");
+
+    typedef uint32_t key_type;
+    typedef segment_tree<key_type, size_t> db_type;
+    typedef indexed_segment_tree<key_type, size_t> indexed_db_type;
+
+    key_type data_count = 500000;
+    key_type query_count = 1000000;
+
+    db_type db1;
+    indexed_db_type db2;
+
+    {
+        stack_printer __stack_printer2__("::st_test_perf_indexed:: insert and build (segment_tree)");
+        for (key_type i = 0; i < data_count; ++i)
+        {
+            key_type begin_key = (i * 7919) % (data_count * 4);
+            db1.insert(begin_key, begin_key + 1 + i % 256, i);
+        }
+        db1.build_tree();
+    }
+
+    {
+        stack_printer __stack_printer2__("::st_test_perf_indexed:: insert and build (indexed_segment_tree)");
+        for (key_type i = 0; i < data_count; ++i)
+        {
+            key_type begin_key = (i * 7919) % (data_count * 4);
+            db2.insert(begin_key, begin_key + 1 + i % 256, i);
+        }
+        db2.build_tree();
+    }
+
+    size_t hits1 = 0, hits2 = 0;
+    {
+        stack_printer __stack_printer2__("::st_test_perf_indexed:: search (segment_tree)");
+        for (key_type i = 0; i < query_count; ++i)
+            hits1 += db1.count((i * 104729) % (data_count * 4));
+    }
+
+    {
+        stack_printer __stack_printer2__("::st_test_perf_indexed:: search (indexed_segment_tree)");
+        for (key_type i = 0; i < query_count; ++i)
+            hits2 += db2.count((i * 104729) % (data_count * 4));
+    }
+
+    cout << "hits: " << hits1 << " " << hits2 << endl;
+    assert(hits1 == hits2);
+}
+
 void st_test_aggregated_search_results()
 {
     stack_printer __stack_printer__("::st_test_aggregated_search_results");
@@ -1097,6 +1373,699 @@ void st_test_non_pointer_data()
     assert(*result.begin() == 10);
 }
 
+void st_test_search_range()
+{
+    stack_printer __stack_printer__("::st_test_search_range");
+
+    typedef long key_type;
+    typedef test_data value_type;
+    typedef segment_tree<key_type, value_type*> db_type;
+
+    test_data A("A"), B("B"), C("C"), D("D"), E("E");
+
+    db_type db;
+    db_type::search_result_type result;
+
+    // Searching an invalid tree should fail.
+    assert(!db.search_range(0, 10, result));
+
+    db.insert(0, 10, &A);
+    db.insert(5, 20, &B);
+    db.insert(15, 30, &C);
+    db.insert(-10, 2, &D);
+    db.insert(40, 50, &E);
+    db.build_tree();
+
+    auto check = [&db](key_type begin_key, key_type end_key, std::vector<value_type*> expected)
+    {
+        db_type::search_result_type res;
+        bool success = db.search_range(begin_key, end_key, res);
+        assert(success);
+        sort(res.begin(), res.end(), test_data::sort_by_name());
+        sort(expected.begin(), expected.end(), test_data::sort_by_name());
+        return res == expected;
+    };
+
+    assert(check(0, 1, {&A, &D}));
+    assert(check(2, 5, {&A}));
+    assert(check(9, 16, {&A, &B, &C}));
+    assert(check(10, 15, {&B}));
+    assert(check(-100, 100, {&A, &B, &C, &D, &E}));
+    assert(check(30, 40, {}));
+    assert(check(49, 60, {&E}));
+    assert(check(50, 60, {}));
+    assert(check(-20, -10, {}));
+
+    // Empty range.
+    assert(!db.search_range(5, 5, result));
+    assert(result.empty());
+
+    // The result gets appended.
+    result.push_back(&A);
+    assert(db.search_range(0, 6, result));
+    assert(result.size() == 4);
+    assert(result[0] == &A);
+
+    // Compare against brute-force overlap checks on random segments.
+    vector<unique_ptr<test_data>> data_store;
+    vector<pair<key_type, key_type>> segments;
+    db_type db2;
+    srand(42);
+    for (size_t i = 0; i < 300; ++i)
+    {
+        ostringstream os;
+        os << i;
+        data_store.emplace_back(new test_data(os.str()));
+        key_type begin_key = rand() % 1000;
+        key_type end_key = begin_key + 1 + rand() % 50;
+        segments.emplace_back(begin_key, end_key);
+        db2.insert(begin_key, end_key, data_store.back().get());
+    }
+    db2.build_tree();
+
+    for (size_t i = 0; i < 500; ++i)
+    {
+        key_type begin_key = rand() % 1100 - 50;
+        key_type end_key = begin_key + 1 + rand() % 100;
+
+        db_type::search_result_type res;
+        assert(db2.search_range(begin_key, end_key, res));
+
+        db_type::search_result_type expected;
+        for (size_t j = 0; j < segments.size(); ++j)
+        {
+            if (segments[j].first < end_key && begin_key < segments[j].second)
+                expected.push_back(data_store[j].get());
+        }
+
+        sort(res.begin(), res.end());
+        sort(expected.begin(), expected.end());
+        assert(res == expected);
+    }
+}
+
+void st_test_incremental_insert()
+{
+    stack_printer __stack_printer__("::st_test_incremental_insert");
+
+    typedef long key_type;
+    typedef test_data value_type;
+    typedef segment_tree<key_type, value_type*> db_type;
+
+    test_data A("A"), B("B"), C("C"), D("D"), E("E");
+
+    db_type db;
+    assert(!db.is_incremental_insert());
+    db.set_incremental_insert(true);
+    assert(db.is_incremental_insert());
+
+    // Insertion into an invalid tree keeps it invalid.
+    db.insert(0, 10, &A);
+    assert(!db.is_tree_valid());
+    db.build_tree();
+    assert(db.is_tree_valid());
+
+    db.insert(20, 30, &B);
+    assert(db.is_tree_valid());
+
+    auto check = [&db](key_type point, std::vector<value_type*> expected)
+    {
+        db_type::search_result_type res;
+        bool success = db.search(point, res);
+        assert(success);
+        sort(res.begin(), res.end(), test_data::sort_by_name());
+        sort(expected.begin(), expected.end(), test_data::sort_by_name());
+        if (res != expected)
+            return false;
+
+        db_type::search_result res2 = db.search(point);
+        if (res2.size() != expected.size())
+            return false;
+
+        db_type::search_result_type res3(res2.begin(), res2.end());
+        sort(res3.begin(), res3.end(), test_data::sort_by_name());
+        return res3 == expected;
+    };
+
+    assert(check(5, {&A}));
+    assert(check(25, {&B}));
+    assert(check(15, {}));
+
+    // Both end points coincide with the existing leaf nodes.
+    db.insert(0, 30, &C);
+    assert(db.is_tree_valid());
+    assert(db.verify_node_lists());
+    assert(check(5, {&A, &C}));
+    assert(check(15, {&C}));
+    assert(check(29, {&B, &C}));
+
+    {
+        db_type::search_result_type res;
+        assert(db.search_range(8, 22, res));
+        sort(res.begin(), res.end(), test_data::sort_by_name());
+        assert((res == db_type::search_result_type{&A, &B, &C}));
+    }
+
+    // Remove segments both from the tree and from the pending buffer.
+    db.insert(-5, 5, &D);
+    db.remove(&B);
+    db.remove(&C);
+    assert(db.is_tree_valid());
+    assert(check(2, {&A, &D}));
+    assert(check(25, {}));
+    assert(db.size() == 2);
+
+    // The result should stay the same after re-building the tree.
+    db.insert(3, 4, &E);
+    db.build_tree();
+    assert(check(2, {&A, &D}));
+    assert(check(3, {&A, &D, &E}));
+
+    // Compare against brute-force searches while inserting random
+    // segments, with periodic re-builds triggered by the pending buffer.
+    vector<unique_ptr<test_data>> data_store;
+    vector<pair<key_type, key_type>> segments;
+    db_type db2;
+    db2.set_incremental_insert(true);
+    db2.build_tree();
+    srand(7);
+    for (size_t i = 0; i < 400; ++i)
+    {
+        ostringstream os;
+        os << i;
+        data_store.emplace_back(new test_data(os.str()));
+        key_type begin_key = rand() % 200;
+        key_type end_key = begin_key + 1 + rand() % 40;
+        segments.emplace_back(begin_key, end_key);
+        db2.insert(begin_key, end_key, data_store.back().get());
+        assert(db2.is_tree_valid());
+
+        key_type point = rand() % 250;
+        db_type::search_result_type res;
+        assert(db2.search(point, res));
+
+        db_type::search_result_type expected;
+        for (size_t j = 0; j < segments.size(); ++j)
+        {
+            if (segments[j].first <= point && point < segments[j].second)
+                expected.push_back(data_store[j].get());
+        }
+
+        sort(res.begin(), res.end());
+        sort(expected.begin(), expected.end());
+        assert(res == expected);
+        assert(db2.search(point).size() == expected.size());
+    }
+
+    // The copy should be identical.
+    db_type db3(db2);
+    assert(db3 == db2);
+    assert(db3.is_incremental_insert());
+}
+
+void st_test_search_visitor()
+{
+    stack_printer __stack_printer__("::st_test_search_visitor");
+
+    typedef long key_type;
+    typedef test_data value_type;
+    typedef segment_tree<key_type, value_type*> db_type;
+
+    test_data A("A"), B("B"), C("C"), D("D");
+
+    db_type db;
+
+    struct collector
+    {
+        std::vector<value_type*> values;
+        void operator() (value_type* p) { values.push_back(p); }
+    };
+
+    // Nothing gets visited or counted on an invalid tree.
+    db.insert(0, 10, &A);
+    assert(db.search(5, collector()).values.empty());
+    assert(db.count(5) == 0);
+
+    db.insert(5, 20, &B);
+    db.insert(8, 9, &C);
+    db.build_tree();
+
+    for (key_type point = -2; point < 22; ++point)
+    {
+        db_type::search_result_type expected;
+        db.search(point, expected);
+
+        std::vector<value_type*> values = db.search(point, collector()).values;
+        sort(values.begin(), values.end());
+        sort(expected.begin(), expected.end());
+        assert(values == expected);
+        assert(db.count(point) == expected.size());
+        assert(db.count(point) == db.search(point).size());
+    }
+
+    assert(db.count(8) == 3);
+    assert(db.count(20) == 0);
+
+    // Pending segments are visited as well.
+    db.set_incremental_insert(true);
+    db.insert(7, 12, &D);
+    assert(db.is_tree_valid());
+    assert(db.count(8) == 4);
+
+    size_t n = 0;
+    db.search(11, [&n](const value_type*) { ++n; });
+    assert(n == 2);
+}
+
+void st_test_search_many()
+{
+    stack_printer __stack_printer__("::st_test_search_many");
+
+    typedef long key_type;
+    typedef test_data value_type;
+    typedef segment_tree<key_type, value_type*> db_type;
+    typedef std::vector<std::vector<value_type*>> results_type;
+
+    struct collector
+    {
+        results_type* results;
+        void operator() (size_t pos, value_type* p) { (*results)[pos].push_back(p); }
+    };
+
+    vector<unique_ptr<test_data>> data_store;
+    db_type db;
+
+    {
+        // Nothing gets visited on an invalid tree.
+        data_store.emplace_back(new test_data("A"));
+        db.insert(0, 10, data_store.back().get());
+        std::vector<key_type> keys = { 1, 2 };
+        results_type results(keys.size());
+        db.search_many(keys.begin(), keys.end(), collector{&results});
+        assert(results[0].empty() && results[1].empty());
+    }
+
+    srand(11);
+    for (size_t i = 1; i < 200; ++i)
+    {
+        ostringstream os;
+        os << i;
+        data_store.emplace_back(new test_data(os.str()));
+        key_type begin_key = rand() % 500;
+        key_type end_key = begin_key + 1 + rand() % 60;
+        db.insert(begin_key, end_key, data_store.back().get());
+    }
+    db.build_tree();
+
+    auto check = [&db](const std::vector<key_type>& keys)
+    {
+        results_type results(keys.size());
+        db.search_many(keys.begin(), keys.end(), collector{&results});
+
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            db_type::search_result_type expected;
+            db.search(keys[i], expected);
+            sort(expected.begin(), expected.end());
+            sort(results[i].begin(), results[i].end());
+            if (results[i] != expected)
+                return false;
+        }
+        return true;
+    };
+
+    // Unsorted points with duplicates and out-of-range values.
+    std::vector<key_type> keys;
+    for (size_t i = 0; i < 1000; ++i)
+        keys.push_back(rand() % 600 - 20);
+    keys.push_back(keys.front());
+    assert(check(keys));
+
+    // Sorted points covering the whole range.
+    keys.clear();
+    for (key_type i = -5; i < 580; ++i)
+        keys.push_back(i);
+    assert(check(keys));
+
+    // No points.
+    keys.clear();
+    assert(check(keys));
+
+    // Segments in the pending buffer.
+    db.set_incremental_insert(true);
+    data_store.emplace_back(new test_data("pending"));
+    db.insert(1001, 1003, data_store.back().get());
+    keys = { 1002, 5, 1001, 1003 };
+    assert(check(keys));
+}
+
+void st_test_freeze()
+{
+    stack_printer __stack_printer__("::st_test_freeze");
+
+    typedef long key_type;
+    typedef test_data value_type;
+    typedef segment_tree<key_type, value_type*> db_type;
+
+    {
+        // Default-constructed instance is empty.
+        db_type::frozen_type frozen;
+        assert(frozen.empty());
+        assert(frozen.count(0) == 0);
+        db_type::search_result_type res;
+        frozen.search(0, res);
+        assert(res.empty());
+    }
+
+    db_type db;
+    test_data A("A");
+    db.insert(0, 10, &A);
+
+    try
+    {
+        // The tree must be valid.
+        db.freeze();
+        assert(!"exception was not thrown");
+    }
+    catch (const mdds::general_error&)
+    {
+        // expected
+    }
+
+    vector<unique_ptr<test_data>> data_store;
+    srand(3);
+    for (size_t i = 0; i < 500; ++i)
+    {
+        ostringstream os;
+        os << i;
+        data_store.emplace_back(new test_data(os.str()));
+        key_type begin_key = rand() % 1000 - 100;
+        key_type end_key = begin_key + 1 + rand() % 100;
+        db.insert(begin_key, end_key, data_store.back().get());
+    }
+    db.build_tree();
+
+    // Add some pending segments too.
+    db.set_incremental_insert(true);
+    for (size_t i = 0; i < 5; ++i)
+    {
+        data_store.emplace_back(new test_data("pending"));
+        db.insert(2000 + i, 2010 + i * 3, data_store.back().get());
+    }
+
+    db_type::frozen_type frozen = db.freeze();
+    assert(frozen.size() == db.size());
+    assert(frozen.node_size() > 0);
+
+    for (key_type point = -120; point < 2050; ++point)
+    {
+        db_type::search_result_type expected, res;
+        db.search(point, expected);
+        frozen.search(point, res);
+        sort(expected.begin(), expected.end());
+        sort(res.begin(), res.end());
+        assert(res == expected);
+        assert(frozen.count(point) == expected.size());
+
+        size_t m = 0;
+        frozen.search(point, [&m](const value_type* p) { assert(p); ++m; });
+        assert(m == expected.size());
+    }
+
+    // The snapshot stays intact after the source gets cleared.
+    db.clear();
+    assert(frozen.count(5) > 0);
+}
+
+void st_test_lazy_removal()
+{
+    stack_printer __stack_printer__("::st_test_lazy_removal");
+
+    typedef long key_type;
+    typedef test_data value_type;
+    typedef segment_tree<key_type, value_type*> db_type;
+
+    test_data A("A"), B("B"), C("C"), D("D");
+
+    db_type db;
+    assert(!db.is_lazy_removal());
+    db.set_lazy_removal(true);
+    assert(db.is_lazy_removal());
+
+    db.insert(0, 10, &A);
+    db.insert(5, 20, &B);
+    db.insert(8, 12, &C);
+    db.build_tree();
+
+    auto check = [&db](key_type point, std::vector<value_type*> expected)
+    {
+        sort(expected.begin(), expected.end());
+
+        db_type::search_result_type res;
+        db.search(point, res);
+        sort(res.begin(), res.end());
+        if (res != expected)
+            return false;
+
+        db_type::search_result res2 = db.search(point);
+        db_type::search_result_type res3(res2.begin(), res2.end());
+        sort(res3.begin(), res3.end());
+        if (res3 != expected || res2.size() != expected.size())
+            return false;
+
+        if (db.count(point) != expected.size())
+            return false;
+
+        db_type::search_result_type res4;
+        db.search(point, [&res4](value_type* p) { res4.push_back(p); });
+        sort(res4.begin(), res4.end());
+        if (res4 != expected)
+            return false;
+
+        db_type::frozen_type frozen = db.freeze();
+        return frozen.count(point) == expected.size();
+    };
+
+    assert(check(9, {&A, &B, &C}));
+
+    // Removal keeps the tree valid, and filters the value out.
+    db.remove(&B);
+    assert(db.is_tree_valid());
+    assert(db.size() == 2);
+    assert(check(9, {&A, &C}));
+    assert(check(15, {}));
+
+    {
+        db_type::search_result_type res;
+        assert(db.search_range(0, 100, res));
+        sort(res.begin(), res.end());
+        db_type::search_result_type expected = {&A, &C};
+        sort(expected.begin(), expected.end());
+        assert(res == expected);
+    }
+
+    {
+        std::vector<key_type> keys = { 9, 15 };
+        size_t n = 0;
+        db.search_many(keys.begin(), keys.end(), [&n](size_t, value_type*) { ++n; });
+        assert(n == 2);
+    }
+
+    // Re-inserting a removed value invalidates the tree.
+    db.insert(15, 18, &B);
+    assert(!db.is_tree_valid());
+    db.build_tree();
+    assert(check(9, {&A, &C}));
+    assert(check(16, {&B}));
+
+    // In incremental mode, the tree gets re-built instead.
+    db.set_incremental_insert(true);
+    db.remove(&C);
+    assert(check(9, {&A}));
+    db.insert(8, 12, &C);
+    assert(db.is_tree_valid());
+    assert(check(9, {&A, &C}));
+
+    // Removal of a pending segment.
+    db.insert(3, 4, &D);
+    assert(check(3, {&A, &D}));
+    db.remove(&D);
+    assert(check(3, {&A}));
+
+    // Disabling lazy removal invalidates the tree, and the node lists get
+    // re-created on the next build.
+    db.set_lazy_removal(false);
+    assert(!db.is_tree_valid());
+    db.build_tree();
+    db.remove(&A);
+    assert(check(9, {&C}));
+
+    // Compare against brute-force searches with many removals, which
+    // trigger automatic re-builds along the way.
+    vector<unique_ptr<test_data>> data_store;
+    vector<pair<key_type, key_type>> segments;
+    vector<bool> removed;
+    db_type db2;
+    db2.set_lazy_removal(true);
+    srand(5);
+    for (size_t i = 0; i < 300; ++i)
+    {
+        ostringstream os;
+        os << i;
+        data_store.emplace_back(new test_data(os.str()));
+        key_type begin_key = rand() % 300;
+        key_type end_key = begin_key + 1 + rand() % 50;
+        segments.emplace_back(begin_key, end_key);
+        removed.push_back(false);
+        db2.insert(begin_key, end_key, data_store.back().get());
+    }
+    db2.build_tree();
+
+    for (size_t i = 0; i < 250; ++i)
+    {
+        size_t pos = rand() % segments.size();
+        db2.remove(data_store[pos].get());
+        removed[pos] = true;
+        assert(db2.is_tree_valid());
+
+        key_type point = rand() % 360;
+        db_type::search_result_type res, expected;
+        db2.search(point, res);
+        for (size_t j = 0; j < segments.size(); ++j)
+        {
+            if (!removed[j] && segments[j].first <= point && point < segments[j].second)
+                expected.push_back(data_store[j].get());
+        }
+
+        sort(res.begin(), res.end());
+        sort(expected.begin(), expected.end());
+        assert(res == expected);
+        assert(db2.count(point) == expected.size());
+    }
+}
+
+void st_test_indexed()
+{
+    stack_printer __stack_printer__("::st_test_indexed");
+
+    typedef long key_type;
+    typedef indexed_segment_tree<key_type, std::string> db_type;
+
+    db_type db;
+    assert(db.empty());
+
+    // Values don't need to be unique.
+    db_type::id_type id0 = db.insert(0, 10, "A");
+    db_type::id_type id1 = db.insert(5, 20, "A");
+    db_type::id_type id2 = db.insert(8, 9, "B");
+    assert(id0 == 0 && id1 == 1 && id2 == 2);
+    assert(db.size() == 3);
+    assert(db.get_segment(id1).begin_key == 5);
+    assert(db.get_segment(id1).end_key == 20);
+    assert(db.get_segment(id1).value == "A");
+
+    try
+    {
+        db.insert(3, 3, "C");
+        assert(!"exception was not thrown");
+    }
+    catch (const mdds::invalid_arg_error&)
+    {
+        // expected
+    }
+
+    db_type::search_result_type res;
+    assert(!db.is_tree_valid());
+    assert(!db.search(5, res));
+    assert(db.count(5) == 0);
+
+    db.build_tree();
+    assert(db.is_tree_valid());
+
+    auto check = [&db](key_type point, db_type::search_result_type expected)
+    {
+        db_type::search_result_type ids;
+        bool success = db.search(point, ids);
+        assert(success);
+        sort(ids.begin(), ids.end());
+        return ids == expected && db.count(point) == expected.size();
+    };
+
+    assert(check(-1, {}));
+    assert(check(0, {0}));
+    assert(check(5, {0, 1}));
+    assert(check(8, {0, 1, 2}));
+    assert(check(9, {0, 1}));
+    assert(check(10, {1}));
+    assert(check(19, {1}));
+    assert(check(20, {}));
+
+    // Removal keeps the tree valid.
+    db.remove(id0);
+    db.remove(id0);
+    assert(db.is_removed(id0));
+    assert(db.is_tree_valid());
+    assert(db.size() == 2);
+    assert(check(8, {1, 2}));
+
+    size_t n = 0;
+    db.search(8, [&n](db_type::id_type) { ++n; });
+    assert(n == 2);
+
+    // The removed segment stays out after the re-build.
+    db.build_tree();
+    assert(check(0, {}));
+    assert(check(8, {1, 2}));
+
+    try
+    {
+        db.remove(100);
+        assert(!"exception was not thrown");
+    }
+    catch (const std::out_of_range&)
+    {
+        // expected
+    }
+
+    db.clear();
+    assert(db.empty());
+    assert(db.insert(1, 2, "C") == 0);
+
+    // Compare against brute-force searches.
+    std::vector<pair<key_type, key_type>> segments;
+    db_type db2;
+    srand(9);
+    for (size_t i = 0; i < 500; ++i)
+    {
+        key_type begin_key = rand() % 1000 - 100;
+        key_type end_key = begin_key + 1 + rand() % 80;
+        segments.emplace_back(begin_key, end_key);
+        db2.insert(begin_key, end_key, std::string());
+    }
+    for (size_t i = 0; i < 50; ++i)
+        db2.remove(rand() % segments.size());
+
+    db2.build_tree();
+
+    for (size_t i = 0; i < 50; ++i)
+        db2.remove(rand() % segments.size());
+
+    for (key_type point = -120; point < 1000; ++point)
+    {
+        db_type::search_result_type expected;
+        for (size_t j = 0; j < segments.size(); ++j)
+        {
+            if (!db2.is_removed(j) && segments[j].first <= point && point < segments[j].second)
+                expected.push_back(j);
+        }
+        db_type::search_result_type ids;
+        db2.search(point, ids);
+        sort(ids.begin(), ids.end());
+        assert(ids == expected);
+        assert(db2.count(point) == expected.size());
+    }
+}
+
 int main(int argc, char** argv)
 {
     try
@@ -1120,11 +2089,23 @@ int main(int argc, char** argv)
             st_test_search_iterator_result_check();
             st_test_empty_result_set();
             st_test_non_pointer_data();
+            st_test_search_range();
+            st_test_incremental_insert();
+            st_test_search_visitor();
+            st_test_search_many();
+            st_test_freeze();
+            st_test_lazy_removal();
+            st_test_indexed();
         }
 
         if (opt.test_perf)
         {
             st_test_perf_insertion();
+            st_test_perf_incremental_insert();
+            st_test_perf_search_many();
+            st_test_perf_freeze();
+            st_test_perf_lazy_removal();
+            st_test_perf_indexed();
         }
 
         // At this point, all of the nodes created during the test run should have